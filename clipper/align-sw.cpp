@@ -1,23 +1,96 @@
-///A tutorial about local alignments.
-#include <iostream>
-#include <seqan/align.h>
+/*
+$Id$
 
-using namespace seqan;
+Smith-Waterman local alignment of two sequences, see sw-lib.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "sw-lib.h"
+
+void usage(FILE *f);
 
 int main(int argc, char **argv)
 {
-///Example 1: This program applies the Smith-Waterman algorithm to compute the best local alignment between two given sequences.
-	if (argc < 3) {
-		fprintf(stderr, "usage: align-sw <seq1> <seq2>\n");
-		exit(1);
+	int match=3, mismatch=-3, gap_open=-2, gap_ext=-2;
+	int min_score=0;
+	bool all=false;
+
+	char c;
+	while ( (c = getopt(argc, argv, "ham:x:o:e:s:")) != -1) {
+		switch (c) {
+			case 'h': usage(stdout); return 0;
+			case 'a': all=true; break;
+			case 'm': match=atoi(optarg); break;
+			case 'x': mismatch=-abs(atoi(optarg)); break;
+			case 'o': gap_open=-abs(atoi(optarg)); break;
+			case 'e': gap_ext=-abs(atoi(optarg)); break;
+			case 's': min_score=atoi(optarg); break;
+			case '?':
+				usage(stderr);
+				return 1;
+		}
 	}
 
-	Align< String<char> > ali;
-	appendValue(rows(ali), argv[1]);
-	appendValue(rows(ali), argv[2]);
-    ::std::cout << "Score = " << localAlignment(ali, Score<int>(3,-3,-2, -2), SmithWaterman()) << ::std::endl;
-	::std::cout << ali;
-	::std::cout << "Aligns Seq1[" << clippedBeginPosition(row(ali, 0)) << ":" << (clippedEndPosition(row(ali, 0))-1) << "]";
-	::std::cout << " and Seq2[" << clippedBeginPosition(row(ali, 1)) << ":" <<  (clippedEndPosition(row(ali, 1))-1) << "]" << ::std::endl << ::std::endl;
+	if (argc-optind < 2) {
+		usage(stderr);
+		return 1;
+	}
+
+	const char *q = argv[optind];
+	const char *t = argv[optind+1];
+	int tlen = strlen(t);
+
+	sw_profile prof(q, match, mismatch, gap_ext, gap_open);
+
+	std::vector<sw_hit> hits;
+	if (all) {
+		prof.hits(t, tlen, min_score > 0 ? min_score : 1, hits);
+	} else {
+		sw_hit h;
+		if (prof.align(t, tlen, h) && h.score >= min_score)
+			hits.push_back(h);
+	}
+
+	if (hits.empty()) {
+		printf("Score = 0\n\n");
+		return 0;
+	}
+
+	int i;
+	for (i=0;i<hits.size();++i) {
+		const sw_hit &h = hits[i];
+		std::string qrow, trow, mrow;
+		prof.trace(t, h, qrow, trow);
+		int j;
+		for (j=0;j<qrow.size();++j)
+			mrow += qrow[j]==trow[j] ? '|' : ' ';
+		printf("Score = %d\n", h.score);
+		printf("%s\n%s\n%s\n", qrow.c_str(), mrow.c_str(), trow.c_str());
+		printf("Aligns Seq1[%d:%d] and Seq2[%d:%d]\n\n", h.qbeg, h.qend-1, h.tbeg, h.tend-1);
+	}
 	return 0;
 }
+
+void usage(FILE *f) {
+	fprintf(f,
+"Usage: align-sw [options] <seq1> <seq2>\n"
+"\n"
+"Local alignment of seq1 against seq2.  Positions are 0-based, inclusive.\n"
+"\n"
+"Options:\n"
+"-m N   match score (3)\n"
+"-x N   mismatch penalty (3)\n"
+"-o N   gap open penalty (2)\n"
+"-e N   gap extend penalty (2)\n"
+"-s N   minimum score to report (1 with -a)\n"
+"-a     all non-overlapping alignments in seq2, best first\n"
+"\n"
+"A gap of length k costs open + (k-1) * extend.\n"
+	);
+}
@@ -42,9 +42,18 @@ void usage(FILE *f) {
 "	-e	save all equal alignments\n"
 "	-m	save equal only if edit distance is smaller\n"
 "	-f	bam file to filter input against\n"
+"	-q	all inputs are name sorted (samtools sort -n), merge instead of hashing\n"
+"	-Q	same as -q, but sorted by plain string compare (picard)\n"
+"	-p INT	unsorted, spill to INT hash partitions on disk instead of hashing in memory\n"
+"	-T DIR	directory for -p files (TMPDIR or /tmp)\n"
 "\n"
 "For each read in the input bam, searches all the filters.  If an analogous read in a filter has\n"
 "a higher mapping quality, then the read from the input bam is discarded.\n"
+"\n"
+"By default the filters are read into a hash of read names, which for large filters can be\n"
+"more memory than you have.  With -q the input and filters are read together, in one pass,\n"
+"using next to no memory.  With -p, names are written out to partition files, and each\n"
+"partition is hashed on its own, the input is read twice.  All give the same output.\n"
 "\n"
         ,f);
 }
@@ -57,7 +66,10 @@ void usage(FILE *f) {
 #include <math.h>
 #include <sys/stat.h>
 
+#include <stdint.h>
+
 #include <string>
+#include <vector>
 #include <sparsehash/sparse_hash_map> // or sparse_hash_set, dense_hash_map, ...
 
 #include <api/BamReader.h>
@@ -73,17 +85,69 @@ public:
 };
 
 #define MAX_F 128
+#define SPILL_MAX 512
+
+// what happens to an input alignment
+enum {F_MISSING, F_BETTER, F_EQ_SAVED, F_EQ_REMOVED, F_REMOVED, F_NCAT};
 
 void usage(FILE *f);
+static void fold(mapq &m, bool &have, const BamAlignment &al);
+static int judge(int mq, int nm, const mapq *f);
+static int strnum_cmp(const char *_a, const char *_b);
+
+typedef int (*name_cmp)(const char *, const char *);
+
+// a filter in name order, for merge joins
+class fcursor {
+public:
+	const char *path;
+	BamReader bam;
+	BamAlignment al;
+	bool more;
+	std::string last;
+	name_cmp cmp;
+
+	void next();
+};
+
+// hash partitions on disk: name, mapq and edit distance, in the order written
+class spill {
+	std::string dir;
+	int n;
+	std::vector<FILE *> f;
+	FILE *open(char tag, int k, const char *mode);
+public:
+	spill(const char *d, int parts) {dir=d; n=parts;}
+	int part(const std::string &name);
+	std::string path(char tag, int k);
+	void begin(char tag, const char *mode);
+	FILE *at(int k) {return f[k];}
+	void end(char tag, bool rm);
+	void clean();
+	static void put(FILE *f, const std::string &name, int mq, int nm);
+	static bool get(FILE *f, std::string &name, int &mq, int &nm);
+};
 
 int debug=0;
+int saveeq = 0, savenm = 0;
+
+// partition files are removed on any exit, not just a clean one
+static spill *spilled = NULL;
+static void spill_cleanup() {
+	if (spilled)
+		spilled->clean();
+}
+
 int main(int argc, char **argv) {
   char c, *in=NULL, *out=NULL, *err=NULL, *bad=NULL, trimchar = '\0';
 	char *filter[MAX_F];
-	int nfilter = 0, saveeq = 0, savenm = 0;
+	int nfilter = 0, nspill = 0;
+	name_cmp sorted = NULL;
+	const char *tmpdir = getenv("TMPDIR");
+	if (!tmpdir || !*tmpdir) tmpdir = "/tmp";
 
 
-        while ( (c = getopt (argc, argv, "demo:i:s:f:b:t:")) != -1) {
+        while ( (c = getopt (argc, argv, "demqQo:i:s:f:b:t:p:T:")) != -1) {
                 switch (c) {
                 case 'd': ++debug; break;
                 case 'b': bad=optarg; break;
@@ -93,6 +157,15 @@ int main(int argc, char **argv) {
                 case 'i': in=optarg; break;
                 case 't': trimchar=*optarg; break;
                 case 's': err=optarg; break;
+                case 'q': sorted=strnum_cmp; break;
+                case 'Q': sorted=strcmp; break;
+                case 'p': nspill=atoi(optarg);
+			  if (nspill < 1 || nspill > SPILL_MAX) {
+				fprintf(stderr, "Partitions (-p) must be from 1 to %d\n", SPILL_MAX);
+				return 1;
+			  }
+			  break;
+                case 'T': tmpdir=optarg; break;
                 case 'h': usage(stdout); return 0;
 		case 'f': filter[nfilter++]=optarg;
 			  if (nfilter >= MAX_F) {
@@ -103,7 +176,7 @@ int main(int argc, char **argv) {
                 case '?':
 		     if (optopt == '?') {
                 	usage(stdout); return 0;
-                     } else if (optopt && strchr("oisft", optopt))
+                     } else if (optopt && strchr("oisftbpT", optopt))
                        fprintf (stderr, "Option -%c requires an argument.\n", optopt);
                      else if (isprint(optopt))
                        fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -123,6 +196,20 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
+	if (sorted && nspill) {
+		fprintf(stderr, "Options -q/-Q and -p can't be used together\n");
+		return 1;
+	}
+
+	// the input is read twice, so it has to be a file, and that's known before anything is spilled
+	if (nspill) {
+		struct stat st;
+		if (!in || !strcmp(in, "-") || stat(in, &st) || !S_ISREG(st.st_mode)) {
+			fprintf(stderr, "Input '%s' can't be read twice, -p needs a file, not a pipe\n", in ? in : "stdin");
+			return 1;
+		}
+	}
+
 	FILE *ferr=stderr;
 	if (err) {
 		fprintf(stderr,"Opening %s\n",err);
@@ -134,38 +221,131 @@ int main(int argc, char **argv) {
 
 	// options are done
 	BamReader inbam;
-	if ( !inbam.Open(in) ) {
+	if ( !inbam.Open(in ? in : "-") ) {
         	fprintf(stderr, "Error reading '%s': %s\n", in, strerror(errno));	
 		return 1;
 	}
 
-
 	google::sparse_hash_map<std::string, mapq> pmap;
+	std::vector<fcursor *> fcur;
+	static spill sp(tmpdir, nspill);	// static, the exit handler runs after main returns
 	int i;
-	for (i=0;i<nfilter;++i) {
-		BamReader fbam;
-		if ( !fbam.Open(filter[i]) ) {
-			fprintf(stderr, "Error reading '%s': %s\n", filter[i], strerror(errno));
-			return 1;
+
+	if (nspill) {
+		spilled = &sp;
+		atexit(spill_cleanup);
+	}
+
+	if (sorted) {
+		// merge join: each filter is stepped forward to the input's read names as they come
+		for (i=0;i<nfilter;++i) {
+			fcursor *c = new fcursor;
+			c->path = filter[i];
+			c->cmp = sorted;
+			if ( !c->bam.Open(filter[i]) ) {
+				fprintf(stderr, "Error reading '%s': %s\n", filter[i], strerror(errno));
+				return 1;
+			}
+			c->more = c->bam.GetNextAlignment(c->al);
+			fcur.push_back(c);
+		}
+	} else if (nspill) {
+		// spill filter names to partitions
+		sp.begin('f', "w");
+		for (i=0;i<nfilter;++i) {
+			BamReader fbam;
+			if ( !fbam.Open(filter[i]) ) {
+				fprintf(stderr, "Error reading '%s': %s\n", filter[i], strerror(errno));
+				return 1;
+			}
+			if (debug) fprintf(stderr, "Spilling '%s'\n",filter[i]);
+			BamAlignment al;
+			while ( fbam.GetNextAlignment(al) ) {
+				int nm = 0;
+				al.GetTag("NM",nm);
+				spill::put(sp.at(sp.part(al.Name)), al.Name, al.MapQuality, nm);
+			}
 		}
-		if (debug) fprintf(stderr, "Indexing '%s'\n",filter[i]);
-		google::sparse_hash_map<std::string,mapq>::iterator it; 
+		sp.end('f', false);
+	} else {
+		for (i=0;i<nfilter;++i) {
+			BamReader fbam;
+			if ( !fbam.Open(filter[i]) ) {
+				fprintf(stderr, "Error reading '%s': %s\n", filter[i], strerror(errno));
+				return 1;
+			}
+			if (debug) fprintf(stderr, "Indexing '%s'\n",filter[i]);
+			BamAlignment al;
+			while ( fbam.GetNextAlignment(al) ) {
+				google::sparse_hash_map<std::string,mapq>::iterator it = pmap.find(al.Name);
+				if (it == pmap.end()) {
+					bool have = false;
+					fold(pmap[al.Name], have, al);
+				} else {
+					bool have = true;
+					fold(it->second, have, al);
+				}
+			}
+		}
+	}
+
+	if (nspill) {
+		// spill input names, then judge each partition against its share of the filters
+		// the verdicts are a byte per alignment, in input order within a partition
 		BamAlignment al;
-		while ( fbam.GetNextAlignment(al) ) {
-			it = pmap.find(al.Name);
+		sp.begin('i', "w");
+		while ( inbam.GetNextAlignment(al) ) {
+			int nm = 0;
+			al.GetTag("NM",nm);
+			spill::put(sp.at(sp.part(al.Name)), al.Name, al.MapQuality, nm);
+		}
+		sp.end('i', false);
 
-			mapq m;
-			m.mq = al.MapQuality;
-			al.GetTag("NM",m.nm);
+		if ( !inbam.Rewind() ) {
+			fprintf(stderr, "Error rewinding '%s', -p needs a file, not a pipe\n", in ? in : "stdin");
+			return 1;
+		}
 
-			if (it == pmap.end()) {
-				pmap[al.Name]=m;
-			} else {
-				if (al.MapQuality > it->second.mq) {
-					pmap[al.Name]=m;
+		int k;
+		std::string name;
+		int mq, nm;
+		for (k=0;k<nspill;++k) {
+			if (debug) fprintf(stderr, "Partition %d\n", k);
+			FILE *ff = fopen(sp.path('f', k).c_str(), "r");
+			FILE *fi = fopen(sp.path('i', k).c_str(), "r");
+			FILE *fd = fopen(sp.path('d', k).c_str(), "w");
+			if (!ff || !fi || !fd) {
+				fprintf(stderr, "Error opening partition %d in '%s': %s\n", k, tmpdir, strerror(errno));
+				return 1;
+			}
+			pmap.clear();
+			while (spill::get(ff, name, mq, nm)) {
+				google::sparse_hash_map<std::string,mapq>::iterator it = pmap.find(name);
+				if (it == pmap.end()) {
+					mapq m;
+					m.mq = mq; m.nm = nm;
+					pmap[name] = m;
+				} else if (mq > it->second.mq) {
+					it->second.mq = mq; it->second.nm = nm;
 				}
 			}
+			while (spill::get(fi, name, mq, nm)) {
+				google::sparse_hash_map<std::string,mapq>::iterator it = pmap.find(name);
+				if (fputc(judge(mq, nm, it == pmap.end() ? NULL : &it->second), fd) == EOF)
+					break;
+			}
+			fclose(ff);
+			fclose(fi);
+			bool bad = ferror(fd);
+			if (fclose(fd) || bad) {
+				fprintf(stderr, "Error writing partition %d in '%s': %s\n", k, tmpdir, strerror(errno));
+				return 1;
+			}
+			unlink(sp.path('f', k).c_str());
+			unlink(sp.path('i', k).c_str());
 		}
+		pmap.clear();
+		sp.begin('d', "r");
 	}
 
 	SamHeader header = inbam.GetHeader();
@@ -179,7 +359,7 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 	
-	if ( !badwriter.Open(bad, header, references) ) {
+	if ( bad && !badwriter.Open(bad, header, references) ) {
                 fprintf(stderr, "Error writing '%s': %s", bad, strerror(errno));
 		return 1;
 	}
@@ -187,53 +367,62 @@ int main(int argc, char **argv) {
 	google::sparse_hash_map<std::string,mapq>::iterator it; 
 	BamAlignment al;
 	if (debug) fprintf(stderr, "Filtering\n");
-	int na=0, gt=0, eq=0, lt=0, to=0, eq_r=0, eq_s=0;
+	int to=0, cnt[F_NCAT];
+	memset(cnt, 0, sizeof(cnt));
+	std::string name;
+	mapq m;
+	bool have = false;
 
 	while ( inbam.GetNextAlignment(al) ) {
 		++to;
 		try {
-			it = pmap.find(al.Name);
-			if (it == pmap.end()) {
-				// not found?
-				writer.SaveAlignment(al);
-				++na;
-			} else if (al.MapQuality > it->second.mq) {
-				// gt
-				++gt;
-				writer.SaveAlignment(al);
-			} else if (al.MapQuality == it->second.mq) {
-				// eq
-				int nm;
+			int k;
+			if (nspill) {
+				k = fgetc(sp.at(sp.part(al.Name)));
+				if (k < 0 || k >= F_NCAT) {
+					fprintf(stderr, "Input changed between passes, or partition files are truncated\n");
+					return 1;
+				}
+			} else {
+				int nm = 0;
 				al.GetTag("NM",nm);
-				if (nm < it->second.nm) {
-					// fewer mismatches
-					if (savenm) {
-						writer.SaveAlignment(al);
-						++eq_s;					
-					} else {
-					  badwriter.SaveAlignment(al);
-						++eq_r;					
-					}
-				} else if (nm == it->second.nm) {
-					if (saveeq) {
-						writer.SaveAlignment(al);
-						++eq_s;
-					} else {
-					  badwriter.SaveAlignment(al);
-						++eq_r;					
+				if (sorted) {
+					if (to == 1 || al.Name != name) {
+						if (to > 1 && sorted(al.Name.c_str(), name.c_str()) < 0) {
+							fprintf(stderr, "Input '%s' isn't sorted by name at '%s', see -q, -Q and -p\n", in ? in : "stdin", al.Name.c_str());
+							return 1;
+						}
+						name = al.Name;
+						have = false;
+						for (i=0;i<nfilter;++i) {
+							fcursor &c = *fcur[i];
+							while (c.more && sorted(c.al.Name.c_str(), name.c_str()) < 0)
+								c.next();
+							while (c.more && c.al.Name == name) {
+								fold(m, have, c.al);
+								c.next();
+							}
+						}
 					}
+					k = judge(al.MapQuality, nm, have ? &m : NULL);
 				} else {
-				  badwriter.SaveAlignment(al);
-					++eq_r;					
+					it = pmap.find(al.Name);
+					k = judge(al.MapQuality, nm, it == pmap.end() ? NULL : &it->second);
 				}
-			} else {
-				// lt
-			  badwriter.SaveAlignment(al);
-				++lt;
+			}
+			++cnt[k];
+			if (k == F_MISSING || k == F_BETTER || k == F_EQ_SAVED) {
+				writer.SaveAlignment(al);
+			} else if (bad) {
+				badwriter.SaveAlignment(al);
 			}
 		} catch (...) {
 		}
 	}
+	if (nspill)
+		sp.end('d', true);
+
+	int na=cnt[F_MISSING], gt=cnt[F_BETTER], eq_s=cnt[F_EQ_SAVED], eq_r=cnt[F_EQ_REMOVED], lt=cnt[F_REMOVED];
 	fprintf(ferr,"total\t%d\n",to);
 	fprintf(ferr,"better\t%d\t%2.2f%%\n",gt,100.0*gt/(float)to);
 	if (eq_s > 0) fprintf(ferr,"eq-saved\t%d\t%2.2f%%\n",eq_s,100.0*eq_s/(float)to);
@@ -243,3 +432,142 @@ int main(int argc, char **argv) {
 	return 0;
 }
 
+// keeps the highest mapping quality, with the edit distance of the first alignment that had it
+static void fold(mapq &m, bool &have, const BamAlignment &al) {
+	if (have && al.MapQuality <= m.mq)
+		return;
+	m.mq = al.MapQuality;
+	m.nm = 0;
+	al.GetTag("NM",m.nm);
+	have = true;
+}
+
+// f is the best for the read name in the filters, NULL if it's not there
+static int judge(int mq, int nm, const mapq *f) {
+	if (!f)
+		return F_MISSING;
+	if (mq > f->mq)
+		return F_BETTER;
+	if (mq < f->mq)
+		return F_REMOVED;
+	if (nm < f->nm)
+		// fewer mismatches
+		return savenm ? F_EQ_SAVED : F_EQ_REMOVED;
+	if (nm == f->nm)
+		return saveeq ? F_EQ_SAVED : F_EQ_REMOVED;
+	return F_EQ_REMOVED;
+}
+
+void fcursor::next() {
+	last = al.Name;
+	more = bam.GetNextAlignment(al);
+	if (more && cmp(al.Name.c_str(), last.c_str()) < 0) {
+		fprintf(stderr, "Filter '%s' isn't sorted by name at '%s', see -q, -Q and -p\n", path, al.Name.c_str());
+		exit(1);
+	}
+}
+
+// same order as samtools sort -n
+static int strnum_cmp(const char *_a, const char *_b)
+{
+	const unsigned char *a = (const unsigned char*)_a, *b = (const unsigned char*)_b;
+	const unsigned char *pa = a, *pb = b;
+	while (*pa && *pb) {
+		if (isdigit(*pa) && isdigit(*pb)) {
+			while (*pa == '0') ++pa;
+			while (*pb == '0') ++pb;
+			while (isdigit(*pa) && isdigit(*pb) && *pa == *pb) ++pa, ++pb;
+			if (isdigit(*pa) && isdigit(*pb)) {
+				int i = 0;
+				while (isdigit(pa[i]) && isdigit(pb[i])) ++i;
+				return isdigit(pa[i])? 1 : isdigit(pb[i])? -1 : (int)*pa - (int)*pb;
+			} else if (isdigit(*pa)) return 1;
+			else if (isdigit(*pb)) return -1;
+			else if (pa - a != pb - b) return pa - a < pb - b? 1 : -1;
+		} else {
+			if (*pa != *pb) return (int)*pa - (int)*pb;
+			++pa; ++pb;
+		}
+	}
+	return *pa? 1 : *pb? -1 : 0;
+}
+
+// fnv-1a
+int spill::part(const std::string &name) {
+	uint32_t h = 2166136261U;
+	int i;
+	for (i=0;i<name.size();++i) {
+		h ^= (unsigned char) name[i];
+		h *= 16777619U;
+	}
+	return h % n;
+}
+
+std::string spill::path(char tag, int k) {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "/bam-filter.%d.%c.%d", (int) getpid(), tag, k);
+	return dir + buf;
+}
+
+void spill::begin(char tag, const char *mode) {
+	f.assign(n, (FILE *) NULL);
+	int k;
+	for (k=0;k<n;++k) {
+		if (!(f[k] = fopen(path(tag, k).c_str(), mode))) {
+			fprintf(stderr, "Error opening '%s': %s\n", path(tag, k).c_str(), strerror(errno));
+			exit(1);
+		}
+	}
+}
+
+void spill::end(char tag, bool rm) {
+	int k;
+	for (k=0;k<n;++k) {
+		bool bad = ferror(f[k]);
+		if (fclose(f[k]) || bad) {
+			fprintf(stderr, "Error on '%s': %s\n", path(tag, k).c_str(), strerror(errno));
+			exit(1);
+		}
+		if (rm)
+			unlink(path(tag, k).c_str());
+	}
+	f.clear();
+}
+
+// every partition file this run could have made, whatever state it's in
+void spill::clean() {
+	const char *tags = "fid";
+	int k;
+	for (;*tags;++tags)
+		for (k=0;k<n;++k)
+			unlink(path(*tags, k).c_str());
+}
+
+// a partition that's short a record gives wrong verdicts, not an error, so every write is checked
+void spill::put(FILE *f, const std::string &name, int mq, int nm) {
+	int32_t v[3];
+	v[0] = name.size(); v[1] = mq; v[2] = nm;
+	if (fwrite(v, sizeof(v), 1, f) != 1 || fwrite(name.data(), 1, name.size(), f) != name.size()) {
+		fprintf(stderr, "Error writing partition file: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+// false at the end, exits on a partial record or a read error
+bool spill::get(FILE *f, std::string &name, int &mq, int &nm) {
+	int32_t v[3];
+	size_t got = fread(v, 1, sizeof(v), f);
+	if (got == 0 && !ferror(f))
+		return false;
+	if (got != sizeof(v) || v[0] < 0) {
+		fprintf(stderr, "Error reading partition file: %s\n", ferror(f) ? strerror(errno) : "truncated");
+		exit(1);
+	}
+	name.resize(v[0]);
+	if (v[0] && fread(&name[0], 1, v[0], f) != v[0]) {
+		fprintf(stderr, "Error reading partition file: %s\n", ferror(f) ? strerror(errno) : "truncated");
+		exit(1);
+	}
+	mq = v[1]; nm = v[2];
+	return true;
+}
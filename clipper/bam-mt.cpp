@@ -0,0 +1,380 @@
+/*
+$Id$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "bam-mt.h"
+
+#define kroundup32(x) (--(x), (x)|=(x)>>1, (x)|=(x)>>2, (x)|=(x)>>4, (x)|=(x)>>8, (x)|=(x)>>16, ++(x))
+
+// slot states
+#define BLK_EMPTY  0		// free for the reader
+#define BLK_READY  1		// compressed data read, waiting for a worker
+#define BLK_BUSY   2		// being inflated
+#define BLK_DONE   3		// inflated, waiting for the consumer
+#define BLK_END    4		// end of input (or error) marker
+
+struct mtbam_blk {
+	int state;
+	bool err;
+	int clen;								// compressed length
+	int ulen;								// inflated length
+	unsigned char cdata[MTBAM_BLOCK];
+	unsigned char udata[MTBAM_BLOCK];
+};
+
+static inline int le16(const unsigned char *p) { return p[0] | (p[1]<<8); }
+
+mtbam::mtbam() {
+	header=NULL;
+	fh=NULL;
+	nthreads=0;
+	nslot=0;
+	slot=NULL;
+	tids=NULL;
+	stop=false;
+	next_read=next_inflate=next_use=0;
+	cur=NULL;
+	cur_off=0;
+	failed=false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+mtbam::~mtbam() {
+	close();
+	pthread_mutex_destroy(&lock);
+	pthread_cond_destroy(&cond);
+}
+
+bool mtbam::open(const char *path, int threads) {
+	if (bam_is_be) {
+		// record parsing below assumes little-endian, let samtools handle it
+		return false;
+	}
+
+	if (!strcmp(path, "-"))
+		fh = fdopen(dup(0), "rb");			// caller still owns stdin
+	else
+		fh = fopen(path, "rb");
+
+	if (!fh)
+		return false;
+
+	failed=false;
+	nthreads = threads > 1 ? threads : 0;
+	nslot = nthreads ? nthreads * 4 : 1;
+	slot = (mtbam_blk *) calloc(nslot, sizeof(mtbam_blk));
+
+	if (nthreads) {
+		int i;
+		tids = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+		pthread_create(&rtid, NULL, reader_thread, this);
+		for (i=0;i<nthreads;++i)
+			pthread_create(&tids[i], NULL, inflate_thread, this);
+	}
+
+	// same as bam_header_read
+	char buf[4];
+	int32_t i, name_len;
+	if (read(buf, 4) != 4 || strncmp(buf, "BAM\001", 4)) {
+		fprintf(stderr, "[mtbam] invalid BAM binary header (this is not a BAM file).\n");
+		close();
+		return false;
+	}
+	header = bam_header_init();
+	if (read(&header->l_text, 4) != 4) goto trunc;
+	header->text = (char*)calloc(header->l_text + 1, 1);
+	if (read(header->text, header->l_text) != header->l_text) goto trunc;
+	if (read(&header->n_targets, 4) != 4) goto trunc;
+	header->target_name = (char**)calloc(header->n_targets, sizeof(char*));
+	header->target_len = (uint32_t*)calloc(header->n_targets, 4);
+	for (i = 0; i != header->n_targets; ++i) {
+		if (read(&name_len, 4) != 4) goto trunc;
+		header->target_name[i] = (char*)calloc(name_len, 1);
+		if (read(header->target_name[i], name_len) != name_len) goto trunc;
+		if (read(&header->target_len[i], 4) != 4) goto trunc;
+	}
+	return true;
+
+trunc:
+	fprintf(stderr, "[mtbam] truncated BAM header.\n");
+	close();
+	return false;
+}
+
+void mtbam::close() {
+	if (nthreads) {
+		int i;
+		pthread_mutex_lock(&lock);
+		stop=true;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+		pthread_join(rtid, NULL);
+		for (i=0;i<nthreads;++i)
+			pthread_join(tids[i], NULL);
+		free(tids);
+		tids=NULL;
+		nthreads=0;
+	}
+	if (fh) {
+		fclose(fh);
+		fh=NULL;
+	}
+	if (header) {
+		bam_header_destroy(header);
+		header=NULL;
+	}
+	free(slot);
+	slot=NULL;
+	cur=NULL;
+}
+
+// read one raw bgzf block, false on eof or error (b->err set on error)
+bool mtbam::fetch_block(mtbam_blk *b) {
+	unsigned char *p = b->cdata;
+	int n, xlen, bsize=0;
+
+	b->err=false;
+	b->clen=0;
+
+	if ((n=fread(p, 1, 12, fh)) != 12) {
+		if (n != 0) b->err=true;
+		return false;
+	}
+	if (p[0] != 31 || p[1] != 139 || p[2] != 8 || !(p[3] & 4)) {
+		b->err=true;
+		return false;
+	}
+	xlen = le16(p+10);
+	if (xlen + 12 > MTBAM_BLOCK || (int) fread(p+12, 1, xlen, fh) != xlen) {
+		b->err=true;
+		return false;
+	}
+
+	// find the BC subfield for the block size
+	int x = 12;
+	while (x + 4 <= 12 + xlen) {
+		int slen = le16(p+x+2);
+		if (p[x] == 'B' && p[x+1] == 'C' && slen == 2) {
+			bsize = le16(p+x+4) + 1;
+			break;
+		}
+		x += 4 + slen;
+	}
+	if (bsize <= 12 + xlen + 8 || bsize > MTBAM_BLOCK) {
+		b->err=true;
+		return false;
+	}
+
+	n = bsize - 12 - xlen;
+	if ((int) fread(p+12+xlen, 1, n, fh) != n) {
+		b->err=true;
+		return false;
+	}
+	b->clen=bsize;
+	return true;
+}
+
+bool mtbam::inflate_block(mtbam_blk *b) {
+	z_stream zs;
+	int xlen = le16(b->cdata+10);
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	zs.next_in = b->cdata + 12 + xlen;
+	zs.avail_in = b->clen - 12 - xlen - 8;
+	zs.next_out = b->udata;
+	zs.avail_out = MTBAM_BLOCK;
+
+	if (inflateInit2(&zs, -15) != Z_OK)
+		return false;
+	ret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	if (ret != Z_STREAM_END)
+		return false;
+
+	b->ulen = MTBAM_BLOCK - zs.avail_out;
+
+	// isize trailer must agree
+	const unsigned char *t = b->cdata + b->clen - 4;
+	unsigned int isize = t[0] | (t[1]<<8) | (t[2]<<16) | ((unsigned int)t[3]<<24);
+	return isize == (unsigned int) b->ulen;
+}
+
+void *mtbam::reader_thread(void *arg) {
+	mtbam *m = (mtbam *) arg;
+	for (;;) {
+		mtbam_blk *b = &m->slot[m->next_read % m->nslot];
+
+		pthread_mutex_lock(&m->lock);
+		while (b->state != BLK_EMPTY && !m->stop)
+			pthread_cond_wait(&m->cond, &m->lock);
+		bool stop = m->stop;
+		pthread_mutex_unlock(&m->lock);
+		if (stop) break;
+
+		// slot is ours until it's marked ready
+		bool ok = m->fetch_block(b);
+
+		pthread_mutex_lock(&m->lock);
+		b->state = ok ? BLK_READY : BLK_END;
+		++m->next_read;
+		pthread_cond_broadcast(&m->cond);
+		pthread_mutex_unlock(&m->lock);
+
+		if (!ok) break;
+	}
+	return NULL;
+}
+
+void *mtbam::inflate_thread(void *arg) {
+	mtbam *m = (mtbam *) arg;
+	pthread_mutex_lock(&m->lock);
+	for (;;) {
+		// another worker may take the block we're waiting for, so look again after each wakeup
+		mtbam_blk *b;
+		while ((b = &m->slot[m->next_inflate % m->nslot])->state != BLK_READY && b->state != BLK_END && !m->stop)
+			pthread_cond_wait(&m->cond, &m->lock);
+		if (m->stop || b->state == BLK_END)
+			break;
+
+		// claim it, blocks are handed out in order so the consumer rarely waits
+		b->state = BLK_BUSY;
+		++m->next_inflate;
+		pthread_mutex_unlock(&m->lock);
+
+		bool ok = m->inflate_block(b);
+
+		pthread_mutex_lock(&m->lock);
+		b->err = !ok;
+		b->state = BLK_DONE;
+		pthread_cond_broadcast(&m->cond);
+	}
+	pthread_mutex_unlock(&m->lock);
+	return NULL;
+}
+
+// advance cur to the next inflated block, false on eof/error
+bool mtbam::next_block() {
+	if (!nthreads) {
+		mtbam_blk *b = &slot[0];
+		cur=NULL;
+		do {
+			if (!fetch_block(b)) {
+				b->state = BLK_END;
+				if (b->err) bad_block();
+				return false;
+			}
+			if (!inflate_block(b)) {
+				b->err=true;
+				b->state = BLK_END;
+				bad_block();
+				return false;
+			}
+		} while (!b->ulen);		// skip empty (eof marker) blocks
+		cur=b;
+		cur_off=0;
+		return true;
+	}
+
+	pthread_mutex_lock(&lock);
+	if (cur) {
+		// give the old one back to the reader
+		cur->state = BLK_EMPTY;
+		++next_use;
+		cur=NULL;
+		pthread_cond_broadcast(&cond);
+	}
+	for (;;) {
+		mtbam_blk *b = &slot[next_use % nslot];
+		while (b->state != BLK_DONE && b->state != BLK_END)
+			pthread_cond_wait(&cond, &lock);
+		if (b->state == BLK_END || b->err) {
+			bool err = b->err;
+			if (err) b->state = BLK_END;
+			pthread_mutex_unlock(&lock);
+			if (err) bad_block();
+			return false;
+		}
+		if (b->ulen) {
+			cur=b;
+			cur_off=0;
+			break;
+		}
+		b->state = BLK_EMPTY;
+		++next_use;
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return true;
+}
+
+// a bad block ends the stream like eof does, so remember it and say so once
+void mtbam::bad_block() {
+	if (!failed)
+		fprintf(stderr, "[mtbam] truncated or corrupt BGZF block.\n");
+	failed=true;
+}
+
+// copy len bytes out of the block stream
+int mtbam::read(void *buf, int len) {
+	char *out = (char *) buf;
+	int got = 0;
+	while (got < len) {
+		if (!cur || cur_off >= cur->ulen) {
+			if (!next_block())
+				break;
+		}
+		int n = cur->ulen - cur_off;
+		if (n > len - got) n = len - got;
+		memcpy(out+got, cur->udata+cur_off, n);
+		cur_off+=n;
+		got+=n;
+	}
+	return got;
+}
+
+// same as bam_read1, minus the endian swapping
+int mtbam::read1(bam1_t *b) {
+	bam1_core_t *c = &b->core;
+	int32_t block_len, ret;
+	uint32_t x[8];
+
+	if ((ret = read(&block_len, 4)) != 4) {
+		if (ret == 0 && !failed) return -1;		// normal end-of-file
+		else return -2;					// truncated, or a bad block
+	}
+	if (read(x, BAM_CORE_SIZE) != BAM_CORE_SIZE) return -3;
+	c->tid = x[0]; c->pos = x[1];
+	c->bin = x[2]>>16; c->qual = x[2]>>8&0xff; c->l_qname = x[2]&0xff;
+	c->flag = x[3]>>16; c->n_cigar = x[3]&0xffff;
+	c->l_qseq = x[4];
+	c->mtid = x[5]; c->mpos = x[6]; c->isize = x[7];
+	b->data_len = block_len - BAM_CORE_SIZE;
+	if (b->m_data < b->data_len) {
+		b->m_data = b->data_len;
+		kroundup32(b->m_data);
+		b->data = (uint8_t*)realloc(b->data, b->m_data);
+	}
+	if (read(b->data, b->data_len) != b->data_len) return -4;
+	b->l_aux = b->data_len - c->n_cigar * 4 - c->l_qname - c->l_qseq - (c->l_qseq+1)/2;
+	if (bam_no_B) bam_remove_B(b);
+	return 4 + block_len;
+}
+
+int mtbam::read_batch(bam1_t **v, int n, int *ret) {
+	int i;
+	*ret = 0;
+	for (i=0;i<n;++i) {
+		if ((*ret=read1(v[i])) <= 0)
+			break;
+	}
+	return i;
+}
@@ -0,0 +1,70 @@
+/*
+$Id$
+
+Multi-threaded BAM reader.
+
+A reader thread pulls raw BGZF blocks off the input, a pool of worker threads
+inflates them ahead of the consumer, and the consumer parses bam1_t records out
+of the inflated blocks in file order.  Records are byte-for-byte what bam_read1
+would have returned.
+*/
+
+#ifndef _BAM_MT_H
+#define _BAM_MT_H
+
+#include <pthread.h>
+#include <samtools/bam.h>
+
+#define MTBAM_BLOCK 65536
+
+struct mtbam_blk;
+
+class mtbam {
+public:
+	bam_header_t *header;
+
+	mtbam();
+	~mtbam();
+
+	// open a bam file ("-" is stdin), start threads, read the header
+	bool open(const char *path, int threads);
+	void close();
+
+	// same return codes as bam_read1: >0 bytes read, -1 eof, <-1 truncated/corrupt
+	// a block that won't read or inflate is an error, even on a record boundary
+	int read1(bam1_t *b);
+
+	// true once a bad block was hit
+	bool error() const {return failed;}
+
+	// fill up to n records, returns number filled, *ret gets the last read1 code
+	int read_batch(bam1_t **v, int n, int *ret);
+
+private:
+	FILE *fh;
+	int nthreads;
+	int nslot;
+	mtbam_blk *slot;
+	pthread_t *tids;
+	pthread_t rtid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+	long next_read;
+	long next_inflate;
+	long next_use;
+	mtbam_blk *cur;
+	int cur_off;
+	bool failed;
+
+	int read(void *buf, int len);
+	bool next_block();
+	void bad_block();
+	bool fetch_block(mtbam_blk *b);
+	bool inflate_block(mtbam_blk *b);
+
+	static void *reader_thread(void *);
+	static void *inflate_thread(void *);
+};
+
+#endif
@@ -37,12 +37,21 @@ See "void usage" below for usage.
 #include <errno.h>
 #include <time.h>
 #include <vector>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 using namespace std;            // bad practice
 
 // #include "fastq-lib.h"
 
 #define CHUNK 32768
+#define BCL_BLOCK 16384         // clusters inflated at a time, per cycle
+#define BCL_GZBUF (1<<18)       // zlib input buffer, per cycle file
+#define BCL_SLICE 1024          // clusters formatted (and compressed) at a time, per thread
+#define BCL_GZLEVEL 2
+#define BCL_SEEK_MIN (1<<20)    // shorter skips just inflate through
 #define MAX_ERR_FILES 10
 #include "zlib.h"
 
@@ -55,7 +64,6 @@ std::string arg2cmdstr(int argc, char** argv);
 std::string string_format(const std::string fmt_str, ...);
 void usage(FILE *f, const char *msg=NULL);
 FILE *openordie(const char *path, const char *mode);
-FILE *popenordie(const char *path, const char *mode);
 char* itoa(int value, char* result, int base, char **endp);
 
 // per file/output file
@@ -64,7 +72,7 @@ typedef struct {
     int cyc_offset;
     int cyc_len;
     int rnum;
-    FILE *fout;
+    bool index;             // index cycles: put in the read id, and matched to barcodes
 } mask;
 
 // per-cycle info
@@ -79,9 +87,473 @@ typedef struct  __attribute__ ((packed)) {
     uint32_t ccnt;          // cluster count
 } tile_record;
 
+// locs record
+typedef struct  __attribute__ ((packed)) {
+    float x;
+    float y;
+} loc_record;
+
+// barcode sheet entry, same format as fastq-multx -B: ID SEQ, or ID SEQ1-SEQ2 for dual indexes
+typedef struct {
+    string id;
+    string seq;
+    string dual;
+} barcode;
+
+static void read_barcodes(const char *path, vector<barcode> &bcs) {
+    FILE *f=openordie(path, "r");
+    char buf[1024];
+    while (fgets(buf, sizeof(buf), f)) {
+        if (buf[0]=='#')
+            continue;
+        char *id=strtok(buf, "\t\n\r ");
+        if (!id)
+            continue;
+        char *seq=strtok(NULL, "\t\n\r ");
+        if (!seq) {
+            die("Barcode file '%s' required format is 'ID SEQ'\n", path);
+        }
+        barcode b;
+        b.id=id;
+        char *dual=strchr(seq, '-');
+        if (dual) {
+            *dual++='\0';
+            b.dual=dual;
+        }
+        b.seq=seq;
+        bcs.push_back(b);
+    }
+    fclose(f);
+}
+
+// differences over the barcode, index cycles that are missing count as differences
+static int bc_hd(const char *s, int n, const string &bc) {
+    int i, d=0, m=min(n, (int) bc.size());
+    for (i=0;i<m;++i)
+        if (s[i]!=bc[i]) ++d;
+    return d+bc.size()-m;
+}
+
+// same rules as fastq-multx: up to mismatch differences if only one barcode is that close,
+// and the best has to be at least distance better than the best before it.  -1 if nothing is
+static int bc_match(const vector<barcode> &bcs, const char *s1, int n1, const char *s2, int n2, int mismatch, int distance, bool *poor) {
+    int i, best=-1, bestmm=mismatch+distance+1, bestd=mismatch+distance+1, next_best=mismatch+distance*2+1;
+    *poor=false;
+    for (i=0;i<bcs.size();++i) {
+        int d=bc_hd(s1, n1, bcs[i].seq);
+        // distance is added in for duals
+        if (bcs[i].dual.size())
+            d+=bc_hd(s2, n2, bcs[i].dual);
+        if (d < bestd) {
+            next_best=bestd;
+            bestd=d;
+        }
+        if (d==0) {
+            best=i;
+            break;
+        } else if (d <= mismatch) {
+            if (d == bestmm) {
+                best=-1;        // more than 1 match... bad
+            } else if (d < bestmm) {
+                bestmm=d;
+                best=i;
+            }
+        }
+    }
+    if (best >= 0 && distance && (next_best-bestd) < distance) {
+        // match is ok, but distance is poor
+        *poor=true;
+        best=-1;
+    }
+    return best;
+}
+
+enum bcl_stage {BCL_INFLATE, BCL_FORMAT, BCL_QUIT};
+
+// one block of clusters, converted by all the threads together.  cycles are inflated into raw
+// (cycle-major, as stored), then slices of clusters are transposed, formatted, and optionally
+// compressed, each into its own buffer, so output is written in cluster (and tile) order
+struct bcl_block {
+    int ncyc;
+    int blk;                            // capacity, in clusters
+    int nb;                             // clusters in this block
+    vector<cycle> *cycles;
+    vector<mask> *masks;
+    bool usegz;
+
+    // demux, outputs are per barcode (last is unmatched) and mask, otherwise just per mask
+    vector<barcode> *bcs;
+    int mismatch;
+    int distance;
+    int nsamp;
+    vector<FILE *> fout;
+
+    vector<unsigned char> raw;          // unused cycles stay zero, so N
+    vector<int> got;                    // bytes inflated, per cycle
+    vector<char> pf;                    // per cluster
+    vector<int> x, y, tileid;
+
+    int nslice;
+    vector< vector<string> > text;      // per slice, per output: fastq, or a gzip member
+    vector< vector<int> > nout;         // reads output, per slice, per barcode
+    vector<int> npoor;                  // unmatched because of distance, per slice
+
+    int id_len;                         // read id, up to and including the lane:
+    char seq_map[256];
+    char qual_map[256];
+
+    // work is handed out under the lock, a stage at a time
+    pthread_mutex_t lock;
+    pthread_cond_t go;
+    pthread_cond_t done;
+    int stage;
+    int gen;
+    int next;
+    int busy;
+    int nthreads;
+};
+
+struct bcl_worker {
+    bcl_block *b;
+    pthread_t tid;
+    vector<char> seq;                   // 64 clusters, cluster-major
+    vector<char> qual;
+    char read_id[1000];
+    z_stream z;
+    bool zinit;
+};
+
+// next unclaimed cycle or slice, -1 when there are none left
+static int bcl_claim(bcl_block *b, int n) {
+    pthread_mutex_lock(&b->lock);
+    int i = b->next < n ? b->next++ : -1;
+    pthread_mutex_unlock(&b->lock);
+    return i;
+}
+
+// one gzip member, concatenated members are a valid gzip file
+static void bcl_gzip(bcl_worker *w, string &s) {
+    if (!w->zinit) {
+        memset(&w->z, 0, sizeof(w->z));
+        if (deflateInit2(&w->z, BCL_GZLEVEL, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            die("Can't initialize zlib\n");
+        }
+        w->zinit=true;
+    } else {
+        deflateReset(&w->z);
+    }
+    string out(deflateBound(&w->z, s.size()), '\0');
+    w->z.next_in=(Bytef *) s.data();
+    w->z.avail_in=s.size();
+    w->z.next_out=(Bytef *) &out[0];
+    w->z.avail_out=out.size();
+    if (deflate(&w->z, Z_FINISH) != Z_STREAM_END) {
+        die("Error : gzip failed\n");
+    }
+    out.resize(w->z.total_out);
+    s.swap(out);
+}
+
+static void bcl_format(bcl_worker *w, int sl) {
+    bcl_block *b=w->b;
+    vector<mask> &masks=*b->masks;
+    int ncyc=b->ncyc;
+    int s0=sl*BCL_SLICE, s1=min(b->nb, s0+BCL_SLICE);
+    int i, k, k0;
+
+    int nm=masks.size();
+    vector<string> &text=b->text[sl];
+    for (i=0;i<text.size();++i) {
+        text[i].clear();
+        if (masks[i%nm].useit && b->nsamp == 1)
+            text[i].reserve((s1-s0)*(2*masks[i%nm].cyc_len+64));
+    }
+    vector<int> &nout=b->nout[sl];
+    nout.assign(b->nsamp, 0);
+    b->npoor[sl]=0;
+
+    char *pid_after_lane=w->read_id+b->id_len;
+    for (k0=s0;k0<s1;k0+=64) {
+        int k1=min(s1,k0+64);
+
+        // cycle-major to cluster-major, 64 clusters at a time so reads and writes both stay in cache
+        for (i=0;i<ncyc;++i) {
+            const unsigned char *r=&b->raw[(size_t)i*b->blk];
+            char *sq=&w->seq[i], *ql=&w->qual[i];
+            for (k=k0;k<k1;++k) {
+                sq[(k-k0)*ncyc]=b->seq_map[r[k]];
+                ql[(k-k0)*ncyc]=b->qual_map[r[k]];
+            }
+        }
+
+        // output read(s)
+        for (k=k0;k<k1;++k) {
+            char pf=b->pf[k];
+            if (pf == 'Y')
+                continue;
+
+            const char *seqs=&w->seq[(k-k0)*ncyc];
+            const char *quals=&w->qual[(k-k0)*ncyc];
+
+            // index reads, joined with +, and the first two matched against the barcodes
+            char idx[256], *pidx=idx;
+            const char *is[2]={NULL,NULL};
+            int in[2]={0,0}, ni=0;
+            for (i=0;i<nm;++i) {
+                if (masks[i].index) {
+                    *pidx++ = ni ? '+' : ':';
+                    memcpy(pidx, seqs+masks[i].cyc_offset, masks[i].cyc_len);
+                    if (ni < 2) {
+                        is[ni]=pidx;
+                        in[ni]=masks[i].cyc_len;
+                    }
+                    pidx+=masks[i].cyc_len;
+                    ++ni;
+                }
+            }
+            int samp=0;
+            if (b->nsamp > 1) {
+                bool poor;
+                samp=bc_match(*b->bcs, is[0], in[0], is[1], in[1], b->mismatch, b->distance, &poor);
+                if (samp < 0) {
+                    samp=b->nsamp-1;
+                    if (poor)
+                        b->npoor[sl]++;
+                }
+            }
+            nout[samp]++;
+
+            // convert tileid, x y to read header
+            char *tmpid = pid_after_lane;
+            itoa(b->tileid[k], tmpid, 10, &tmpid);
+            *tmpid++=':';
+            itoa(b->x[k], tmpid, 10, &tmpid);
+            *tmpid++=':';
+            itoa(b->y[k], tmpid, 10, &tmpid);
+            *tmpid++=' ';
+
+            // id after the space
+            char *pid_after_space = tmpid;
+            for (i=0;i<nm;++i) {
+                if (masks[i].useit) {
+                    // output file number, pf flag and control flag
+                    tmpid=pid_after_space;
+                    itoa(masks[i].rnum, tmpid, 10, &tmpid);
+                    *tmpid++=':';
+                    *tmpid++=pf;
+                    *tmpid++=':';
+                    *tmpid++='0';
+                    memcpy(tmpid, idx, pidx-idx);
+                    tmpid+=pidx-idx;
+                    *tmpid++='\n';
+
+                    // the id, sequence, and quals for the current file output
+                    string &t=text[samp*nm+i];
+                    t.append(w->read_id, tmpid-w->read_id);
+                    t.append(seqs+masks[i].cyc_offset, masks[i].cyc_len);
+                    t.append("\n+\n", 3);
+                    t.append(quals+masks[i].cyc_offset, masks[i].cyc_len);
+                    t.push_back('\n');
+                }
+            }
+        }
+    }
+
+    if (b->usegz) {
+        for (i=0;i<text.size();++i)
+            if (text[i].size())
+                bcl_gzip(w, text[i]);
+    }
+}
+
+static void bcl_work(bcl_worker *w) {
+    bcl_block *b=w->b;
+    int i;
+    if (b->stage == BCL_INFLATE) {
+        vector<cycle> &cycles=*b->cycles;
+        while ((i=bcl_claim(b, b->ncyc)) >= 0) {
+            if (cycles[i].useit)
+                b->got[i]=gzread(cycles[i].fin, &b->raw[(size_t)i*b->blk], b->nb);
+        }
+    } else if (b->stage == BCL_FORMAT) {
+        while ((i=bcl_claim(b, b->nslice)) >= 0)
+            bcl_format(w, i);
+    }
+}
+
+static void *bcl_thread(void *arg) {
+    bcl_worker *w=(bcl_worker *) arg;
+    bcl_block *b=w->b;
+    int gen=0;
+    pthread_mutex_lock(&b->lock);
+    for(;;) {
+        while (b->gen == gen)
+            pthread_cond_wait(&b->go, &b->lock);
+        gen=b->gen;
+        if (b->stage == BCL_QUIT)
+            break;
+        pthread_mutex_unlock(&b->lock);
+        bcl_work(w);
+        pthread_mutex_lock(&b->lock);
+        if (--b->busy == 0)
+            pthread_cond_signal(&b->done);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+// runs a stage on every thread, the calling one is worker 0
+static void bcl_run(bcl_block *b, vector<bcl_worker> &w, int stage) {
+    pthread_mutex_lock(&b->lock);
+    b->stage=stage;
+    b->next=0;
+    b->busy=b->nthreads-1;
+    ++b->gen;
+    pthread_cond_broadcast(&b->go);
+    pthread_mutex_unlock(&b->lock);
+    if (stage == BCL_QUIT)
+        return;
+    bcl_work(&w[0]);
+    pthread_mutex_lock(&b->lock);
+    while (b->busy > 0)
+        pthread_cond_wait(&b->done, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+}
+
+// bgzf block offsets, as in a bgzip .gzi: compressed and uncompressed start of every block
+// but the first, which is (0,0)
+typedef struct {
+    uint64_t coff;
+    uint64_t uoff;
+} gzi_record;
+
+// from the block headers, the data isn't inflated. false if it's not bgzf
+static bool gzi_build(const char *path, vector<gzi_record> &ix) {
+    FILE *f=fopen(path, "rb");
+    if (!f)
+        return false;
+    ix.clear();
+    uint64_t coff=0, uoff=0;
+    unsigned char h[12], x[256];
+    bool ok=true;
+    size_t n;
+    while ((n=fread(h, 1, 12, f)) > 0) {
+        int xlen=h[10] | (h[11]<<8);
+        if (n < 12 || h[0] != 31 || h[1] != 139 || h[2] != 8 || !(h[3] & 4) || xlen > sizeof(x) || fread(x, 1, xlen, f) != xlen) {
+            ok=false;
+            break;
+        }
+        // BC subfield is the block size - 1
+        int i, bsize=0;
+        for (i=0;i+4<=xlen;i+=4+(x[i+2] | (x[i+3]<<8))) {
+            if (x[i]=='B' && x[i+1]=='C' && (x[i+2] | (x[i+3]<<8)) == 2 && i+6<=xlen) {
+                bsize=(x[i+4] | (x[i+5]<<8))+1;
+                break;
+            }
+        }
+        // ISIZE is the last 4 bytes of the block
+        unsigned char is[4];
+        if (!bsize || fseek(f, coff+bsize-4, SEEK_SET) || fread(is, 1, 4, f) != 4) {
+            ok=false;
+            break;
+        }
+        if (coff) {
+            gzi_record r = {coff, uoff};
+            ix.push_back(r);
+        }
+        coff+=bsize;
+        uoff+=is[0] | (is[1]<<8) | (is[2]<<16) | ((uint32_t) is[3]<<24);
+    }
+    fclose(f);
+    return ok;
+}
+
+// cached index, if it's newer than the file
+static bool gzi_read(const char *path, vector<gzi_record> &ix) {
+    string ipath=string(path)+".gzi";
+    struct stat st, ist;
+    if (stat(path, &st) || stat(ipath.c_str(), &ist) || ist.st_mtime < st.st_mtime)
+        return false;
+    FILE *f=fopen(ipath.c_str(), "rb");
+    if (!f)
+        return false;
+    uint64_t n;
+    bool ok = fread(&n, sizeof(n), 1, f) == 1 && n < (uint64_t) st.st_size;
+    if (ok) {
+        ix.resize(n);
+        ok = fread(ix.data(), sizeof(gzi_record), n, f) == n;
+    }
+    fclose(f);
+    return ok;
+}
+
+// written to a temp file and renamed, so jobs on the same run don't see each other's partial files
+static bool gzi_write(const char *path, const vector<gzi_record> &ix) {
+    string ipath=string(path)+".gzi";
+    string tmp=string_format("%s.%d.tmp", ipath.c_str(), (int) getpid());
+    FILE *f=fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+    uint64_t n=ix.size();
+    bool ok = fwrite(&n, sizeof(n), 1, f) == 1 && fwrite(ix.data(), sizeof(gzi_record), n, f) == n;
+    ok = !fclose(f) && ok && !rename(tmp.c_str(), ipath.c_str());
+    if (!ok)
+        unlink(tmp.c_str());
+    return ok;
+}
+
+// skip forward off bytes: on a bgzf file, reopen at the block holding off, so only that block
+// is inflated.  the block index is built on first use and cached as path.gzi (same as bgzip -r)
+// anything else falls back to gzseek.  returns the (possibly new) file, Z_NULL on failure
+static gzFile bgzf_seek(gzFile fil, const char *path, uint64_t off, FILE *flog) {
+    z_off_t cur=gztell(fil);
+    vector<gzi_record> ix;
+    if (off >= BCL_SEEK_MIN && !gzi_read(path, ix)) {
+        if (gzi_build(path, ix)) {
+            if (!gzi_write(path, ix))
+                fprintf(flog,"Can't cache block index for %s: %s\n", path, strerror(errno));
+        } else {
+            ix.clear();
+        }
+    }
+    int b=0, e=ix.size();                   // first block starting after the target
+    while (b < e) {
+        int m=(b+e)/2;
+        if (ix[m].uoff <= cur+off)
+            b=m+1;
+        else
+            e=m;
+    }
+    if (b > 0) {
+        int fd=open(path, O_RDONLY);
+        if (fd < 0 || lseek(fd, ix[b-1].coff, SEEK_SET) < 0) {
+            if (fd >= 0) close(fd);
+            gzclose(fil);
+            return Z_NULL;
+        }
+        gzFile nf=gzdopen(fd, "r");
+        if (nf == Z_NULL) {
+            close(fd);
+            gzclose(fil);
+            return Z_NULL;
+        }
+        gzclose(fil);
+        fil=nf;
+        gzbuffer(fil, BCL_GZBUF);
+        off=cur+off-ix[b-1].uoff;
+    }
+    if (off && gzseek(fil, off, SEEK_CUR) < 0) {
+        gzclose(fil);
+        return Z_NULL;
+    }
+    return fil;
+}
+
 int main (int argc, char **argv) {
     static struct option long_options[] = {
        {"debug", 0, 0, 0},
+       {"mismatch", 1, 0, 0},
+       {"distance", 1, 0, 0},
        {0, 0, 0, 0}
     };
 
@@ -96,18 +568,26 @@ int main (int argc, char **argv) {
     unsigned int output_cluster_count=0;                 // number of reads to process
     int tile=0;                                   // tile number
     int debug=0;                    // debug flag
+    int nthreads=1;
+    const char *bcfile=NULL;        // barcodes, for demux
+    int mismatch=1;
+    int distance=2;
     bool usegz=false;
     const char *fcid="X";
 
     int option_index = 0;
     int c;
-    while (	(c = getopt_long(argc, argv, "zhr:l:t:o:m:s:n:f:",long_options,&option_index)) != -1) {
+    while (	(c = getopt_long(argc, argv, "zhr:l:t:o:m:s:n:f:p:B:",long_options,&option_index)) != -1) {
 		switch (c) {
 			case '\0':
                 { 
                     const char *oname=long_options[option_index].name;
                     if(!strcmp(oname,        "debug")) {
                         debug=1;
+                    } else if(!strcmp(oname, "mismatch")) {
+                        mismatch=atoi(optarg);
+                    } else if(!strcmp(oname, "distance")) {
+                        distance=atoi(optarg);
                     }
                     break;
                 }
@@ -118,6 +598,8 @@ int main (int argc, char **argv) {
 			case 't': tile = atoi(optarg); break;
 			case 'f': fcid = optarg; break;
 			case 'z': usegz = 1; break;
+			case 'p': nthreads = atoi(optarg); break;
+			case 'B': bcfile = optarg; break;
 			case 'm': 
                     {
                         int typ;
@@ -126,17 +608,20 @@ int main (int argc, char **argv) {
                         int cur_offset=0;
                         while (*p) {
                             mask m; 
+                            m.index=0;
                             if (*p=='Y') {
                                 m.useit=1;
                             } else if (*p=='N') {
                                 m.useit=0;
+                            } else if (*p=='I') {
+                                m.useit=0;
+                                m.index=1;
                             } else {
                                 err=1;
                             }
                             ++p;
                             int len;
                             if (isdigit(*p)) {
-                                m.fout=NULL;
                                 m.cyc_offset=cur_offset;
                                 m.cyc_len=strtol(p, &p, 10);
                                 cur_offset+=m.cyc_len;
@@ -145,7 +630,7 @@ int main (int argc, char **argv) {
                                 err=1;
                             }
                             if (err) {
-                                die("Mask should be something like: Y50Y30Y50");    
+                                die("Mask should be something like: Y50I8Y50");    
                             }
                        }
                     } 
@@ -153,7 +638,7 @@ int main (int argc, char **argv) {
 			case 's': char *endp; cluster_start=strtoul(optarg, &endp, 10); break;
 			case 'n': cluster_count=atoi(optarg); break;
 			case '?': 
-					  if (strchr("rltomsn", optopt))
+					  if (strchr("rltomsnfpB", optopt))
 						  fprintf(stderr, "Option -%c requires an argument.\n", optopt);
 					  else if (isprint(optopt))
 						  fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -169,6 +654,35 @@ int main (int argc, char **argv) {
     if (!run.size() || !masks.size() || !lane || !out.length()) {
 		die("Run, mask and lane are required.\n");
     }
+    if (nthreads < 1) {
+		die("Threads should be at least 1\n");
+    }
+
+    vector<barcode> bcs;
+    int index_len=0, index_n=0, mi;
+    for (mi=0;mi<masks.size();++mi) {
+        if (masks[mi].index) {
+            index_len+=masks[mi].cyc_len+1;
+            ++index_n;
+        }
+    }
+    if (index_len > 200) {
+		die("Index reads are too long\n");
+    }
+    if (bcfile) {
+        read_barcodes(bcfile, bcs);
+        if (!bcs.size()) {
+            die("No barcodes in %s\n", bcfile);
+        }
+        if (!index_n) {
+            die("Demux needs index cycles in the mask, like: Y50I8Y50\n");
+        }
+        for (mi=0;mi<bcs.size();++mi) {
+            if (bcs[mi].dual.size() && index_n < 2) {
+                die("Dual barcodes need two index reads in the mask, like: Y50I8I8Y50\n");
+            }
+        }
+    }
   
     char lanestr[5];
     char lanestrnopad[5];
@@ -285,23 +799,27 @@ int main (int argc, char **argv) {
     vector<cycle>cycles;
     int output_fnum=0;
     string outtmp;
+    int nsamp=bcs.size() ? bcs.size()+1 : 1;      // with demux, the last is unmatched
+    vector<FILE *> fouts(nsamp*masks.size(), (FILE *) NULL);      // null by default
     for(i=0;i<masks.size();++i) {
-        FILE *fo=NULL;                            // null by default
         if(masks[i].useit) {
             ++output_fnum;                        // output file number is sequential
             masks[i].rnum=output_fnum;            // save file number as "read number"
-            if (usegz) {
-                outtmp = string_format("gzip -2 --rsyncable -c > %s.%d.fq.gz",out.c_str(),output_fnum); 
-                fo=popenordie(outtmp.c_str(),"w");
-            } else {
-                outtmp = string_format("%s.%d.fq",out.c_str(),output_fnum); 
-                fo=openordie(outtmp.c_str(),"w");
+            for (j=0;j<nsamp;++j) {
+                if (nsamp == 1) {
+                    outtmp = string_format("%s.%d.fq",out.c_str(),output_fnum); 
+                } else {
+                    outtmp = string_format("%s.%s.%d.fq",out.c_str(),j<bcs.size()?bcs[j].id.c_str():"unmatched",output_fnum); 
+                }
+                if (usegz) {
+                    outtmp += ".gz";                // compressed in-process
+                }
+                fouts[j*masks.size()+i]=openordie(outtmp.c_str(),"w");
             }
         }
-        masks[i].fout=fo;                         // pointer to output fiule for this mask level
         for (j = 0; j < masks[i].cyc_len; ++j) {
             cycle c;                            
-            c.useit = masks[i].useit;
+            c.useit = masks[i].useit || masks[i].index;
             cycles.push_back(c);
         }
     }
@@ -324,6 +842,7 @@ int main (int argc, char **argv) {
                 }
                 cycles[i].useit=false;
             }  else {
+                gzbuffer(fil, BCL_GZBUF);                                       // before the first read
                 uint32_t numc;
                 gzread(fil,&numc,4);                                                // read the header
                 if (numc!=filter_info.numclusters) {
@@ -333,9 +852,8 @@ int main (int argc, char **argv) {
                     cycles[i].useit=false;
                 } else {
     //                warn("Seek bcl %d\n",i);
-                    if (gzseek(fil,cluster_start,SEEK_CUR)<0) {                            // seek to cluster_start (8 bits per record)
-                        gzclose(fil);
-                        fil=Z_NULL;
+                    fil=bgzf_seek(fil,bclpath.c_str(),cluster_start,flog);                // seek to cluster_start (8 bits per record)
+                    if (fil == Z_NULL) {
                         cycles[i].useit=false;
                     }
                 }
@@ -349,14 +867,6 @@ int main (int argc, char **argv) {
         cycles[i].fin=fil;
     }
 
-    struct {
-        unsigned int base : 2;
-        unsigned int qual : 6;
-    } rec;
-
-    char seqs[cycles.size()];
-    char quals[cycles.size()];
-
     //ID Template:
     //@<instrument>:<run number>:<flowcell ID>:<lane>:<tile>:<x-pos>:<y-pos> <read>:<is filtered>:<control number>:<index sequence>
     //@NS500184:5:H0K79AGXX:1:11103:20690:3982 1:N:0:ATTCAGAA+GCCTCTAT
@@ -377,13 +887,57 @@ int main (int argc, char **argv) {
     for(i=0;i<64;++i) 
         qc_map[i]=33+i;
 
-    struct __attribute__ ((packed)) {
-        float x;
-        float y;
-    } locrec;
+    bcl_block b;
+    b.ncyc=cycles.size();
+    b.blk=max(BCL_BLOCK, 4*BCL_SLICE*nthreads);      // enough slices to go around
+    b.cycles=&cycles;
+    b.masks=&masks;
+    b.usegz=usegz;
+    b.bcs=&bcs;
+    b.mismatch=mismatch;
+    b.distance=distance;
+    b.nsamp=nsamp;
+    b.fout=fouts;
+    b.raw.assign((size_t)b.ncyc*b.blk, 0);
+    b.got.assign(b.ncyc, 0);
+    b.pf.resize(b.blk);
+    b.x.resize(b.blk);
+    b.y.resize(b.blk);
+    b.tileid.resize(b.blk);
+    b.text.assign((b.blk+BCL_SLICE-1)/BCL_SLICE, vector<string>(fouts.size()));
+    b.nout.resize(b.text.size());
+    b.npoor.resize(b.text.size());
+    vector<unsigned int> samp_count(nsamp, 0);
+    unsigned int poor_distance=0;
+    b.id_len=pid_after_lane-read_id;
+
+    // one lookup per bcl byte: base in the low 2 bits, quality in the high 6, zero is a no-call
+    for(i=0;i<256;++i) {
+        b.seq_map[i] = i ? aa_map[i&3] : 'N';
+        b.qual_map[i] = i ? qc_map[i>>2] : '#';
+    }
+
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.go, NULL);
+    pthread_cond_init(&b.done, NULL);
+    b.gen=0;
+    b.nthreads=nthreads;
+
+    // worker 0 is this thread
+    vector<bcl_worker> workers(nthreads);
+    for (i=0;i<nthreads;++i) {
+        workers[i].b=&b;
+        workers[i].seq.resize(64*b.ncyc);
+        workers[i].qual.resize(64*b.ncyc);
+        memcpy(workers[i].read_id, read_id, b.id_len);
+        workers[i].zinit=false;
+        if (i)
+            pthread_create(&workers[i].tid, NULL, bcl_thread, &workers[i]);
+    }
+
+    vector<char> pfb(b.blk);
+    vector<loc_record> locb(b.blk);
  
-    char pf;        /// purity filter (PF in illumina-speak)
-   
     int tidx=(tinfo.size()>0)?0:-1; 
     int tileid=(tinfo.size()>0)?tinfo[tidx].tid:0;
     int trnum=0;
@@ -400,122 +954,122 @@ int main (int argc, char **argv) {
     fprintf(flog,"Cluster start: %u\n", cluster_start);
     fprintf(flog,"Cluster subset: %u\n", cluster_count);
 
-    for(j=0;j<cluster_count;++j) {
-        if (tidx > 0 && trnum > tinfo[tidx].ccnt) {
-            ++tidx;
-            trnum=0;
-            if (tidx > tinfo.size()) {
-                // tile numbers are invalid at this point... !
-                fprintf(flog,"Tile numbers invalid at: %u\n", cluster_start+j);
-                tidx=-1;
-                tileid=0;
-            }
-            tileid=tinfo[tidx].tid;
-//            printf("TINFO: %d, %d\n", tileid, tinfo[tidx].ccnt);
-        }
-        ++trnum;
-
-        // read filter flag from filter file
-        if(ffilter && (fread(&pf,1,1,ffilter)==1)) {
-            pf = pf ? 'N' : 'Y';
-        } else {
-            pf = 'U';
+    unsigned int j0;
+    int nb, k, got_pf, got_loc;
+    for(j0=0;j0<cluster_count;j0+=nb) {
+        nb = min((unsigned int) b.blk, cluster_count-j0);
+        b.nb = nb;
+
+        // filter flags and x/y locations for the block, short reads leave the rest unknown
+        got_pf = ffilter ? fread(pfb.data(),1,nb,ffilter) : 0;
+        got_loc = flocs ? fread(locb.data(),sizeof(loc_record),nb,flocs) : 0;
+        if (flocs && got_loc < nb) {
+            fprintf(flog,"Locations invalid at: %u\n", cluster_start+j0+got_loc);
+            flocs = NULL;
         }
 
-        // read x/y location from locs file
-        int x, y;
-        if (flocs && fread(&locrec,sizeof(locrec), 1, flocs)==1) {
-            x=int(locrec.x * 10 + 1000 + 0.5);
-            y=int(locrec.y * 10 + 1000 + 0.5);
-        } else {
-            x=0;
-            y=0;
-            if (flocs) {
-                fprintf(flog,"Locations invalid at: %u\n", cluster_start+j);
-                flocs = NULL;
+        for(k=0;k<nb;++k) {
+            j=j0+k;
+            if (tidx > 0 && trnum > tinfo[tidx].ccnt) {
+                ++tidx;
+                trnum=0;
+                if (tidx > tinfo.size()) {
+                    // tile numbers are invalid at this point... !
+                    fprintf(flog,"Tile numbers invalid at: %u\n", cluster_start+j);
+                    tidx=-1;
+                    tileid=0;
+                }
+                tileid=tinfo[tidx].tid;
+//                printf("TINFO: %d, %d\n", tileid, tinfo[tidx].ccnt);
             }
-        }
+            ++trnum;
+            b.tileid[k]=tileid;
 
+            // filter flag from filter file
+            if (k < got_pf) {
+                b.pf[k] = pfb[k] ? 'N' : 'Y';
+            } else {
+                b.pf[k] = 'U';
+            }
 
-        // read cycles
-        for (i=0;i<cycles.size();++i) {
-            if (cycles[i].useit) {
-                // 1 byte read
-                if(gzread(cycles[i].fin,&rec,1)==1) {
-//                    warn("Record n:%d, cy:%d: b:%d, q:%d\n", j, i, rec.base, rec.qual);
-                    if (rec.base==0 && rec.qual == 0) {
-                        seqs[i]='N';
-                        quals[i]='#';
-                    } else {
-                        char aa = aa_map[rec.base];
-                        char qc = qc_map[rec.qual];
-                        seqs[i]=aa;
-                        quals[i]=qc;
-                    }
-                } else {
-                    // zero out the cycle from now on... 
-                    fprintf(flog,"Cycle %d invalid at %d\n", i+1, cluster_start);
-                    cycles[i].useit = 0;
-                    seqs[i]='N';
-                    quals[i]='#';
-                }
+            // x/y location from locs file
+            if (k < got_loc) {
+                b.x[k]=int(locb[k].x * 10 + 1000 + 0.5);
+                b.y[k]=int(locb[k].y * 10 + 1000 + 0.5);
             } else {
-                seqs[i]='N';
-                quals[i]='#';
+                b.x[k]=0;
+                b.y[k]=0;
             }
         }
-        
-        // output read(s)
-        if (pf != 'Y') {
-            // convert tileid, x y to read header
-            output_cluster_count++;
-            char *tmpid = pid_after_lane;
-            itoa(tileid, tmpid, 10, &tmpid);
-            *tmpid++=':';
-            itoa(x, tmpid, 10, &tmpid);
-            *tmpid++=':';
-            itoa(y, tmpid, 10, &tmpid);
-            *tmpid++=' ';
 
-            // id after the space
-            char *pid_after_space = tmpid;
-            for (i=0;i<masks.size();++i) {
-                if (masks[i].useit) {
-                    // output file number, pf flag and control flag
-                    tmpid=pid_after_space;
-                    itoa(masks[i].rnum, tmpid, 10, &tmpid);
-                    *tmpid++=':';
-                    *tmpid++=pf;
-                    *tmpid++=':';
-                    *tmpid++='0';
-                    *tmpid='\0';
-
-                    // output the id, sequence, and quals for the current file output
-                    fputs(read_id,masks[i].fout);
-                    fputc('\n',masks[i].fout);
-                    fwrite(seqs+masks[i].cyc_offset,1,masks[i].cyc_len, masks[i].fout);
-                    fputc('\n',masks[i].fout);
-                    fputc('+',masks[i].fout);
-                    fputc('\n',masks[i].fout);
-                    fwrite(quals+masks[i].cyc_offset,1,masks[i].cyc_len, masks[i].fout),
-                    fputc('\n',masks[i].fout);
-                } 
+        // cycles that went bad in the last block: clear what they did read
+        for (i=0;i<b.ncyc;++i) {
+            if (!cycles[i].useit && cycles[i].fin != Z_NULL) {
+                memset(&b.raw[(size_t)i*b.blk],0,b.blk);
+                gzclose(cycles[i].fin);
+                cycles[i].fin=Z_NULL;
             }
         }
-    }
 
+        // read cycles, a block at a time per file, the files in parallel
+        bcl_run(&b, workers, BCL_INFLATE);
+        for (i=0;i<b.ncyc;++i) {
+            if (cycles[i].useit && b.got[i] < nb) {
+                // zero out the cycle from now on... 
+                fprintf(flog,"Cycle %d invalid at %d\n", i+1, cluster_start);
+                cycles[i].useit = 0;
+                int got=max(b.got[i],0);
+                memset(&b.raw[(size_t)i*b.blk+got],0,b.blk-got);
+            }
+        }
 
-    for(i=0;i<masks.size();++i) {
-        if(masks[i].fout && usegz) {
-            if (!pclose(masks[i].fout)) {
-                fprintf(flog, "Error : gzip file may be corrupt\n");
-                die("Error : gzip file may be corrupt\n");
+        // transpose, format and compress, slices in parallel, then write them in order
+        b.nslice=(nb+BCL_SLICE-1)/BCL_SLICE;
+        bcl_run(&b, workers, BCL_FORMAT);
+        for (k=0;k<b.nslice;++k) {
+            for (i=0;i<nsamp;++i) {
+                output_cluster_count+=b.nout[k][i];
+                samp_count[i]+=b.nout[k][i];
+            }
+            poor_distance+=b.npoor[k];
+            for (i=0;i<fouts.size();++i) {
+                const string &t=b.text[k][i];
+                if (fouts[i] && t.size() && fwrite(t.data(),1,t.size(),fouts[i]) != t.size()) {
+                    fprintf(flog, "Error : write failed: %s\n", strerror(errno));
+                    die("Error : write failed: %s\n", strerror(errno));
+                }
             }
         }
     }
 
+    bcl_run(&b, workers, BCL_QUIT);
+    for (i=1;i<nthreads;++i)
+        pthread_join(workers[i].tid, NULL);
+    for(i=0;i<fouts.size();++i) {
+        if(fouts[i] && usegz && ftell(fouts[i]) == 0) {
+            // nothing went to this one, but it should still be a gzip file
+            string empty;
+            bcl_gzip(&workers[0], empty);
+            fwrite(empty.data(),1,empty.size(),fouts[i]);
+        }
+        if(fouts[i] && fclose(fouts[i])) {
+            fprintf(flog, "Error : output file may be corrupt\n");
+            die("Error : output file may be corrupt\n");
+        }
+    }
+
+    for (i=0;i<nthreads;++i)
+        if (workers[i].zinit)
+            deflateEnd(&workers[i].z);
+
     // all ok?
     fprintf(flog,"Cluster output: %u\n", output_cluster_count);
+    if (nsamp > 1) {
+        for (i=0;i<bcs.size();++i)
+            fprintf(flog,"Barcode %s: %u\n", bcs[i].id.c_str(), samp_count[i]);
+        fprintf(flog,"Unmatched: %u\n", samp_count[bcs.size()]);
+        fprintf(flog,"Skipped because of distance < %d: %u\n", distance, poor_distance);
+    }
     exit(0);
 }
 
@@ -531,12 +1085,25 @@ void usage(FILE *f, const char *msg) {
 "\n"
 "Required:\n"
 "    -r PATH     Path to run folder\n"
-"    -m MASK     Y50Y6Y50\n"
+"    -m MASK     Y50I6Y50, Y is output, N is skipped, I is index\n"
 "    -o PREFIX   Output file prefix\n"
 "\n"
 "Optional:\n"
 "    -s START    Cluster offset (ZERO BASED OFFSET)\n"
 "    -n COUNT    Cluster count\n"
+"    -z          Gzip output (in-process)\n"
+"    -p THREADS  Number of threads (1)\n"
+"    -B BCFIL    Demux on the index (I) cycles of the mask, using barcodes from BCFIL\n"
+"    --mismatch N  Allow up to N mismatches, as long as they are unique (1)\n"
+"    --distance N  Require a minimum distance of N between the best and next best (2)\n"
+"\n"
+"Starting at a cluster offset reads only the bgzf blocks it needs, using a block\n"
+"index cached next to each cycle file (NNNN.bcl.bgzf.gzi, as from bgzip -r)\n"
+"\n"
+"Index cycles are added to the read ids (1:N:0:ACGTACGT+TTGCAATG).  With -B,\n"
+"reads are split by the first (and second, for dual) index, using the same\n"
+"rules and barcode file as fastq-multx, into PREFIX.ID.N.fq and\n"
+"PREFIX.unmatched.N.fq\n"
 "\n"
     ,VERSION, SVNREV);
 }
@@ -586,16 +1153,6 @@ FILE *openordie(const char *path, const char *mode) {
     return f;
 }
 
-FILE *popenordie(const char *path, const char *mode) {
-    FILE *f=popen(path, mode);
-    if (!f) {
-        warn("Can't popen-%s %s: %s\n", mode, path, strerror(errno));
-        exit(1);
-    }
-    return f;
-}
-
-
 std::string string_format(const std::string fmt, ...) {
     int size = 100;
     std::string str;
@@ -0,0 +1,213 @@
+/*
+$Id$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fai-mm.h"
+
+using namespace std;
+
+// hints are checked against this, across every reader
+static long mmfai_gen=0;
+
+mmfai::mmfai() {
+    map=NULL;
+    map_len=0;
+    gen=__sync_add_and_fetch(&mmfai_gen, 1);
+    index.set_empty_key("");
+    cache_max=0;
+    cache_tick=0;
+    pthread_mutex_init(&cache_lock, NULL);
+}
+
+mmfai::~mmfai() {
+    close();
+    pthread_mutex_destroy(&cache_lock);
+}
+
+bool mmfai::open(const char *path) {
+    close();
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) || !st.st_size) {
+        ::close(fd);
+        return false;
+    }
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED)
+        return false;
+    map = (const char *) m;
+    map_len = st.st_size;
+
+    string fai_path = string(path) + ".fai";
+    FILE *fp = fopen(fai_path.c_str(), "r");
+    if (!fp) {
+        close();
+        return false;
+    }
+
+    // same columns as samtools: name, length, offset, bases per line, bytes per line
+    char *buf = (char*)calloc(0x10000, 1);
+    char *p;
+    while (fgets(buf, 0x10000, fp)) {
+        for (p = buf; *p && isgraph(*p); ++p);
+        if (!*p)
+            continue;
+        *p = 0; ++p;
+        ent e;
+        if (sscanf(p, "%d%lld%d%d", &e.len, &e.offset, &e.line_blen, &e.line_len) != 4 || e.line_blen <= 0)
+            continue;
+        e.id = index.size();
+        index[buf]=e;
+    }
+    free(buf);
+    fclose(fp);
+    return true;
+}
+
+void mmfai::close() {
+    if (map)
+        munmap((void *) map, map_len);
+    map=NULL;
+    map_len=0;
+    index.clear();
+    cached.clear();
+    gen=__sync_add_and_fetch(&mmfai_gen, 1);
+}
+
+const mmfai::ent *mmfai::chrdex(const char *chr) {
+    google::dense_hash_map<string, ent>::const_iterator it = index.find(chr);
+    return it == index.end() ? NULL : &(it->second);
+}
+
+void mmfai::cache(int n) {
+    pthread_mutex_lock(&cache_lock);
+    cache_max = n;
+    cached.clear();
+    gen=__sync_add_and_fetch(&mmfai_gen, 1);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// n bases from beg, which must be inside the sequence
+bool mmfai::copy(char *buf, const ent *e, int beg, int n) {
+    while (n > 0) {
+        int col = beg % e->line_blen;
+        long long off = e->offset + (long long) (beg / e->line_blen) * e->line_len + col;
+        int seg = min(n, e->line_blen - col);
+        if (off + seg > map_len)
+            return false;
+        memcpy(buf, map + off, seg);
+        buf += seg;
+        beg += seg;
+        n -= seg;
+    }
+    return true;
+}
+
+shared_ptr<mmfai::packed> mmfai::pack(const ent *e) {
+    shared_ptr<packed> p(new packed);
+    p->id = e->id;
+    p->b2.assign((e->len+3)/4, 0);
+    p->nmask.assign((e->len+7)/8, 0);
+
+    // a line at a time, so the whole sequence is never unpacked in memory
+    string line(e->line_blen, '\0');
+    int beg, i;
+    for (beg=0;beg<e->len;beg+=e->line_blen) {
+        int n = min(e->line_blen, e->len-beg);
+        if (!copy(&line[0], e, beg, n))
+            return shared_ptr<packed>();
+        for (i=0;i<n;++i) {
+            int x = beg+i, c;
+            switch (line[i]) {
+                case 'A': case 'a': c=0; break;
+                case 'C': case 'c': c=1; break;
+                case 'G': case 'g': c=2; break;
+                case 'T': case 't': c=3; break;
+                default: c=0; p->nmask[x>>3] |= 1<<(x&7);
+            }
+            p->b2[x>>2] |= c<<((x&3)*2);
+        }
+    }
+    return p;
+}
+
+bool mmfai::fetch(char *buf, const ent *e, int beg, int end, hint *h) {
+    if (!e || !map)
+        return false;
+
+    int len = end-beg+1;
+    int l = 0;
+
+    // off the ends of the sequence is N, not the neighboring record
+    while (beg < 0 && l < len) {
+        buf[l++] = 'N';
+        ++beg;
+    }
+    int n = max(0, min(len-l, e->len-beg));
+
+    if (n > 0) {
+        if (!cache_max) {
+            if (!copy(buf+l, e, beg, n))
+                return false;
+        } else {
+            shared_ptr<packed> p;
+            if (h && h->gen == gen && h->p && h->p->id == e->id) {
+                // the lru order only sees misses, a sequence in use could be dropped from the
+                // cache, but the hint keeps it
+                p = h->p;
+            } else {
+                pthread_mutex_lock(&cache_lock);
+                int i, lru=-1;
+                for (i=0;i<cached.size();++i) {
+                    if (cached[i]->id == e->id) {
+                        p = cached[i];
+                        break;
+                    }
+                    if (lru < 0 || cached[i]->used < cached[lru]->used)
+                        lru = i;
+                }
+                if (!p) {
+                    // decoded under the lock, so threads asking for the same sequence wait for one decode
+                    p = pack(e);
+                    if (!p) {
+                        pthread_mutex_unlock(&cache_lock);
+                        return false;
+                    }
+                    if (cached.size() < cache_max)
+                        cached.push_back(p);
+                    else
+                        cached[lru] = p;            // readers still holding the old one keep it alive
+                }
+                p->used = ++cache_tick;
+                pthread_mutex_unlock(&cache_lock);
+                if (h) {
+                    h->gen = gen;
+                    h->p = p;
+                }
+            }
+
+            static const char b2c[] = "ACGT";
+            int x;
+            for (x=beg;x<beg+n;++x)
+                buf[l+x-beg] = (p->nmask[x>>3] & (1<<(x&7))) ? 'N' : b2c[(p->b2[x>>2] >> ((x&3)*2)) & 3];
+        }
+        l += n;
+    }
+
+    while (l < len)
+        buf[l++] = 'N';
+    return true;
+}
@@ -0,0 +1,85 @@
+/*
+$Id$
+
+Memory-mapped fasta reader, using the samtools .fai index.
+
+Line offsets are computed from the index and sequence is copied out of the
+mapping a line segment at a time.  Nothing changes after open(), so one reader
+can be shared by any number of threads.
+
+Optionally, sequences can be decoded into a 2-bit cache as they are used.
+The cache keeps the most recently used n sequences, it loses case and
+anything that isn't ACGT comes back as N.  A caller can keep a hint with its
+last hit, so runs of fetches from one sequence don't take the cache's lock.
+*/
+
+#ifndef _FAI_MM_H
+#define _FAI_MM_H
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <sparsehash/dense_hash_map>
+
+class mmfai {
+public:
+    struct ent {
+        int id;
+        int len;
+        long long offset;
+        int line_blen;
+        int line_len;
+    };
+
+    // a sequence in the 2-bit cache
+    struct packed {
+        int id;
+        long used;
+        std::vector<unsigned char> b2;      // 4 bases a byte
+        std::vector<unsigned char> nmask;   // 1 bit a base, set for N
+    };
+
+    // a caller's last cache hit, one per thread, never shared
+    // it keeps its sequence alive, so there can be one more of them than the cache holds
+    struct hint {
+        long gen;
+        std::shared_ptr<packed> p;
+        hint() {gen=0;}
+    };
+
+    mmfai();
+    ~mmfai();
+
+    // map the fasta and read path.fai, false if either is missing
+    bool open(const char *path);
+    void close();
+    bool is_open() {return map != NULL;}
+
+    // index entry for a sequence, NULL if it's not there
+    const ent *chrdex(const char *chr);
+
+    // 0-based, end inclusive, positions off either end of the sequence are N
+    // false for an unknown sequence or a truncated file
+    bool fetch(char *buf, const ent *e, int beg, int end, hint *h=NULL);
+    bool fetch(char *buf, const char *chr, int beg, int end, hint *h=NULL) {return fetch(buf, chrdex(chr), beg, end, h);}
+
+    // fetch() goes through the 2-bit cache, holding up to n sequences, 0 turns it off
+    void cache(int n);
+
+private:
+    const char *map;
+    long long map_len;
+    long gen;                               // changes whenever hints go stale
+    google::dense_hash_map<std::string, ent> index;
+
+    int cache_max;
+    long cache_tick;
+    std::vector< std::shared_ptr<packed> > cached;
+    pthread_mutex_t cache_lock;
+
+    bool copy(char *buf, const ent *e, int beg, int n);
+    std::shared_ptr<packed> pack(const ent *e);
+};
+
+#endif
@@ -10,8 +10,11 @@
 #include <sys/stat.h>
 #include <search.h>
 #include <limits.h>
+#include <stdint.h>
 #include <sparsehash/sparse_hash_map> // or sparse_hash_set, dense_hash_map, ...
 #include <string>
+#include <vector>
+#include <algorithm>
 
 typedef struct line {
         char *s; int n; size_t a;
@@ -32,23 +35,114 @@ public:
 	to_merge() {};
 };
 
-class ent {
-public:
-	std::string seq;
-	int cnt;
+// collapsed reads, numbered in the order they are first seen, with counts and names
+// up to 32 ACGT's are 2-bit packed, with the length, in a flat open addressing table.
+// anything else (N's, long reads) goes in a string map.
+// names are indexes into a name list: set on an entry by patterns or alignment, and kept
+// on the side for sequences that aren't entries (references, reverse strand alignments)
+#define SEQTAB_MAXPACK 32
 
-	ent(const std::string &s, const int &c) { seq=s; cnt=c; };
+class seqtab {
+public:
+	struct ent {
+		uint64_t bits;		// packed bases, base i at bit 2*i, or index into strs
+		int len;		// -1 for a string entry
+		int cnt;
+		int annot;		// -1 for none
+	};
+	std::vector<ent> ents;
+
+	seqtab();
+	int size() {return ents.size();}
+	int find(const char *s, int n);		// -1 if not there
+	int add(const char *s, int n);		// new entries have no count
+	std::string seq(int i);
+	int seqlen(int i) {return ents[i].len >= 0 ? ents[i].len : strs[ents[i].bits].size();}
+
+	void annotate(const std::string &s, int a);
+	int annot(int i);			// -1 for none
+	bool annotated(const char *s, int n);
+private:
+	std::vector<uint32_t> slots;		// entry+1, 0 is empty
+	uint64_t mask;
+	std::vector<std::string> strs;
+	google::sparse_hash_map<std::string,int> strmap;
+	google::sparse_hash_map<std::string,int> xmap;
+
+	static bool pack(const char *s, int n, uint64_t &bits);
+	static uint64_t hash(uint64_t bits, int len) {
+		uint64_t h = (bits ^ ((uint64_t)len << 58)) * 0x9E3779B97F4A7C15ULL;
+		return h ^ (h >> 29);
+	}
+	void grow();
+};
 
-	static bool comp_cnt (const ent &a, const ent &b) {
-		return a.cnt < b.cnt;
+// ascending count, ties by entry number descending, so reading from the end is
+// highest first, and ties in the order first seen
+struct by_cnt {
+	seqtab &t;
+	by_cnt(seqtab &x) : t(x) {};
+	bool operator() (int a, int b) const {
+		return t.ents[a].cnt != t.ents[b].cnt ? t.ents[a].cnt < t.ents[b].cnt : a > b;
 	};
 };
-class idseq {
+
+// Aho-Corasick automaton over the pattern sequences
+// first() is the lowest numbered pattern found anywhere in a sequence, the same one
+// a search through the patterns in order finds.  patterns that aren't all ACGT are
+// searched for the old way
+class acpat {
+	std::vector<int> go;			// 4 a node, every transition filled in by build()
+	std::vector<int> best;			// lowest pattern ending at a node or any of its suffixes
+	std::vector<std::pair<int,std::string> > other;
+	int npat;
+public:
+	acpat() {go.assign(4,0); best.push_back(INT_MAX); npat=0;}
+	int size() {return npat;}
+	void add(const char *s);
+	void build();
+	int first(const std::string &s);	// -1 for none
+};
+
+// short read aligner for small references (miRNA, rRNA, tRNA)
+// every reference position is indexed by the ALN_K bases from it, sorted, with where each
+// ALN_P base prefix starts, so a seed of any length up to ALN_K is a range.
+// a read is cut into mismatches/2+1 seeds, one of which has at most one mismatch, each is
+// looked up as is and with every single substitution, and the hits are extended without
+// gaps, giving up past the limit.  reads are aligned within a reference, on either strand
+#define ALN_K 12
+#define ALN_P 10
+
+class seqaln {
+	struct kpos {
+		uint32_t code;
+		uint32_t pos;
+		bool operator<(const kpos &o) const {return code != o.code ? code < o.code : pos < o.pos;};
+	};
+	std::string seq;			// all references, back to back, anything not ACGT is 0
+	std::vector<uint32_t> beg;		// start of each, and the end of the last
+	std::vector<kpos> index;
+	std::vector<uint32_t> bucket;		// first entry for each ALN_P base prefix, and the end
+	void lookup(uint32_t code, int sl, int off, std::vector<uint32_t> &cand);
+	void hits(const std::string &r, int mm, int &best, uint32_t &bpos);
 public:
-        std::string id;
-        std::string seq;
+	std::vector<std::string> names;
+	bool load(const char *path);		// multi-line fasta
+	int align(const std::string &r, int mm);	// reference with the fewest mismatches, -1 for none
+};
 
-        idseq(const std::string &s, const std::string &i) { seq=s; id=i; };
+// annotation names, each stored once
+class namelist {
+	google::sparse_hash_map<std::string,int> ix;
+	std::vector<std::string> v;
+public:
+	int id(const std::string &nam) {
+		google::sparse_hash_map<std::string,int>::iterator it = ix.find(nam);
+		if (it != ix.end()) return it->second;
+		v.push_back(nam);
+		return ix[nam] = v.size()-1;
+	}
+	const char *operator[](int i) {return i < 0 ? "" : v[i].c_str();}
 };
 
 // get file extension
@@ -64,11 +158,13 @@ int read_fa(FILE *in, int &lno, struct fq *fq);          // 0=done, 1=ok, -1=err
 void usage(FILE *f);
 double quantile(std::vector<int> vec, double p);
 #define meminit(l) (memset(&l,0,sizeof(l)))
+#define comp(c) ((c)=='A'?'T':(c)=='a'?'t':(c)=='C'?'G':(c)=='c'?'g':(c)=='G'?'C':(c)=='g'?'c':(c)=='T'?'A':(c)=='t'?'a':(c))
 FILE *openordie(const char *nam, const char * mode, FILE *def, const char *errstr, bool *isgz=NULL);
 
 std::string string_format(const std::string &fmt, ...);
 bool file_newer(const char *f1, const char *f2);
 std::vector<std::string> split(char* str,const char* delim);
+int align_all(seqtab &pmap, seqaln &aln, namelist &names, int mm, bool unnamed);
 
 #define MAX_EX 4
 
@@ -86,10 +182,13 @@ int main (int argc, char **argv) {
 	int mergs = 1;
 	int mergc = 0;
 	int mergn = 0;
+	int alnmm = 2;
+	bool refaln = false;
+	bool bowtie = false;
 	bool debug = false;
 
 	char c;
-	while ( (c = getopt (argc, argv, "-hdi:o:s:p:r:n:t:x:m:")) != -1) {
+	while ( (c = getopt (argc, argv, "-hdabi:o:s:p:r:n:t:x:m:v:")) != -1) {
 		switch (c) {
 			case '\1':
 				if (!in)
@@ -111,7 +210,17 @@ int main (int argc, char **argv) {
 			case 'p':
 				pat = optarg; break;
 			case 'x':
+				if (excl_n >= MAX_EX) {
+					fprintf(stderr, "Too many -x files, max is %d\n", MAX_EX);
+					exit(1);
+				}
 				vexcl[excl_n++] = optarg; break;
+			case 'v':
+				alnmm = atoi(optarg); break;
+			case 'a':
+				refaln = true; break;
+			case 'b':
+				bowtie = true; break;
 			case 'n':
 				targ = atoi(optarg); break;
 			case 't':
@@ -122,7 +231,7 @@ int main (int argc, char **argv) {
 				usage(stdout);
 				exit(0);
 			case '?':
-				if (strchr("iosrn", optopt))
+				if (strchr("iosrnptxmv", optopt))
 					fprintf (stderr, "Option -%c requires an argument.\n", optopt);
 				else if (isprint(optopt))
 					fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -135,6 +244,11 @@ int main (int argc, char **argv) {
 		}
 	}
 
+	if (refaln && !ref) {
+		fprintf(stderr, "Option -a needs a reference (-r)\n");
+		exit(1);
+	}
+
 	FILE *fin, *fout, *fstat, *fref = NULL, *fpat=NULL, *ftmp=NULL;
 	bool fingz;
 	fin = openordie(in, "r", stdin, "Error opening file '%s': %s\n", &fingz);
@@ -147,8 +261,8 @@ int main (int argc, char **argv) {
 	if (pat) 
 		fpat = openordie(pat, "r", NULL, "Error opening file '%s': %s\n");
 
-	google::sparse_hash_map<std::string, std::string> mmap;
-
+	seqtab pmap;
+	namelist names;
 
 	int read_ok, nref=0, nrec = 0, lno = 0, npat=0; struct fq fq; meminit(fq);
 
@@ -159,12 +273,13 @@ int main (int argc, char **argv) {
 			++nref;
 			char * p=strchr(fq.id.s, ' ');
 			if (p) *p='\0';
-			mmap[fq.seq.s] = fq.id.s+1;
+			pmap.annotate(fq.seq.s, names.id(fq.id.s+1));
 		}
 		fprintf(fstat,"nrefseq\t%d\n", nref);
 	}
 
-	std::vector<idseq> pvec;
+	acpat pats;
+	std::vector<int> pnam;
 	if (fpat) {
 		// patterns to search and exclude
 		lno = 0;
@@ -172,31 +287,31 @@ int main (int argc, char **argv) {
 			++npat;
 			char * p=strchr(fq.id.s, ' ');
 			if (p) *p='\0';
-			idseq np(fq.seq.s,fq.id.s+1);
-			pvec.push_back(np);
+			pats.add(fq.seq.s);
+			pnam.push_back(names.id(fq.id.s+1));
 		}
+		pats.build();
 		fprintf(fstat,"npatseq\t%d\n", npat);
 	}
 
 
-	// map all sequences to the hash
-	google::sparse_hash_map<std::string, int> pmap;
+	// collapse all sequences
 	lno = 0;
 	while (read_ok=read_fq(fin, lno, &fq)) {
 		++nrec;
 //		fprintf(stderr, "read %d '%s'\n", nrec, fq.seq.s);
 		if (fq.seq.n > 1) {
-			++pmap[fq.seq.s];
+			++pmap.ents[pmap.add(fq.seq.s, fq.seq.n)].cnt;
 		}
 	}
 	if (thr<0) thr = (int)(log(1+nrec)/log(10));
 
 	std::vector<int> vec;
 	std::vector<int> lvec;
-	std::vector<ent> lis;
+	std::vector<int> lis;
 
 	std::string tmp;
-	if (excl_n) {
+	if (excl_n && bowtie) {
 		// make a temp file
 		if (in) {
 			tmp=string_format("%s.tmp.fq", in);
@@ -206,34 +321,54 @@ int main (int argc, char **argv) {
         ftmp = openordie(tmp.c_str(), "w", NULL, "Error opening file '%s': %s\n");
 	}
 
-	if (npat > 0 || excl_n) {
-		// fill mmap with pattern matches, and fill tmp fastq with sequences
-		std::vector<idseq>::iterator pit;
-      	google::sparse_hash_map<std::string,int>::iterator it = pmap.begin();
-		while (it != pmap.end()) {
-			if (excl_n) {
+	if (npat > 0 || ftmp) {
+		// tag with the first pattern found, and fill tmp fastq with sequences
+		int i, n = pmap.size();
+		std::string seq;
+		for (i=0;i<n;++i) {
+			seq = pmap.seq(i);
+			if (ftmp) {
 				fputs("@\n", ftmp);
-				fputs(it->first.c_str(),ftmp);
+				fputs(seq.c_str(),ftmp);
 				fputs("\n+\n", ftmp);
-				int i;
-				for(i=0;i<it->first.size();++i) {
+				int j;
+				for(j=0;j<seq.size();++j) {
 					fputc('h',ftmp);
 				}
 				fputc('\n', ftmp);
 			}
 			if (npat > 0) {
-				for (pit=pvec.begin(); pit != pvec.end(); ++pit) {
-					if (it->first.find(pit->seq) != std::string::npos) {
-						mmap[it->first]=pit->id;
-						break;
-					}
-				}
+				int m = pats.first(seq);
+				if (m >= 0)
+					pmap.ents[i].annot = pnam[m];
+			}
+		}
+		if (ftmp) fclose(ftmp);
+	}
+
+	if (refaln) {
+		// name what's left by alignment to the reference
+		seqaln aln;
+		if (!aln.load(ref)) {
+			fprintf(stderr, "Error opening file '%s': %s\n", ref, strerror(errno));
+			exit(1);
+		}
+		fprintf(fstat, "ref aligned\t%d\n", align_all(pmap, aln, names, alnmm, true));
+	}
+
+	if (excl_n && !bowtie) {
+		int i;
+		for (i=0;i<excl_n;++i) {
+			seqaln aln;
+			if (!aln.load(vexcl[i])) {
+				fprintf(stderr, "Error opening file '%s': %s\n", vexcl[i], strerror(errno));
+				exit(1);
 			}
-			++it;
+			align_all(pmap, aln, names, alnmm, false);
 		}
 	}
 
-	if (excl_n) {
+	if (excl_n && bowtie) {
 		int i;
 		for (i=0;i<excl_n;++i) {
 			char *excl=vexcl[i];
@@ -251,7 +386,7 @@ int main (int argc, char **argv) {
 			fprintf(stderr,"+%s\n",cmd.c_str());
 			FILE *aln;
 			if (!(aln=popen(cmd.c_str(),"r"))) {
-				fprintf(stderr, "Can't run bowtie: $!\n", strerror(errno));
+				fprintf(stderr, "Can't run bowtie: %s\n", strerror(errno));
 				exit(1);
 			}
 			struct line l; meminit(l);
@@ -259,69 +394,63 @@ int main (int argc, char **argv) {
 				std::vector<std::string> v = split(l.s,"\t");
 				if (v[9].size() > 17) {
 					if (atoi(v[3].c_str()) > 0) {
-						// add to mmap
-						mmap[v[9]]=v[2];
+						pmap.annotate(v[9], names.id(v[2]));
 					}
 				}
 			}
-			unlink(tmp.c_str());
+			pclose(aln);
 		}
+		unlink(tmp.c_str());
 	}	
 
 	if (mergs > 0) {	
 		if (debug) fprintf(stderr, "merge\n");
-		google::sparse_hash_map<std::string,int>::iterator it = pmap.begin();
-		google::sparse_hash_map<std::string,std::string>::iterator mit; 
-		std::string sseq;
 		std::string oseq;
 		std::vector<to_merge> merge_list;
-		while (it != pmap.end()) {
+		int n = pmap.size(), j;
+		for (j=0;j<n;++j) {
 			int i;
+			oseq = pmap.seq(j);
 			for (i=1;i<=mergs;++i) {
-				sseq = it->first;
-				if (sseq.length() > i) {
-					oseq=sseq;
-					sseq.erase(sseq.length()-i);
-					if (debug) fprintf(stderr, "merge %s %s\n", oseq.c_str(), sseq.c_str());
+				if (oseq.length() > i) {
+					if (debug) fprintf(stderr, "merge %s %s\n", oseq.c_str(), oseq.substr(0, oseq.length()-i).c_str());
 
 					// search for "close enough" ref seq
-					mit = mmap.find(sseq);
 					// merge named sequences
-					if (mit != mmap.end()) {
-						// not safe to search map while iterating!
-						if (debug) fprintf(stderr, "found: %d+%d\n", it->second, (int)pmap[oseq]);
+					if (pmap.annotated(oseq.data(), oseq.length()-i)) {
+						// added after the pass, so the trimmed ones aren't merged again
+						if (debug) fprintf(stderr, "found: %d\n", pmap.ents[j].cnt);
 						++mergn;
-						mergc+=it->second;
-						merge_list.push_back(to_merge(sseq, it->second));
+						mergc+=pmap.ents[j].cnt;
+						merge_list.push_back(to_merge(oseq.substr(0, oseq.length()-i), pmap.ents[j].cnt));
 						break;
 					}
 				}
 			}
-			++it;
 		}
 		int i;
 		for (i=0;i<merge_list.size();++i) {
-			pmap[merge_list[i].sseq]+=merge_list[i].cnt;
+			const std::string &m = merge_list[i].sseq;
+			pmap.ents[pmap.add(m.data(), m.length())].cnt+=merge_list[i].cnt;
 		}
 	}
 
 	int tot = 0;
 	// build lists
-	google::sparse_hash_map<std::string,int>::iterator it = pmap.begin();
-	while (it != pmap.end()) {
- 		ent e(it->first,it->second);
-		lvec.push_back(it->first.size());
-		if (it->second >= thr) {
-			vec.push_back(it->second);
-			tot+=it->second;
+	int j;
+	for (j=0;j<pmap.size();++j) {
+		int cnt = pmap.ents[j].cnt;
+		lvec.push_back(pmap.seqlen(j));
+		if (cnt >= thr) {
+			vec.push_back(cnt);
+			tot+=cnt;
 		}
-		lis.push_back(e);
-		++it;
+		lis.push_back(j);
 	}
 	
 	std::sort(vec.begin(), vec.end());
 	std::sort(lvec.begin(), lvec.end());
-	std::sort(lis.begin(), lis.end(), ent::comp_cnt);
+	std::sort(lis.begin(), lis.end(), by_cnt(pmap));
 
 	fprintf(fstat, "reads\t%d\n", nrec);
 	fprintf(fstat, "threshold\t%d\n", thr);
@@ -364,38 +493,395 @@ int main (int argc, char **argv) {
 	fprintf(fstat, "len q3\t%d\n", lq3);
 	fprintf(fstat, "len max\t%d\n", lq4);
 
-	int i = 0;
-	std::vector<ent>::iterator vit;
-	for (vit=(lis.end()-1); vit>=lis.begin();--vit) {
-		++i;
-		std::string anno;
-                google::sparse_hash_map<std::string,std::string>::iterator mit = mmap.find(vit->seq);
-                if (mit != mmap.end()) {
-                        anno=mit->second;
-                }
-		fprintf(fstat, "top %d\t%d\t%s\t%s\n", i, vit->cnt, vit->seq.c_str(), anno.c_str());
-		if (i >= 10) break;	
+	// highest first, ties in the order first seen
+	int i;
+	for (i=0;i<lis.size() && i < 10;++i) {
+		int e = lis[lis.size()-1-i];
+		fprintf(fstat, "top %d\t%d\t%s\t%s\n", i+1, pmap.ents[e].cnt, pmap.seq(e).c_str(), names[pmap.annot(e)]);
 	}
 
-        google::sparse_hash_map<std::string,std::string>::iterator fn;
-	std::string seq;
-	int ncnt, idf;
-	for (vit=(lis.end()-1); vit>=lis.begin();--vit) {
-		if (vit->cnt <= thr) {
+	int ncnt;
+	for (i=lis.size()-1;i>=0;--i) {
+		int e = lis[i];
+		if (pmap.ents[e].cnt <= thr) {
 			break;
 		}
-		seq=vit->seq;
+		ncnt = (int) (norm * (double) pmap.ents[e].cnt);
+		fprintf(fout, "%s\t%d\t%d\t%s\n", pmap.seq(e).c_str(), pmap.ents[e].cnt, ncnt, names[pmap.annot(e)]);
+	}
+
+}
+
+////////////// collapsing table ////////////////
+
+seqtab::seqtab() {
+	slots.assign(1<<16, 0);
+	mask = slots.size()-1;
+}
+
+static inline int base2(char c) {
+	switch (c) {
+		case 'A': return 0;
+		case 'C': return 1;
+		case 'G': return 2;
+		case 'T': return 3;
+	}
+	return -1;
+}
+
+bool seqtab::pack(const char *s, int n, uint64_t &bits) {
+	if (n > SEQTAB_MAXPACK)
+		return false;
+	bits = 0;
+	int i;
+	for (i=0;i<n;++i) {
+		int b = base2(s[i]);
+		if (b < 0)
+			return false;
+		bits |= ((uint64_t) b) << (2*i);
+	}
+	return true;
+}
+
+std::string seqtab::seq(int i) {
+	const ent &e = ents[i];
+	if (e.len < 0)
+		return strs[e.bits];
+	std::string r(e.len, 'A');
+	int j;
+	for (j=0;j<e.len;++j)
+		r[j] = "ACGT"[(e.bits >> (2*j)) & 3];
+	return r;
+}
+
+void seqtab::grow() {
+	slots.assign(slots.size()*2, 0);
+	mask = slots.size()-1;
+	int i;
+	for (i=0;i<ents.size();++i) {
+		if (ents[i].len < 0)
+			continue;
+		uint64_t h = hash(ents[i].bits, ents[i].len) & mask;
+		while (slots[h])
+			h = (h+1) & mask;
+		slots[h] = i+1;
+	}
+}
+
+int seqtab::find(const char *s, int n) {
+	uint64_t bits;
+	if (!pack(s, n, bits)) {
+		google::sparse_hash_map<std::string,int>::iterator it = strmap.find(std::string(s, n));
+		return it == strmap.end() ? -1 : it->second;
+	}
+	uint64_t h = hash(bits, n) & mask;
+	while (slots[h]) {
+		const ent &e = ents[slots[h]-1];
+		if (e.bits == bits && e.len == n)
+			return slots[h]-1;
+		h = (h+1) & mask;
+	}
+	return -1;
+}
 
-		std::string anno;
-		// merge map
-		google::sparse_hash_map<std::string,std::string>::iterator mit = mmap.find(seq);
-		if (mit != mmap.end()) {
-			anno=mit->second;
+int seqtab::add(const char *s, int n) {
+	ent e;
+	e.cnt = 0;
+	e.annot = -1;
+	if (!pack(s, n, e.bits)) {
+		std::string k(s, n);
+		google::sparse_hash_map<std::string,int>::iterator it = strmap.find(k);
+		if (it != strmap.end())
+			return it->second;
+		e.bits = strs.size();
+		e.len = -1;
+		strs.push_back(k);
+		ents.push_back(e);
+		return strmap[k] = ents.size()-1;
+	}
+	e.len = n;
+	uint64_t h = hash(e.bits, n) & mask;
+	while (slots[h]) {
+		const ent &o = ents[slots[h]-1];
+		if (o.bits == e.bits && o.len == n)
+			return slots[h]-1;
+		h = (h+1) & mask;
+	}
+	ents.push_back(e);
+	slots[h] = ents.size();
+	// half full
+	if (ents.size()*2 > slots.size())
+		grow();
+	return ents.size()-1;
+}
+
+void seqtab::annotate(const std::string &s, int a) {
+	int i = find(s.data(), s.length());
+	if (i >= 0)
+		ents[i].annot = a;
+	else
+		xmap[s] = a;
+}
+
+int seqtab::annot(int i) {
+	if (ents[i].annot >= 0)
+		return ents[i].annot;
+	if (xmap.empty())
+		return -1;
+	google::sparse_hash_map<std::string,int>::iterator it = xmap.find(seq(i));
+	return it == xmap.end() ? -1 : it->second;
+}
+
+bool seqtab::annotated(const char *s, int n) {
+	int i = find(s, n);
+	if (i >= 0 && ents[i].annot >= 0)
+		return true;
+	return xmap.find(std::string(s, n)) != xmap.end();
+}
+
+////////////// pattern automaton ////////////////
+
+void acpat::add(const char *s) {
+	int id = npat++;
+	const char *p;
+	for (p=s;*p;++p)
+		if (base2(*p) < 0) break;
+	if (*p || !*s) {
+		// empty, or not all ACGT
+		other.push_back(std::pair<int,std::string>(id, s));
+		return;
+	}
+	int node = 0;
+	for (p=s;*p;++p) {
+		int b = base2(*p);
+		if (!go[node*4+b]) {
+			go[node*4+b] = best.size();
+			go.insert(go.end(), 4, 0);
+			best.push_back(INT_MAX);
+		}
+		node = go[node*4+b];
+	}
+	if (id < best[node])
+		best[node] = id;
+}
+
+void acpat::build() {
+	// breadth first, so a node's suffix link is done before the node
+	std::vector<int> fail(best.size(), 0);
+	std::vector<int> q;
+	int b, i;
+	for (b=0;b<4;++b)
+		if (go[b]) q.push_back(go[b]);
+	for (i=0;i<q.size();++i) {
+		int u = q[i];
+		best[u] = std::min(best[u], best[fail[u]]);
+		for (b=0;b<4;++b) {
+			int v = go[u*4+b];
+			if (v) {
+				fail[v] = go[fail[u]*4+b];
+				q.push_back(v);
+			} else {
+				go[u*4+b] = go[fail[u]*4+b];
+			}
 		}
-		ncnt = (int) (norm * (double) vit->cnt);
-		fprintf(fout, "%s\t%d\t%d\t%s\n", seq.c_str(), vit->cnt, ncnt, anno.c_str());
 	}
+}
 
+int acpat::first(const std::string &s) {
+	int m = INT_MAX, node = 0, i;
+	for (i=0;i<s.length();++i) {
+		int b = base2(s[i]);
+		if (b < 0) {
+			node = 0;
+			continue;
+		}
+		node = go[node*4+b];
+		if (best[node] < m)
+			m = best[node];
+	}
+	for (i=0;i<other.size() && other[i].first < m;++i) {
+		if (s.find(other[i].second) != std::string::npos) {
+			m = other[i].first;
+			break;
+		}
+	}
+	return m == INT_MAX ? -1 : m;
+}
+
+////////////// aligner ////////////////
+
+bool seqaln::load(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return false;
+	struct line l; meminit(l);
+	while (read_line(f, l) > 0) {
+		while (l.n > 0 && isspace(l.s[l.n-1]))
+			l.s[--l.n] = '\0';
+		if (l.s[0] == '>') {
+			beg.push_back(seq.size());
+			char *p = l.s+1;
+			while (*p && !isspace(*p)) ++p;
+			names.push_back(std::string(l.s+1, p-l.s-1));
+		} else if (!beg.empty()) {
+			int i;
+			for (i=0;i<l.n;++i) {
+				char c = toupper(l.s[i]);
+				seq += base2(c) < 0 ? '\0' : c;
+			}
+		}
+	}
+	free(l.s);
+	fclose(f);
+	beg.push_back(seq.size());
+
+	// past the end of a reference, or not ACGT, codes as A.  the extension sorts it out
+	index.resize(seq.size());
+	int r;
+	for (r=0;r+1<beg.size();++r) {
+		uint32_t p;
+		for (p=beg[r];p<beg[r+1];++p) {
+			uint32_t code = 0, i;
+			for (i=0;i<ALN_K;++i) {
+				int b = p+i < beg[r+1] ? base2(seq[p+i]) : 0;
+				code = (code << 2) | (b < 0 ? 0 : b);
+			}
+			index[p].code = code;
+			index[p].pos = p;
+		}
+	}
+	std::sort(index.begin(), index.end());
+
+	bucket.assign((1<<2*ALN_P)+1, 0);
+	uint32_t i;
+	for (i=0;i<index.size();++i)
+		++bucket[(index[i].code >> 2*(ALN_K-ALN_P))+1];
+	for (i=1;i<bucket.size();++i)
+		bucket[i] += bucket[i-1];
+	return true;
+}
+
+// reference positions where a read would start, if the seed sl bases long at off is there
+void seqaln::lookup(uint32_t code, int sl, int off, std::vector<uint32_t> &cand) {
+	std::vector<kpos>::iterator it, end;
+	if (sl <= ALN_P) {
+		it = index.begin() + bucket[code << 2*(ALN_P-sl)];
+		end = index.begin() + bucket[(code+1) << 2*(ALN_P-sl)];
+	} else {
+		uint32_t b = code >> 2*(sl-ALN_P);
+		kpos lo, hi;
+		lo.code = code << 2*(ALN_K-sl); lo.pos = 0;
+		hi.code = (code+1) << 2*(ALN_K-sl); hi.pos = 0;
+		it = std::lower_bound(index.begin()+bucket[b], index.begin()+bucket[b+1], lo);
+		end = std::lower_bound(it, index.begin()+bucket[b+1], hi);
+	}
+	for (;it<end;++it)
+		if (it->pos >= off)
+			cand.push_back(it->pos - off);
+}
+
+// fewest mismatches, up to mm, then the first position
+void seqaln::hits(const std::string &r, int mm, int &best, uint32_t &bpos) {
+	best = mm+1;
+	bpos = UINT_MAX;
+	int len = r.length();
+	int nseed = mm/2+1;
+	int step = len/nseed;
+	int sl = std::min(step, ALN_K);
+	if (sl <= 0)
+		return;
+
+	std::vector<uint32_t> cand;
+	int j;
+	for (j=0;j<nseed;++j) {
+		int off = j*step, i, nx = -1, bad = 0;
+		uint32_t code = 0;
+		for (i=0;i<sl;++i) {
+			int b = base2(r[off+i]);
+			if (b < 0) {
+				++bad;
+				nx = i;
+				b = 0;
+			}
+			code = (code << 2) | b;
+		}
+		// a seed with two N's isn't the one, a seed with one only needs it substituted
+		if (bad > 1 || (bad && !mm))
+			continue;
+		if (!bad)
+			lookup(code, sl, off, cand);
+		if (!mm)
+			continue;
+		for (i=0;i<sl;++i) {
+			if (bad && i != nx)
+				continue;
+			int sh = 2*(sl-1-i);
+			uint32_t o = (code >> sh) & 3, b;
+			for (b=0;b<4;++b)
+				if (b != o || bad)
+					lookup((code & ~(3U << sh)) | (b << sh), sl, off, cand);
+		}
+	}
+	int c;
+	for (c=0;c<cand.size();++c) {
+		uint32_t p = cand[c];
+		if (p + len > seq.size())
+			continue;
+		int i, n = 0;
+		const char *s = seq.data()+p;
+		for (i=0;i<len && n <= best;++i) {
+			if (s[i] != r[i])
+				++n;
+		}
+		if (n < best || (n == best && p < bpos)) {
+			// not across the end of a reference
+			int ref = std::upper_bound(beg.begin(), beg.end(), p) - beg.begin() - 1;
+			if (p + len > beg[ref+1])
+				continue;
+			best = n;
+			bpos = p;
+		}
+	}
+}
+
+int seqaln::align(const std::string &r, int mm) {
+	// forward wins ties
+	int best, rbest;
+	uint32_t pos, rpos;
+	hits(r, mm, best, pos);
+	if (best) {
+		std::string rc(r.rbegin(), r.rend());
+		int i;
+		for (i=0;i<rc.length();++i)
+			rc[i] = comp(rc[i]);
+		hits(rc, std::min(mm, best-1), rbest, rpos);
+		if (rbest < best) {
+			best = rbest;
+			pos = rpos;
+		}
+	}
+	if (best > mm)
+		return -1;
+	return std::upper_bound(beg.begin(), beg.end(), pos) - beg.begin() - 1;
+}
+
+// names sequences longer than 17 that align, or only those without a name
+// returns the number named
+int align_all(seqtab &pmap, seqaln &aln, namelist &names, int mm, bool unnamed) {
+	int i, n = pmap.size(), cnt = 0;
+	std::vector<int> nam(aln.names.size(), -1);
+	for (i=0;i<n;++i) {
+		if (pmap.seqlen(i) <= 17 || (unnamed && pmap.annot(i) >= 0))
+			continue;
+		int r = aln.align(pmap.seq(i), mm);
+		if (r < 0)
+			continue;
+		if (nam[r] < 0)
+			nam[r] = names.id(aln.names[r]);
+		pmap.ents[i].annot = nam[r];
+		++cnt;
+	}
+	return cnt;
 }
 
 ////////////// pasted library stuff ////////////////
@@ -430,7 +916,6 @@ FILE *openordie(const char *nam, const char * mode, FILE *def, const char *errst
 }
 
 
-#define comp(c) ((c)=='A'?'T':(c)=='a'?'t':(c)=='C'?'G':(c)=='c'?'g':(c)=='G'?'C':(c)=='g'?'c':(c)=='T'?'A':(c)=='t'?'a':(c))
 void revcomp(struct fq *d, struct fq *s) {
         if (!d->seq.s) {
                 d->seq.s=(char *) malloc(d->seq.a=s->seq.n);
@@ -482,6 +967,7 @@ int read_fa(FILE *in, int &lno, struct fq *fa) {
         }
         fa->seq.s[--fa->seq.n] = '\0';
         fa->id.s[--fa->id.n] = '\0';
+        return 1;
 }
 
 int read_fq(FILE *in, int &lno, struct fq *fq) {
@@ -519,8 +1005,12 @@ void usage(FILE *f) {
 "-s FIL         Stats file (stderr)\n"
 "-r FIL         miRNA reference fasta (none)\n"
 "-x FIL         Annot via alignment, ie: rRNA (none)\n"
+"-a             Name seqs that don't match -r exactly by alignment to it\n"
+"-v INT         Mismatches allowed when aligning, for -a and -x (2)\n"
+"-b             Align -x with bowtie, instead of the built-in aligner\n"
 "-n INT         Upper quartile normalize with target (1000)\n"
 "-t INT         Threshold (log10(record count))\n"
+"-p FIL         Pattern fasta, seqs containing one are named for the first (none)\n"
 "-m INT         Combine known (-r) seqs with up to INT mismatches\n"
 "\n"
         ,f);
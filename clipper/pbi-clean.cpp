@@ -1,8 +1,3 @@
-///A tutorial about local alignments.
-#include <iostream>
-#include <seqan/align.h>
-//#include <seqan/graph_msa.h>
-//#include <seqan/consensus/consensus_calling.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,7 +9,11 @@
 #include <limits.h>
 #include <sys/stat.h>
 
-using namespace seqan;
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "sw-lib.h"
 
 void revcomp(struct fq *dest, struct fq* src);
 
@@ -61,23 +60,22 @@ int main(int argc, char **argv)
         memset(&fq, 0, sizeof(fq));
 
 	bool read_ok; int nrec=0;
-	Score<int> score(3,-3,-2, -2);
+	// one adapter profile for every read
+	sw_profile prof(adapter, 3, -3, -2, -2);
+	std::vector<sw_hit> hits;
 	std::vector<int> cnt_vec;
 	std::vector<int> len_vec;
 	int cnt_sum=0, cnt_ssq=0, len_sum=0, len_ssq=0;
         while (read_ok=read_fq(fin, nrec, &fq)) {
 		++nrec;
-		Align< String<char> > ali;
-		appendValue(rows(ali), adapter);
-		appendValue(rows(ali), fq.seq);
-		LocalAlignmentFinder<> finder(ali);
 		if (fq.nseq > al*1.5) {
 			try {
-				int s;
+				int h;
 				int cnt = 0;
-				while ((s=localAlignment(ali, finder, score, (int)(al*1.8), WatermanEggert()))>0) {
-					int b=clippedBeginPosition(row(ali, 1));
-					int e=clippedEndPosition(row(ali, 1));
+				prof.hits(fq.seq, fq.nseq, (int)(al*1.8), hits);
+				for (h=0;h<hits.size();++h) {
+					int b=hits[h].tbeg;
+					int e=hits[h].tend;
 //					printf("%d<-->%d\n", b,e);
 					fq.seq[b]='\1';
 					fq.seq[e]='\2';
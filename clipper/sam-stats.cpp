@@ -40,10 +40,11 @@
 #include <samtools/sam.h>         // samtools api
 
 #include "fastq-lib.h"
+#include "bam-mt.h"
 
 const char * VERSION = "1.38";
 
-#define SVNREV atoi(strchr("$LastChangedRevision$", ':')+1)
+#define SVNREV atoi(strchr("$LastChangedRevision: 0 $", ':')+1)
 
 using namespace std;
 
@@ -56,6 +57,7 @@ void usage(FILE *f);
 //#define max(a,b) (a>b?a:b)
 //#define min(a,b) (a<b?a:b)
 #define meminit(l) (memset(&l,0,sizeof(l)))
+#define comp(c) ((c)=='A'?'T':(c)=='a'?'t':(c)=='C'?'G':(c)=='c'?'g':(c)=='G'?'C':(c)=='g'?'c':(c)=='T'?'A':(c)=='t'?'a':(c))
 #define debugout(s,...) if (debug) fprintf(stderr,s,##__VA_ARGS__)
 #undef warn
 #define warn(s,...) ((++errs), fprintf(stderr,s,##__VA_ARGS__))
@@ -101,6 +103,28 @@ public:
     m_m2 += d * d_n * (m_n - 1);
     m_m1 += d_n;
   }
+  // combine moments of two sets (Pebay 2008), same result as pushing all of b's values
+  void Merge(const cRunningStats &b)
+  {
+    if (b.m_n == 0) return;
+    if (m_n == 0) { *this = b; return; }
+    double n = m_n + b.m_n;
+    double d = b.m_m1 - m_m1;
+    double d2 = d * d;
+    double d3 = d * d2;
+    double d4 = d2 * d2;
+    double m4 = m_m4 + b.m_m4 + d4 * m_n * b.m_n * (m_n * m_n - m_n * b.m_n + b.m_n * b.m_n) / (n * n * n)
+                + 6.0 * d2 * (m_n * m_n * b.m_m2 + b.m_n * b.m_n * m_m2) / (n * n)
+                + 4.0 * d * (m_n * b.m_m3 - b.m_n * m_m3) / n;
+    double m3 = m_m3 + b.m_m3 + d3 * m_n * b.m_n * (m_n - b.m_n) / (n * n)
+                + 3.0 * d * (m_n * b.m_m2 - b.m_n * m_m2) / n;
+    double m2 = m_m2 + b.m_m2 + d2 * m_n * b.m_n / n;
+    m_m1 = (m_n * m_m1 + b.m_n * b.m_m1) / n;
+    m_m2 = m2;
+    m_m3 = m3;
+    m_m4 = m4;
+    m_n = n;
+  }
   double Mean() { return m_m1; }
   double StdDeviation() { return sqrt(Variance()); }
   double StdError() { return (m_n > 1.0) ? sqrt(Variance() / m_n) : 0.0; }
@@ -118,6 +142,15 @@ public:
     cRunningStats spos;
 	int reflen;
 	vector <int> dist;
+	void merge(const scoverage &b) {
+		int i;
+		mapb+=b.mapb;
+		mapr+=b.mapr;
+		spos.Merge(b.spos);
+		if (b.reflen > reflen) reflen=b.reflen;
+		for (i=0;i<dist.size() && i<b.dist.size();++i)
+			dist[i]+=b.dist[i];
+	}
 };
 
 // sorted integer bucket ... good for ram with small max size, slow to access
@@ -144,22 +177,160 @@ public:
 		++dat[v];
 		++tot;
 	}
+
+	void merge(const ibucket &b) {
+		int i;
+		assert(b.dat.size()==dat.size());
+		for (i=0;i<dat.size();++i)
+			dat[i]+=b.dat[i];
+		tot+=b.tot;
+	}
 };
 
-class fqent {
-    public:
-    int bits; 
-    std::string r;
-    std::string q;
+// read-name index for duplicate alignment tracking
+// illumina names (...:lane:tile:x:y) pack into 96 bits: a 32 bit hash of the run/flowcell/lane prefix + tile/x/y
+// anything else is a 64 bit hash of the name
+// counts live in a flat open-addressing table, 24 bytes per slot instead of a string + hash node per read
+class readidx {
+public:
+	struct ent {
+		uint64_t hi, lo;	// hi == 0 : empty slot
+		int cnt;
+	};
+	vector<ent> tab;
+	size_t n;			// # of keys
+
+	readidx() : n(0) {
+		tab.resize(1<<16);
+		memset(&tab[0], 0, tab.size()*sizeof(ent));
+	}
+
+	size_t size() const {return n;}
+	size_t bytes() const {return tab.size()*sizeof(ent);}
+
+	// these are worked out from the table, not counted as names go in, so a table
+	// merged from threads gives the same answer as one filled in order
+
+	// extra probes to find a key, averaged over the keys
+	// with linear probing the total doesn't depend on the order keys went in
+	double collision_rate() const {
+		size_t i, mask = tab.size()-1;
+		double sum = 0;
+		for (i=0;i<tab.size();++i)
+			if (tab[i].hi)
+				sum += (i - slot(tab[i].hi, tab[i].lo)) & mask;
+		return n ? sum / n : 0;
+	}
+
+	// # of keys that didn't look like illumina names
+	size_t nhash() const {
+		size_t i, c = 0;
+		for (i=0;i<tab.size();++i)
+			if (tab[i].hi == 2)
+				++c;
+		return c;
+	}
+
+	// add cnt to the name's count, returns the new count
+	int add(const char *name, int len, int cnt=1) {
+		uint64_t hi, lo;
+		key(name, len, hi, lo);
+		return add(hi, lo, cnt);
+	}
+
+	int add(uint64_t hi, uint64_t lo, int cnt) {
+		if ((n+1)*4 > tab.size()*3)				// keep it under 75% full
+			grow();
+		size_t mask = tab.size()-1;
+		size_t i = slot(hi, lo) & mask;
+		while (tab[i].hi) {
+			if (tab[i].hi == hi && tab[i].lo == lo)
+				return tab[i].cnt += cnt;
+			i = (i+1) & mask;
+		}
+		tab[i].hi=hi;
+		tab[i].lo=lo;
+		tab[i].cnt=cnt;
+		++n;
+		return cnt;
+	}
+
+	// returns true if the name had to be hashed
+	static bool key(const char *name, int len, uint64_t &hi, uint64_t &lo) {
+		int i, nf = 0, f[8];
+		for (i=0;i<len && name[i] != ' ';++i) {
+			if (name[i] == ':') {
+				if (nf < 8) f[nf] = i;
+				++nf;
+			}
+		}
+		len = i;			// most aligners remove the space... but not all
+
+		// @HWI-ST1131:111228:C0B0NACXX:2:1101:1230:2118 or HWUSI-EAS100R:6:73:941:1973#0/1
+		// a #index and/or /mate suffix is dropped, so both mates are the same read
+		if (nf >= 4 && nf <= 8) {
+			unsigned long tile, x, y;
+			char *e;
+			tile = strtoul(name+f[nf-3]+1, &e, 10);
+			if (e == name+f[nf-2] && e[-1] != ':') {
+				x = strtoul(name+f[nf-2]+1, &e, 10);
+				if (e == name+f[nf-1] && e[-1] != ':') {
+					y = strtoul(name+f[nf-1]+1, &e, 10);
+					if ((e == name+len || *e == '#' || *e == '/') && e[-1] != ':' && tile < (1<<16) && x < (1<<24) && y < (1<<24)) {
+						uint64_t h = hash(name, f[nf-3]);
+						hi = (h << 32) | 1;
+						lo = ((uint64_t) tile << 48) | ((uint64_t) x << 24) | y;
+						return false;
+					}
+				}
+			}
+		}
+		hi = 2;
+		lo = hash(name, len);
+		return true;
+	}
+
+	// fnv-1a, pass h to carry on from an earlier hash
+	static uint64_t hash(const char *p, int len, uint64_t h = 14695981039346656037ULL) {
+		int i;
+		for (i=0;i<len;++i) {
+			h ^= (unsigned char) p[i];
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+private:
+	static size_t slot(uint64_t hi, uint64_t lo) {
+		uint64_t h = lo ^ (hi * 0x9e3779b97f4a7c15ULL);
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return (size_t) h;
+	}
+
+	void grow() {
+		vector<ent> old;
+		old.swap(tab);
+		tab.resize(old.size()*2);
+		memset(&tab[0], 0, tab.size()*sizeof(ent));
+		n=0;
+		size_t i;
+		for (i=0;i<old.size();++i)
+			if (old[i].hi)
+				add(old[i].hi, old[i].lo, old[i].cnt);
+	}
 };
 
+class matetab;
+
 class sstats {
 public:
 	ibucket vmapq;			// all map qualities
 	sstats() : vmapq(MAX_MAPQ) {
 		memset((void*)&dat,0,sizeof(dat));
 		covr.set_empty_key("-");
-		petab.set_deleted_key("-");
+		mates=NULL;
 	}
 	~sstats() {
 		covr.clear();
@@ -180,18 +351,34 @@ public:
 		int disc;
 		int disc_pos;
 		int dupmax;		// max dups found
+		int nprim, primary, supp, psing;	// primary records, mapped primary, supplementary, mapped primary w/unmapped mate
 	} dat;
 	vector<int> visize;		// all insert sizes
 	google::dense_hash_map<std::string, scoverage> covr;	// # mapped per ref seq
-	google::sparse_hash_map<std::string, int> dups;		// alignments by read-id (not necessary for some pipes)
-	google::sparse_hash_map<std::string, fqent> petab;		// peread table
+	readidx dups;			// alignments by read-id (not necessary for some pipes)
+	matetab *mates;			// paired fastq output
+	string fqbuf;
+	void dofq(const string &name, int bits, const string &seq, const char *qual);
 
 	// file-format neutral ... called per read... warning seq/qual are not necessarily null-terminated
 	void dostats(string name, int rlen, int bits, const string &ref, int pos, int mapq, const string &materef, int nmate, const string &seq, const char *qual, int nm, int del, int ins);
 
 	// read a bam/sam file and call dostats over and over
 	bool parse_bam(const char *in);
+	bool parse_bam_mt(const char *in);
+	bool parse_bam_regions(const char *in, bam_index_t *idx);
 	bool parse_sam(FILE *f);
+	void dostats_bam(bam1_t *al, const bam_header_t *h);
+	void dostats_bam_str(bam1_t *al, const bam_header_t *h);
+	void addcovr(scoverage *sc, const char *ref, int pos, int rlen);
+
+	// bam input: coverage by target id, so there's no name lookup per read
+	vector<scoverage> tcovr;
+	void bam_targets(const bam_header_t *h);
+	void bam_fold(const bam_header_t *h);
+
+	// fold another set of stats (ie: from a different region of the same file) into this one
+	void merge(sstats &s);
 };
 
 #define T_A 0
@@ -205,14 +392,280 @@ void build_basemap();
 int dupreads = 1000000;
 int max_chr = 1000;
 bool trackdup=0;
+bool flagdup=0;
+int bam_threads=1;
+#define BAM_BATCH 256
 FILE *sefq = NULL;
 FILE *pefq1 = NULL;
 FILE *pefq2 = NULL;
 int basemap[256];
+
+// pending mates for paired fastq output
+// records are packed into an arena: 2 bits per base, qual byte per base with the high bit marking an N
+// once the arena is over budget, everything pending is spilled to temp files partitioned by name hash,
+// finish() then joins each partition (plus what's still in ram) on its own
+#define MATE_PARTS 64
+class matetab {
+public:
+	size_t budget;			// bytes of arena before spilling
+	FILE *fq1, *fq2;
+	long long paired, orphans, spilled;
+	int spills;
+
+	matetab(size_t bytes, FILE *o1, FILE *o2) : budget(bytes), fq1(o1), fq2(o2), paired(0), orphans(0), spilled(0), spills(0), live(0) {
+		memset(parts, 0, sizeof(parts));
+		clear();
+	}
+	~matetab() {
+		int i;
+		for (i=0;i<MATE_PARTS;++i)
+			if (parts[i]) fclose(parts[i]);
+	}
+
+	// first = this is read 1 of the pair (flag 0x40)
+	void add(const char *name, int nlen, bool first, const char *seq, const char *qual, int len) {
+		uint64_t h = readidx::hash(name, nlen);
+		long long i = find(h, name, nlen, first);
+		if (i >= 0) {
+			write_pair(&arena[tab[i].off], name, nlen, first, seq, qual, len);
+			kill(i);
+			return;
+		}
+		if (arena.size() > budget)
+			spill();
+		insert(h, pack(h, name, nlen, first, seq, qual, len));
+	}
+
+	// join whatever got spilled with what's left, one partition at a time
+	void finish() {
+		int p;
+		if (!spills) {
+			orphans += live;
+			clear();
+			return;
+		}
+		spill();
+		for (p=0;p<MATE_PARTS;++p) {
+			if (!parts[p]) continue;
+			if (fflush(parts[p]) || ferror(parts[p]))
+				failed("writing", parts[p]);
+			rewind(parts[p]);
+			clear();
+			uint32_t rlen;
+			while (fread(&rlen, sizeof(rlen), 1, parts[p]) == 1) {
+				size_t o = arena.size();
+				arena.resize(o+rlen);
+				if (fread(&arena[o], 1, rlen, parts[p]) != rlen)
+					failed("reading", parts[p]);
+				rec r(&arena[o]);
+				long long m = find(r.hash, r.name, r.nlen, r.first);
+				if (m >= 0) {
+					rec a(&arena[tab[m].off]);
+					if (a.first)
+						write_rec(fq1, fq2, a, r);
+					else
+						write_rec(fq1, fq2, r, a);
+					kill(m);
+					arena.resize(o);
+				} else {
+					insert(r.hash, o);
+				}
+			}
+			if (ferror(parts[p]))
+				failed("reading", parts[p]);
+			orphans += live;
+			fclose(parts[p]);
+			parts[p]=NULL;
+		}
+		clear();
+	}
+
+private:
+	vector<char> arena;
+	struct slot { uint64_t hash; long long off; };	// off -1 = empty, -2 = deleted
+	vector<slot> tab;
+	size_t used;		// non-empty slots, including deleted
+	size_t live;
+	FILE *parts[MATE_PARTS];
+
+	// view of a packed record
+	struct rec {
+		uint64_t hash;
+		uint32_t size, len;
+		uint16_t nlen;
+		bool first;
+		const char *name;
+		const unsigned char *seq, *qual;
+		rec(const char *p) {
+			memcpy(&size, p, 4);
+			memcpy(&hash, p+4, 8);
+			memcpy(&len, p+12, 4);
+			memcpy(&nlen, p+16, 2);
+			first = p[18];
+			name = p+19;
+			seq = (const unsigned char *) name + nlen;
+			qual = seq + (len+3)/4;
+		}
+		void unpack(string &s, string &q) const {
+			uint32_t i;
+			s.resize(len);
+			q.resize(len);
+			for (i=0;i<len;++i) {
+				unsigned char c = qual[i];
+				s[i] = (c & 0x80) ? 'N' : "ACGT"[(seq[i>>2] >> ((i&3)*2)) & 3];
+				q[i] = c & 0x7f;
+			}
+		}
+	};
+
+	void clear() {
+		arena.clear();
+		tab.assign(1<<12, slot());
+		size_t i;
+		for (i=0;i<tab.size();++i) tab[i].off=-1;
+		used=live=0;
+	}
+
+	size_t pack(uint64_t h, const char *name, int nlen, bool first, const char *seq, const char *qual, int len) {
+		uint32_t size = 19 + nlen + (len+3)/4 + len;
+		uint16_t nl = nlen;
+		uint32_t l = len;
+		size_t o = arena.size();
+		arena.resize(o+size);
+		char *p = &arena[o];
+		memcpy(p, &size, 4);
+		memcpy(p+4, &h, 8);
+		memcpy(p+12, &l, 4);
+		memcpy(p+16, &nl, 2);
+		p[18] = first;
+		memcpy(p+19, name, nlen);
+		unsigned char *s = (unsigned char *) p+19+nlen;
+		unsigned char *q = s + (len+3)/4;
+		memset(s, 0, (len+3)/4);
+		int i;
+		for (i=0;i<len;++i) {
+			int b = basemap[(unsigned char) seq[i]];
+			q[i] = qual[i] & 0x7f;
+			if (b == T_N) {
+				q[i] |= 0x80;
+				b = 0;
+			}
+			s[i>>2] |= b << ((i&3)*2);
+		}
+		return o;
+	}
+
+	// slot of the other mate, or -1
+	long long find(uint64_t h, const char *name, int nlen, bool first) {
+		size_t mask = tab.size()-1;
+		size_t i = h & mask;
+		while (tab[i].off != -1) {
+			if (tab[i].off >= 0 && tab[i].hash == h) {
+				rec r(&arena[tab[i].off]);
+				if (r.nlen == nlen && r.first != first && !memcmp(r.name, name, nlen))
+					return i;
+			}
+			i = (i+1) & mask;
+		}
+		return -1;
+	}
+
+	// mate was found, drop the slot (the arena space is reclaimed at the next spill)
+	void kill(long long i) {
+		tab[i].off = -2;
+		--live;
+	}
+
+	void insert(uint64_t h, size_t off) {
+		if ((used+1)*4 > tab.size()*3)
+			rehash();
+		size_t mask = tab.size()-1;
+		size_t i = h & mask;
+		while (tab[i].off >= 0)
+			i = (i+1) & mask;
+		if (tab[i].off == -1) ++used;
+		tab[i].hash = h;
+		tab[i].off = off;
+		++live;
+	}
+
+	void rehash() {
+		vector<slot> old;
+		old.swap(tab);
+		// only grow if the table is really full of live entries
+		size_t n = live*2 > old.size() ? old.size()*2 : old.size();
+		tab.resize(n);
+		size_t i;
+		for (i=0;i<n;++i) tab[i].off=-1;
+		used=0;
+		for (i=0;i<old.size();++i) {
+			if (old[i].off >= 0) {
+				size_t j = old[i].hash & (n-1);
+				while (tab[j].off != -1)
+					j = (j+1) & (n-1);
+				tab[j]=old[i];
+				++used;
+			}
+		}
+	}
+
+	// write everything pending to the partition files, then start over
+	void spill() {
+		size_t i;
+		for (i=0;i<tab.size();++i) {
+			if (tab[i].off < 0) continue;
+			int p = (tab[i].hash >> 58) % MATE_PARTS;
+			if (!parts[p] && !(parts[p] = tmpfile())) {
+				warn("Can't create temp file for pending mates: %s\n", strerror(errno));
+				exit(1);
+			}
+			const char *r = &arena[tab[i].off];
+			uint32_t size;
+			memcpy(&size, r, 4);
+			if (fwrite(&size, sizeof(size), 1, parts[p]) != 1 || fwrite(r, 1, size, parts[p]) != size)
+				failed("writing", parts[p]);
+			++spilled;
+		}
+		if (live)
+			++spills;
+		clear();
+	}
+
+	// a lost spill file would silently drop mates from the output
+	static void failed(const char *what, FILE *f) {
+		warn("Error %s temp file for pending mates: %s\n", what, ferror(f) ? strerror(errno) : "truncated");
+		exit(1);
+	}
+
+	void write_pair(const char *stored, const char *name, int nlen, bool first, const char *seq, const char *qual, int len) {
+		rec a(stored);
+		string s, q;
+		a.unpack(s, q);
+		if (first) {
+			fprintf(fq1,"@%.*s 1\n%.*s\n+\n%.*s\n", nlen, name, len, seq, len, qual);
+			fprintf(fq2,"@%.*s 2\n%s\n+\n%s\n", nlen, name, s.c_str(), q.c_str());
+		} else {
+			fprintf(fq1,"@%.*s 1\n%s\n+\n%s\n", nlen, name, s.c_str(), q.c_str());
+			fprintf(fq2,"@%.*s 2\n%.*s\n+\n%.*s\n", nlen, name, len, seq, len, qual);
+		}
+		++paired;
+	}
+
+	void write_rec(FILE *o1, FILE *o2, const rec &r1, const rec &r2) {
+		string s, q;
+		r1.unpack(s, q);
+		fprintf(o1,"@%.*s 1\n%s\n+\n%s\n", r1.nlen, r1.name, s.c_str(), q.c_str());
+		r2.unpack(s, q);
+		fprintf(o2,"@%.*s 2\n%s\n+\n%s\n", r2.nlen, r2.name, s.c_str(), q.c_str());
+		++paired;
+	}
+};
+
 int main(int argc, char **argv) {
 	const char *ext = NULL;
 	bool multi=0, newonly=0, inbam=0;
     int fq_out=0;
+    int fq_mem=1000;
     const char *rnafile = NULL;
 	char c;
 	optind = 0;
@@ -223,10 +676,11 @@ int main(int argc, char **argv) {
     int long_index=0;
     const char *prefix;
 
-    while ( (c = getopt_long(argc, argv, "?BzArR:Ddx:MhS:", long_options, &long_index)) != -1) {
+    while ( (c = getopt_long(argc, argv, "?BzArR:Ddx:MhPS:t:m:", long_options, &long_index)) != -1) {
                 switch (c) {
                 case 'd': ++debug; break;                                       // increment debug level
                 case 'D': ++trackdup; break;
+                case 'P': flagdup=1; break;                                    // -D without the read-id table
                 case 'B': inbam=1; break;
                 case 'A': max_chr=1000000; break;                               // max chrom
                 case 'R': rnafile=optarg;                                       // pass through
@@ -236,12 +690,14 @@ int main(int argc, char **argv) {
                 case 'x': ext=optarg; break;
                 case 'M': newonly=1; break;
                 case 'z': allow_no_reads = true; break;
+                case 'm': fq_mem=atoi(optarg); break;                          // mate table budget, in mb
+                case 't': bam_threads=atoi(optarg); break;                     // bgzf inflate threads
                 case 'o': fq_out=1; trackdup=1; break;                     // output suff
                 case 'h': usage(stdout); return 0;
                 case '?':
                      if (!optopt) {
                         usage(stdout); return 0;
-                     } else if (optopt && strchr("ox", optopt))
+                     } else if (optopt && strchr("RxStm", optopt))
                        fprintf (stderr, "Option -%c requires an argument.\n", optopt);
                      else if (isprint(optopt))
                        fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -275,6 +731,7 @@ int main(int argc, char **argv) {
 	// for each input file
 	for (;optind < argc;++optind) {
 		sstats s;
+		matetab *mates=NULL;
 		const char *in = argv[optind];
 		FILE *f;
 		FILE *o=NULL;
@@ -282,7 +739,7 @@ int main(int argc, char **argv) {
 		bool needpclose = 0;
 
 		// decide input format
-		string out;
+		string out, fqbase;
 
 		if (!strcmp(in,"-")) {
 			// read sam/bam from stdin
@@ -343,9 +800,12 @@ int main(int argc, char **argv) {
 					out=in;
 			}
             if (fq_out) {
+                fqbase=out;
                 sefq=fopen((out+".fq").c_str(),"w");
                 pefq1=fopen((out+".fq1").c_str(),"w");
                 pefq2=fopen((out+".fq2").c_str(),"w");
+                if (pefq1 && pefq2)
+                    s.mates = mates = new matetab((size_t) fq_mem * 1024 * 1024, pefq1, pefq2);
             }
 			if (ext) {
 				( out += '.') += ext;
@@ -404,16 +864,23 @@ int main(int argc, char **argv) {
             continue;
         } 
 
+        if (mates) {
+            mates->finish();
+            debugout("mates: %lld paired, %lld orphans, %lld spilled in %d runs\n", mates->paired, mates->orphans, mates->spilled, mates->spills);
+            delete mates;
+            s.mates = mates = NULL;
+        }
+
         if (fq_out) {
             if(sefq && s.dat.pe) {
                 fclose(sefq);
-                unlink((out+".fq").c_str());
+                unlink((fqbase+".fq").c_str());
             }
             if (pefq1 && !s.dat.pe) {
                 fclose(pefq1);
                 fclose(pefq2);
-                unlink((out+".fq1").c_str());
-                unlink((out+".fq2").c_str());
+                unlink((fqbase+".fq1").c_str());
+                unlink((fqbase+".fq2").c_str());
             }
         }
 
@@ -434,19 +901,19 @@ int main(int argc, char **argv) {
 		// mapped reads is the number of reads that mapped at least once (either mated or not)
 		if (s.dat.mapn > 0) {
 			if (trackdup && s.dat.dupmax > (s.dat.pe+1)) {
-				google::sparse_hash_map<string,int>::iterator it = s.dups.begin();
-				vector<int> vtmp;
 				int amb = 0;
 				int sing = 0;
-				while(it!=s.dups.end()) {
+				size_t di;
+				for (di=0;di<s.dups.tab.size();++di) {
+					int cnt = s.dups.tab[di].cnt;
+					if (!s.dups.tab[di].hi) continue;
 					// *not* making the distinction between 2 singleton mappings and 1 paired here
-					if (it->second > (s.dat.pe+1)) {
+					if (cnt > (s.dat.pe+1)) {
 						++amb;
 					}
-					if (it->second == 1 && s.dat.pe) {
+					if (cnt == 1 && s.dat.pe) {
 						++sing;	
 					}
-					++it;
 				}
                 int mapped = (int) s.dups.size()*(s.dat.pe+1)-sing;
 
@@ -465,6 +932,15 @@ int main(int argc, char **argv) {
 					fprintf(o,"singleton mappings\t%.d\n", sing);
 				// number of total mappings
 				fprintf(o, "total mappings\t%d\n", s.dat.mapn);
+			} else if (flagdup) {
+				// primary alignments are reads, secondary/supplementary ones are the extra mappings
+				fprintf(o, "mapped reads\t%d\n", s.dat.primary);
+				fprintf(o, "pct align\t%.6f\n", 100.0*(double)s.dat.primary/(double)s.dat.nprim);
+				if (s.dat.supp > 0)
+					fprintf(o, "supplementary\t%d\n", s.dat.supp);
+				if (s.dat.psing && s.dat.pe)
+					fprintf(o,"singleton mappings\t%.d\n", s.dat.psing);
+				fprintf(o, "total mappings\t%d\n", s.dat.mapn);
 			} else {
 				// dup-id's not tracked
 				fprintf(o, "mapped reads\t%d\n", s.dat.mapn);
@@ -476,6 +952,13 @@ int main(int argc, char **argv) {
 			fprintf(o, "mapped reads\t%d\n", s.dat.mapn);
 		}
 
+		if (trackdup) {
+			fprintf(o, "dup index bytes\t%lu\n", (unsigned long) s.dups.bytes());
+			fprintf(o, "dup index collision rate\t%.6f\n", s.dups.collision_rate());
+			if (s.dups.nhash())
+				fprintf(o, "dup index hashed names\t%lu\n", (unsigned long) s.dups.nhash());
+		}
+
         if (s.dat.mapzero > 0) {
 			fprintf(o, "skipped mappings\t%d\n", s.dat.mapzero);
         }
@@ -677,6 +1160,10 @@ int main(int argc, char **argv) {
 void sstats::dostats(string name, int rlen, int bits, const string &ref, int pos, int mapq, const string &materef, int nmate, const string &seq, const char *qual, int nm, int del, int ins) {
 
 	++dat.n;
+	if (!(bits & 0x900)) ++dat.nprim;   // primary record
+
+	if (sefq || mates)
+		dofq(name, bits, seq, qual);
 
 	if (bits & 0x04) return;       // bits say ... query was not mapped
 
@@ -713,6 +1200,13 @@ void sstats::dostats(string name, int rlen, int bits, const string &ref, int pos
 
 	if (bits & 256) 
         ++dat.secondary;            // secondary alignment
+	if (bits & 0x800)
+        ++dat.supp;                 // supplementary (chimeric) alignment
+	else if (!(bits & 256)) {
+        ++dat.primary;              // primary alignment
+        if ((bits & 0x9) == 0x9)
+            ++dat.psing;            // ... with an unmapped mate
+    }
 
     // mapping quality mean/stdev
 	dat.mapsum += mapq;
@@ -736,36 +1230,7 @@ void sstats::dostats(string name, int rlen, int bits, const string &ref, int pos
 	if (ref.length()) {
 		scoverage *sc = &(covr[ref]);
 		if (sc) {                               // and we have ram for coverage
-			sc->mapb+=rlen;                     // total up mapped bases in that ref
-            if (rnamode) {                      // more detailed
-                int i;
-			    sc->mapr+=1;
-                for (i=0;i<rlen;++i) {          // walk along read
-                    sc->spos.Push(pos+i);       // per-position stats
-                }
-			    if (histnum > 0 && sc->reflen > 0) {                                // if we're making a histogram
-                    for (i=0;i<rlen;++i) {                                          // walk along read
-				        int x = histnum * ((double)(pos+i) / sc->reflen);           // find the bucket this base is in
-                        if (x < histnum) {                                          
-                            sc->dist[x]+=1;                                         // add 1 to that bucket
-                        } else {
-                            // out of bounds.... what to do?
-                            sc->dist[histnum] += 1;                                 // out of bounds bases (fall off the edge) = extra bucket
-                        }
-                    }
-                }
-            } else if (histnum > 0 && sc->reflen > 0) {                             // lightweight... don't deal with each base, ok becauss CHRs are big
-				int x = histnum * ((double)pos / sc->reflen);
-				if (debug > 1) { 
-					warn("chr: %s, hn: %d, pos: %d, rl: %d, x: %x\n", ref.c_str(), histnum, pos, sc->reflen, x);
-				}
-				if (x < histnum) {
-                    sc->dist[x]+=rlen;
-				} else {
-					// out of bounds.... what to do?
-					sc->dist[histnum] +=rlen;
-				}
-			}
+			addcovr(sc, ref.c_str(), pos, rlen);
 		}
 	}
     // total mapped bases += read length
@@ -817,63 +1282,129 @@ void sstats::dostats(string name, int rlen, int bits, const string &ref, int pos
 			name.resize(p);
         }
 
-        /// remove up to flowcell serial number... in case this is a mixture
-        if (((p = name.find_first_of(':'))!=string::npos) ) {
-            if (((p = name.find_first_of(':', p+1))!=string::npos) ) {
-                name=name.substr(p+1);
-                // D0H4MACXX:3:2307:8426:193536
-                if (((p = name.find_first_of(':'))!=string::npos) ) {
-                    if (((p = name.find_first_of(':', p+1))!=string::npos) ) {
-                        if (isdigit(name[p+1])) {
-                            struct id_t { uint16_t i1, i2; uint32_t i3; };
-                            if (((name.length()-p-1)-1) > (sizeof(struct id_t)+1)) {
-                                struct id_t id;
-                                if (sscanf(name.data()+p+1,"%hu:%hu:%u", &id.i1, &id.i2, &id.i3) == 3) {
-                                    * (struct id_t *) (void *) (name.data()+p+1) = id;
-                                    name.resize(p+1+sizeof(id_t));
-                                }
-                            }
-                        }
-                    }
-                } 
-            }
-        }
-
         // count dups for that id
-		int x=++dups[name];
+		int x=dups.add(name.data(), name.length());
 
         // keep track of max dups
 		if (x>dat.dupmax) 
 			dat.dupmax=x;
 
-        // fastq-output mode... 
-        if (sefq) {
-            // if the data isn't paired end or if we're not sure yet
-            if (!dat.pe || dat.mapn < 1000) {
-                // output a single end fq
-                fprintf(sefq,"@%s\n%s\n+\n%s\n",name.c_str(), seq.c_str(), qual);
-            }
-        }
+	}
+}
 
-        // if we're outputting paired-end fastq's and if there's not a lot of dups
-        if (pefq1 && x < 4 && (dat.pe || dat.mapn < 1000)) {
-            fqent fq;
-            google::sparse_hash_map<string,fqent>::iterator it=petab.find(name);
-            // find my mate?
-            if (it == petab.end()) {
-                // no, add me
-                fq.r=seq;
-                fq.q=qual;
-                fq.bits=bits&0x40;                  // mate flag
-                petab[name]=fq;
-            } else if (it->second.bits != bits) {
-                // yes? remove me
-                fq=it->second;
-                fprintf(pefq1,"@%s 1\n%s\n+\n%s\n",name.c_str(), fq.r.c_str(), fq.q.c_str());
-                fprintf(pefq2,"@%s 2\n%s\n+\n%s\n",name.c_str(), seq.c_str(), qual);
-                petab.erase(it); 
-            }
-        }
+// fastq output for one entry, mapped or not
+void sstats::dofq(const string &name, int bits, const string &seq, const char *qual) {
+	if (bits & 0x900) return;               // secondary/supplementary, the read was already output
+
+	// @HWI-ST1131:111228:C0B0NACXX:2:1101:1230:2118 1:N:0 ... ignore stuff after a space
+	size_t nlen = name.find_first_of(' ');
+	if (nlen == string::npos) nlen = name.length();
+
+	int i, len = seq.length();
+	const char *s = seq.data(), *q = qual;
+	if (bits & 0x10) {
+		// reverse aligned, put the read back the way it came off the sequencer
+		fqbuf.resize(len*2);
+		for (i=0;i<len;++i) {
+			fqbuf[len-i-1] = comp(s[i]);
+			fqbuf[len+len-i-1] = q[i];
+		}
+		s = fqbuf.data();
+		q = fqbuf.data()+len;
+	}
+
+	// if the data isn't paired end or if we're not sure yet
+	if (sefq && (!dat.pe || dat.mapn < 1000))
+		fprintf(sefq,"@%.*s\n%.*s\n+\n%.*s\n", (int) nlen, name.data(), len, s, len, q);
+
+	if (mates && (bits & 0x1) && (dat.pe || dat.mapn < 1000))
+		mates->add(name.data(), nlen, bits & 0x40, s, q, len);
+}
+
+// add a mapped read to a reference's coverage
+void sstats::addcovr(scoverage *sc, const char *ref, int pos, int rlen) {
+	sc->mapb+=rlen;                         // total up mapped bases in that ref
+	if (rnamode) {                          // more detailed
+		int i;
+		sc->mapr+=1;
+		for (i=0;i<rlen;++i) {              // walk along read
+			sc->spos.Push(pos+i);           // per-position stats
+		}
+		if (histnum > 0 && sc->reflen > 0) {                                // if we're making a histogram
+			for (i=0;i<rlen;++i) {                                          // walk along read
+				int x = histnum * ((double)(pos+i) / sc->reflen);           // find the bucket this base is in
+				if (x < histnum) {
+					sc->dist[x]+=1;                                         // add 1 to that bucket
+				} else {
+					// out of bounds.... what to do?
+					sc->dist[histnum] += 1;                                 // out of bounds bases (fall off the edge) = extra bucket
+				}
+			}
+		}
+	} else if (histnum > 0 && sc->reflen > 0) {                             // lightweight... don't deal with each base, ok becauss CHRs are big
+		int x = histnum * ((double)pos / sc->reflen);
+		if (debug > 1) {
+			warn("chr: %s, hn: %d, pos: %d, rl: %d, x: %x\n", ref, histnum, pos, sc->reflen, x);
+		}
+		if (x < histnum) {
+			sc->dist[x]+=rlen;
+		} else {
+			// out of bounds.... what to do?
+			sc->dist[histnum] +=rlen;
+		}
+	}
+}
+
+void sstats::merge(sstats &s) {
+	int i;
+	dat.n+=s.dat.n;
+	dat.mapn+=s.dat.mapn;
+	dat.secondary+=s.dat.secondary;
+	dat.mapzero+=s.dat.mapzero;
+	if (s.dat.lenmax > dat.lenmax) dat.lenmax = s.dat.lenmax;
+	if (s.dat.lenmin && (s.dat.lenmin < dat.lenmin || dat.lenmin==0)) dat.lenmin = s.dat.lenmin;
+	dat.lensum+=s.dat.lensum;
+	dat.lenssq+=s.dat.lenssq;
+	dat.mapsum+=s.dat.mapsum;
+	dat.mapssq+=s.dat.mapssq;
+	dat.nmnz+=s.dat.nmnz;
+	dat.nmsum+=s.dat.nmsum;
+	dat.nbase+=s.dat.nbase;
+	if (s.dat.qualmax > dat.qualmax) dat.qualmax = s.dat.qualmax;
+	if (s.dat.qualmin < dat.qualmin) dat.qualmin = s.dat.qualmin;
+	dat.qualsum+=s.dat.qualsum;
+	dat.qualssq+=s.dat.qualssq;
+	dat.nrev+=s.dat.nrev;
+	dat.nfor+=s.dat.nfor;
+	dat.tmapb+=s.dat.tmapb;
+	for (i=0;i<5;++i)
+		dat.basecnt[i]+=s.dat.basecnt[i];
+	dat.del+=s.dat.del;
+	dat.ins+=s.dat.ins;
+	dat.pe|=s.dat.pe;
+	dat.disc+=s.dat.disc;
+	dat.disc_pos+=s.dat.disc_pos;
+	dat.nprim+=s.dat.nprim;
+	dat.primary+=s.dat.primary;
+	dat.supp+=s.dat.supp;
+	dat.psing+=s.dat.psing;
+
+	vmapq.merge(s.vmapq);
+	visize.insert(visize.end(), s.visize.begin(), s.visize.end());
+
+	google::dense_hash_map<string,scoverage>::iterator cit;
+	for (cit=s.covr.begin();cit!=s.covr.end();++cit)
+		covr[cit->first].merge(cit->second);
+
+	// same read can align in more than one region, so the max has to be found again
+	if (s.dat.dupmax > dat.dupmax) dat.dupmax = s.dat.dupmax;
+	size_t di;
+	for (di=0;di<s.dups.tab.size();++di) {
+		const readidx::ent &e = s.dups.tab[di];
+		if (!e.hi) continue;
+		int x = dups.add(e.hi, e.lo, e.cnt);
+		if (x>dat.dupmax)
+			dat.dupmax=x;
 	}
 }
 
@@ -951,27 +1482,143 @@ bool sstats::parse_sam(FILE *f) {
 		if (d[S_CIG][0] == '*') d[S_POS] = (char *) "-1";
 
         // as-if it were a bam...
-		dostats(d[S_ID],strlen(d[S_READ]),atoi(d[S_BITS]),d[S_NMO],atoi(d[S_POS]),atoi(d[S_MAPQ]),d[S_MATEREF],atoi(d[S_MATE]),d[S_READ],d[S_QUAL],nm, ins, del);
+		dostats(d[S_ID],strlen(d[S_READ]),atoi(d[S_BITS]),d[S_NMO],atoi(d[S_POS]),atoi(d[S_MAPQ]),d[S_MATEREF],atoi(d[S_MATE]),d[S_READ],d[S_QUAL],nm, del, ins);
 	}
 	return true;
 }
 
-// let samtools parse the bam
-bool sstats::parse_bam(const char *in) {
-    samfile_t *fp;
-    if (!(fp=samopen(in, "rb", NULL))) {
-            warn("Error reading '%s': %s\n", in, strerror(errno));
-            return false;
+// bam 4-bit base codes to T_ indexes, anything ambiguous is an N
+static const int nt16_base[16] = {T_N, T_A, T_C, T_N, T_G, T_N, T_N, T_N, T_T, T_N, T_N, T_N, T_N, T_N, T_N, T_N};
+
+// size the per-target coverage table from the bam header
+void sstats::bam_targets(const bam_header_t *h) {
+    int i;
+    tcovr.resize(h->n_targets);
+    for (i = 0; i < h->n_targets; ++i) {
+        covr[h->target_name[i]].reflen=h->target_len[i];
+        tcovr[i].reflen=h->target_len[i];
     }
-    if (fp->header) {
-        int i;
-        for (i = 0; i < fp->header->n_targets; ++i) {
-            covr[fp->header->target_name[i]].reflen=fp->header->target_len[i];
-        }
+}
+
+// move per-target coverage into covr, keyed by name
+void sstats::bam_fold(const bam_header_t *h) {
+    int i;
+    for (i = 0; i < tcovr.size() && i < h->n_targets; ++i) {
+        covr[h->target_name[i]].merge(tcovr[i]);
     }
-	bam1_t *al=bam_init1();
-    int ret=0;
-    while ( (ret=samread(fp, al)) > 0 ) {
+    tcovr.clear();
+}
+
+// one bam record ... same as dostats, but straight from the packed record: no strings, no hashing
+void sstats::dostats_bam(bam1_t *al, const bam_header_t *h) {
+    if (sefq || mates) {
+        // fastq output needs the strings
+        dostats_bam_str(al, h);
+        return;
+    }
+
+    const bam1_core_t *c = &al->core;
+    int i;
+
+	++dat.n;
+	if (!(c->flag & 0x900)) ++dat.nprim;
+
+	if (c->flag & 0x04) return;             // not mapped
+
+	if (c->n_cigar == 0 || c->pos < 0) {    // no cigar isn't really a match, this deals with bwa's issue
+	    ++dat.mapzero;
+        return;
+    }
+
+	++dat.mapn;
+
+    int rlen = c->l_qseq;
+	if (rlen > dat.lenmax) dat.lenmax = rlen;
+	if ((rlen < dat.lenmin) || dat.lenmin==0) dat.lenmin = rlen;
+	dat.lensum += rlen;
+	dat.lenssq += rlen*rlen;
+
+	if (c->flag & 16)
+	    if (c->flag & 0x40)
+    		++dat.nrev;
+		else
+            ++dat.nfor;
+	else
+	    if (c->flag & 0x40)
+		    ++dat.nfor;
+        else
+		    ++dat.nrev;
+
+	if (c->flag & 256)
+        ++dat.secondary;
+	if (c->flag & 0x800)
+        ++dat.supp;
+	else if (!(c->flag & 256)) {
+        ++dat.primary;
+        if ((c->flag & 0x9) == 0x9)
+            ++dat.psing;
+    }
+
+	dat.mapsum += c->qual;
+	dat.mapssq += c->qual*c->qual;
+    vmapq.push(c->qual);
+
+    uint8_t *tag=bam_aux_get(al, "NM");
+	int nm = tag ? bam_aux2i(tag) : 0;
+	int ins=0, del=0;
+    uint32_t *cig = bam1_cigar(al);
+	for (i=0;i<c->n_cigar;++i) {
+        int op = cig[i] & BAM_CIGAR_MASK;
+		if (op == BAM_CINS) {
+			ins+=(cig[i] >> BAM_CIGAR_SHIFT);
+		} else if (op == BAM_CDEL) {
+			del+=(cig[i] >> BAM_CIGAR_SHIFT);
+		}
+	}
+	if (nm > 0) {
+		dat.nmnz += 1;
+		dat.nmsum += nm-del-ins;
+	}
+	dat.del+=del;
+	dat.ins+=ins;
+
+	if (c->tid >= 0 && c->tid < tcovr.size())
+		addcovr(&tcovr[c->tid], h->target_name[c->tid], c->pos+1, rlen);
+
+	dat.tmapb+=rlen;
+	if (c->isize>0) {
+		visize.push_back(c->isize);
+		dat.pe=1;
+	}
+
+	if (c->mtid >= 0 && c->mtid != c->tid) {
+		dat.disc++;
+	} else if (abs(c->isize) > 50000) {
+		dat.disc_pos++;
+	}
+
+    // qualities are stored without the +33, bases 2 to a byte
+    uint8_t *qual = bam1_qual(al);
+    uint8_t *bamseq = bam1_seq(al);
+	for (i=0;i<rlen;++i) {
+        char q = qual[i]+33;
+		if (q>dat.qualmax) dat.qualmax=q;
+		if (q<dat.qualmin) dat.qualmin=q;
+		dat.qualsum+=q;
+		dat.qualssq+=q*q;
+		++dat.basecnt[nt16_base[bam1_seqi(bamseq, i)]];
+	}
+	dat.nbase+=rlen;
+
+	if (trackdup) {
+		int x = dups.add(bam1_qname(al), c->l_qname-1);
+		if (x>dat.dupmax)
+			dat.dupmax=x;
+	}
+}
+
+// one bam record ... decode and call dostats
+void sstats::dostats_bam_str(bam1_t *al, const bam_header_t *h) {
         uint32_t *cig = bam1_cigar(al);
         char *name = bam1_qname(al);
         int len = al->core.l_qseq;
@@ -1003,8 +1650,225 @@ bool sstats::parse_bam(const char *in) {
         }
 
         // now do stats
-		dostats(name,len,al->core.flag,al->core.tid>=0?fp->header->target_name[al->core.tid]:"",al->core.pos+1,al->core.qual, al->core.mtid>=0?fp->header->target_name[al->core.mtid]:"", al->core.isize, seq, qual, nm, ins, del);
+		dostats(name,len,al->core.flag,al->core.tid>=0?h->target_name[al->core.tid]:"",al->core.pos+1,al->core.qual, al->core.mtid>=0?h->target_name[al->core.mtid]:"", al->core.isize, seq, qual, nm, del, ins);
+}
+
+// returns the index for in, or NULL if there isn't one
+static bam_index_t *find_bam_index(const char *in) {
+    string fn = string(in) + ".bai";
+    if (access(fn.c_str(), R_OK)) {
+        const char *p = strrchr(in, '.');
+        if (!p || strcmp(p, ".bam"))
+            return NULL;
+        fn = string(in, p-in) + ".bai";
+        if (access(fn.c_str(), R_OK))
+            return NULL;
+    }
+    return bam_index_load(in);
+}
+
+// let samtools parse the bam
+bool sstats::parse_bam(const char *in) {
+    if (bam_threads > 1) {
+        bam_index_t *idx;
+        // fastq output depends on read order, so it can't be split up
+        if (!sefq && !pefq1 && strcmp(in, "-") && (idx=find_bam_index(in)))
+            return parse_bam_regions(in, idx);
+        return parse_bam_mt(in);
+    }
+
+    samfile_t *fp;
+    if (!(fp=samopen(in, "rb", NULL))) {
+            warn("Error reading '%s': %s\n", in, strerror(errno));
+            return false;
+    }
+    bam_targets(fp->header);
+	bam1_t *al=bam_init1();
+    int ret=0;
+    while ( (ret=samread(fp, al)) > 0 ) {
+        dostats_bam(al, fp->header);
 	}
+    bam_destroy1(al);
+    bam_fold(fp->header);
+    if (ret < -2) {
+            // no stats .. corrupt file
+            return false;
+    }
+    if (ret < -1) {
+        ++errs;
+        // truncated file, output stats, but return error code
+        return true;
+    }
+	return true;
+}
+
+// same as parse_bam, but bgzf blocks are inflated ahead by a pool of threads
+bool sstats::parse_bam_mt(const char *in) {
+    mtbam mt;
+    if (!mt.open(in, bam_threads)) {
+            if (bam_is_be) {
+                bam_threads=1;
+                return parse_bam(in);
+            }
+            warn("Error reading '%s': %s\n", in, strerror(errno));
+            return false;
+    }
+    int i;
+    bam_targets(mt.header);
+
+    bam1_t *batch[BAM_BATCH];
+    for (i=0;i<BAM_BATCH;++i)
+        batch[i]=bam_init1();
+
+    int n, ret=0;
+    do {
+        n = mt.read_batch(batch, BAM_BATCH, &ret);
+        for (i=0;i<n;++i)
+            dostats_bam(batch[i], mt.header);
+    } while (ret > 0);
+
+    for (i=0;i<BAM_BATCH;++i)
+        bam_destroy1(batch[i]);
+    bam_fold(mt.header);
+
+    if (ret < -2) {
+            // no stats .. corrupt file
+            return false;
+    }
+    if (ret < -1) {
+        ++errs;
+        // truncated file, output stats, but return error code
+        return true;
+    }
+	return true;
+}
+
+// shared by the region workers
+struct region_job {
+    const char *in;
+    bam_index_t *idx;
+    bam_header_t *h;
+    int next;                   // next tid to hand out
+    bool tail;                  // someone read through to the end, unplaced reads included
+    pthread_mutex_t lock;
+};
+
+struct region_worker {
+    region_job *job;
+    sstats *s;
+    int ret;
+};
+
+static void *region_thread(void *arg) {
+    region_worker *w = (region_worker *) arg;
+    region_job *job = w->job;
+    bamFile fp = bam_open(job->in, "r");
+    if (!fp) {
+        w->ret = -3;
+        return NULL;
+    }
+    bam1_t *al=bam_init1();
+    for (;;) {
+        int t;
+        pthread_mutex_lock(&job->lock);
+        t = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (t >= job->h->n_targets)
+            break;
+
+        // the iterator finds the first record for t, after that it's a plain sequential read
+        bam_iter_t iter = bam_iter_query(job->idx, t, 0, 1<<29);
+        int ret = bam_iter_read(fp, iter, al);
+        bam_iter_destroy(iter);
+        bool any = ret > 0;
+        while (ret > 0) {
+            // sorted input: only the last populated reference is followed by unplaced reads
+            if (al->core.tid >= 0 && al->core.tid != t)
+                break;
+            w->s->dostats_bam(al, job->h);
+            ret = bam_read1(fp, al);
+        }
+        if (any && ret <= 0) {
+            pthread_mutex_lock(&job->lock);
+            job->tail = true;
+            pthread_mutex_unlock(&job->lock);
+        }
+        if (ret < w->ret)
+            w->ret = ret;
+    }
+    bam_destroy1(al);
+    bam_close(fp);
+    return NULL;
+}
+
+// indexed bam: one sstats per worker thread, each handed whole references, merged at the end
+bool sstats::parse_bam_regions(const char *in, bam_index_t *idx) {
+    bamFile fp;
+    bam_header_t *h;
+    if (!(fp=bam_open(in, "r")) || !(h=bam_header_read(fp))) {
+            warn("Error reading '%s': %s\n", in, strerror(errno));
+            if (fp) bam_close(fp);
+            bam_index_destroy(idx);
+            return false;
+    }
+    bam_close(fp);
+
+    int i, nt = min(bam_threads, h->n_targets);
+    if (nt < 1) nt = 1;
+
+    region_job job;
+    job.in=in;
+    job.idx=idx;
+    job.h=h;
+    job.next=0;
+    job.tail=false;
+    pthread_mutex_init(&job.lock, NULL);
+    debugout("splitting %s over %d threads by reference\n", in, nt);
+
+    vector<region_worker> w(nt);
+    vector<pthread_t> tids(nt);
+    for (i=0;i<nt;++i) {
+        w[i].job=&job;
+        w[i].s=new sstats;
+        w[i].ret=0;
+        w[i].s->bam_targets(h);
+        pthread_create(&tids[i], NULL, region_thread, &w[i]);
+    }
+
+    bam_targets(h);
+
+    int ret = 0;
+    for (i=0;i<nt;++i) {
+        pthread_join(tids[i], NULL);
+        w[i].s->bam_fold(h);
+        merge(*w[i].s);
+        delete w[i].s;
+        if (w[i].ret < ret)
+            ret = w[i].ret;
+    }
+
+    if (!job.tail) {
+        // no reference has reads, so nobody ran into the unplaced ones ... they're all that's left
+        bam1_t *al=bam_init1();
+        bam_header_t *th;
+        if ((fp=bam_open(in, "r")) && (th=bam_header_read(fp))) {
+            while ((i=bam_read1(fp, al)) > 0)
+                dostats_bam(al, h);
+            if (i < ret)
+                ret = i;
+            bam_header_destroy(th);
+        } else {
+            ret = -3;
+        }
+        if (fp) bam_close(fp);
+        bam_destroy1(al);
+        bam_fold(h);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    bam_header_destroy(h);
+    bam_index_destroy(idx);
+
     if (ret < -2) {
             // no stats .. corrupt file
             return false;
@@ -1027,6 +1891,8 @@ void usage(FILE *f) {
 "Options (default in parens):\n"
 "\n"
 "-D             Keep track of multiple alignments\n"
+"-P             Count multiple alignments by secondary/supplementary flags,\n"
+"               instead of by read id (less ram, needs an aligner that sets them)\n"
 "-O PREFIX      Output prefix enabling extended output (see below)\n"
 "-R FIL         Coverage/RNA output (coverage, 3' bias, etc, implies -A)\n"
 "-A             Report all chr sigs, even if there are more than 1000\n"
@@ -1036,6 +1902,9 @@ void usage(FILE *f) {
 "-M             Only overwrite if newer (requires -x, or multiple files)\n"
 "-B             Input is bam, don't bother looking at magic\n"
 "-z             Don't fail when zero entries in sam\n"
+"--fastq        Write reads back out to <file>.fq, or <file>.fq1/.fq2 if paired\n"
+"-m INT         Memory for pending mates with --fastq in MB, spills to temp files past that (1000)\n"
+"-t INT         Threads used for bam input, indexed bams are split by reference (1)\n"
 "\n"
 "OUTPUT:\n"
 "\n"
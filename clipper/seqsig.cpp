@@ -1,13 +1,14 @@
 
 #include <iostream>
-#include <sparsehash/sparse_hash_map>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <pthread.h>
 #include "fastq-lib.h"
 
 #include <time.h>
 
-#include <string>
-#include <vector>
-
 #include <stdio.h>
 #include <getopt.h>
 #include <stdarg.h>
@@ -21,7 +22,7 @@ FILE *popenordie(const char *path, const char *mode);
 std::string string_format(const std::string &fmt, ...);
 
 using namespace std;
-void seq2char(uint32_t s, int k, char *p);
+void seq2char(uint64_t s, int k, char *p);
 // true if different
 void compare_files(const char *f1, const char *f2);
 template <class vtype> double quantile(const vtype &vec, double p);
@@ -32,13 +33,381 @@ template <class vtype> double quantile(const vtype &vec, double p);
 
 unsigned long long basemap[256];
 unsigned long long basemaprc[256];
-bool lowcomplex(char *s, int n, int max);
+bool isbase[256];
+bool lowcomplex(const char *s, int n, int max);
 void usage(FILE *f);
 
 // coefficients used to produce the blended similarity score (range 0 to 1, where 1 is identical)
 
 double scoef=.75;
 double qcoef=350;
+
+#define KC_FLAT_K 12                // flat counters up to here (4^12, 64MB), hashed above
+#define KC_EMPTY (~(uint64_t)0)
+#define KC_BATCH 4096               // reads handed to a counting thread at a time
+#define CONTAM_K 25                 // contaminant screen k-mer size
+#define CONTAM_STEP 4               // read k-mers checked against the contaminants, every n
+
+// k-mer counts.  for small k a flat array indexed by k-mer, otherwise an open addressing table,
+// lock-free while adding, grown between batches.  add() may be called from any number of
+// threads, each inside its own begin()/end()
+class kcount {
+    int nthreads;
+    uint32_t *cnt;                  // by k-mer, or by slot
+    uint64_t *keys;                 // by slot, KC_EMPTY if not used
+    uint64_t mask;                  // slots - 1
+    uint64_t used;                  // slots taken
+    pthread_rwlock_t lock;          // shared while adding, exclusive to grow
+
+    static uint64_t mix(uint64_t v) {
+        v ^= v >> 33; v *= 0xff51afd7ed558ccdULL;
+        v ^= v >> 33; v *= 0xc4ceb9fe1a85ec53ULL;
+        return v ^ (v >> 33);
+    }
+    void grow();
+public:
+    int k;
+    bool flat;
+
+    kcount(int k, int nthreads);
+    ~kcount();
+
+    void begin(int n);              // before adding up to n k-mers
+    void end() {if (!flat) pthread_rwlock_unlock(&lock);}
+    void add(uint64_t v) {
+        uint64_t h;
+        if (flat) {
+            h=v;
+        } else {
+            h=mix(v)&mask;
+            for(;;) {
+                uint64_t cur=keys[h];
+                if (cur == v)
+                    break;
+                if (cur == KC_EMPTY) {
+                    if (nthreads == 1) {
+                        keys[h]=v;
+                        ++used;
+                        break;
+                    }
+                    cur=__sync_val_compare_and_swap(&keys[h], KC_EMPTY, v);
+                    if (cur == KC_EMPTY) {
+                        __sync_fetch_and_add(&used, 1);
+                        break;
+                    }
+                    if (cur == v)
+                        break;
+                }
+                h=(h+1)&mask;
+            }
+        }
+        if (nthreads == 1)
+            ++cnt[h];
+        else
+            __sync_fetch_and_add(&cnt[h], 1);
+    }
+
+    bool has(uint64_t v) {
+        if (flat)
+            return cnt[v] > 0;
+        uint64_t h=mix(v)&mask;
+        while (keys[h] != KC_EMPTY) {
+            if (keys[h] == v)
+                return true;
+            h=(h+1)&mask;
+        }
+        return false;
+    }
+
+    // walk with slot(i) for i < slots(), zero counts are empty
+    uint64_t slots() {return mask+1;}
+    uint32_t slot(uint64_t i, uint64_t *v) {*v = flat ? i : keys[i]; return cnt[i];}
+};
+
+kcount::kcount(int kk, int nt) {
+    k=kk;
+    nthreads=nt;
+    flat=k<=KC_FLAT_K;
+    used=0;
+    keys=NULL;
+    mask=flat ? (1ULL<<(2*k))-1 : (1<<20)-1;
+    cnt=(uint32_t *) calloc(mask+1, sizeof(*cnt));
+    if (!flat) {
+        keys=(uint64_t *) malloc((mask+1)*sizeof(*keys));
+        memset(keys, 0xff, (mask+1)*sizeof(*keys));
+    }
+    if (!cnt || (!flat && !keys)) {
+        fail("Out of memory for k=%d\n", k);
+    }
+    pthread_rwlock_init(&lock, NULL);
+}
+
+kcount::~kcount() {
+    free(cnt);
+    free(keys);
+    pthread_rwlock_destroy(&lock);
+}
+
+// every thread could add n new keys before the next check, so there's room for all of them
+void kcount::begin(int n) {
+    if (flat)
+        return;
+    for(;;) {
+        pthread_rwlock_rdlock(&lock);
+        if (used + (uint64_t) n*nthreads <= (mask+1)/4*3)
+            return;
+        pthread_rwlock_unlock(&lock);
+        pthread_rwlock_wrlock(&lock);
+        if (used + (uint64_t) n*nthreads > (mask+1)/4*3)
+            grow();
+        pthread_rwlock_unlock(&lock);
+    }
+}
+
+void kcount::grow() {
+    uint64_t i, n=mask+1;
+    uint32_t *ocnt=cnt;
+    uint64_t *okeys=keys;
+    mask=n*2-1;
+    cnt=(uint32_t *) calloc(mask+1, sizeof(*cnt));
+    keys=(uint64_t *) malloc((mask+1)*sizeof(*keys));
+    if (!cnt || !keys) {
+        fail("Out of memory for k=%d\n", k);
+    }
+    memset(keys, 0xff, (mask+1)*sizeof(*keys));
+    for (i=0;i<n;++i) {
+        if (okeys[i] != KC_EMPTY) {
+            uint64_t h=mix(okeys[i])&mask;
+            while (keys[h] != KC_EMPTY)
+                h=(h+1)&mask;
+            keys[h]=okeys[i];
+            cnt[h]=ocnt[i];
+        }
+    }
+    free(ocnt);
+    free(okeys);
+}
+
+// contaminant screen: every canonical k-mer of the contaminant sequences, and reads are checked
+// every few positions.  a read sharing enough of them is dropped, like the unmapped-only bowtie pipe
+static void contam_load(kcount &kc, const char *path) {
+    FILE *f=zopenordie(path, "r");
+    char *s=NULL; size_t a=0; int l;
+    int k=kc.k, i, run=0;
+    uint64_t kmask=~(((uint64_t) ~0) << (k*2));
+    uint64_t fwd=0, rc=0;
+    while ((l=getline(&s, &a, f)) > 0) {
+        if (s[0]=='>') {
+            run=0;
+            continue;
+        }
+        kc.begin(l);
+        for (i=0;i<l;++i) {
+            unsigned char c=s[i];
+            if (c=='\n' || c=='\r')
+                continue;
+            if (!isbase[c]) {
+                run=0;
+                continue;
+            }
+            uint64_t b=basemap[c];
+            fwd=(fwd>>2)|(b<<(2*(k-1)));
+            rc=((rc<<2)|(3-b))&kmask;
+            if (++run >= k)
+                kc.add(min(fwd, rc));
+        }
+        kc.end();
+    }
+    free(s);
+    fclose(f);
+}
+
+// contaminant k-mers in the read, stops counting at max
+static int contam_hits(kcount &kc, const char *s, int n, int max) {
+    int k=kc.k, i, run=0, hits=0;
+    uint64_t kmask=~(((uint64_t) ~0) << (k*2));
+    uint64_t fwd=0, rc=0;
+    for (i=0;i<n;++i) {
+        unsigned char c=s[i];
+        if (!isbase[c]) {
+            run=0;
+            continue;
+        }
+        uint64_t b=basemap[c];
+        fwd=(fwd>>2)|(b<<(2*(k-1)));
+        rc=((rc<<2)|(3-b))&kmask;
+        if (++run >= k && (run-k) % CONTAM_STEP == 0 && kc.has(min(fwd, rc)) && ++hits >= max)
+            break;
+    }
+    return hits;
+}
+
+// reads that pass the filters, shared by the counting threads
+struct sig_input {
+    FILE *fin;
+    bool sam;
+    bool canon;                     // whole reads, canonical k-mers
+    int k;
+    int sampsize;                   // 0 is all of them
+    int lowcom_count;
+    float lowcom_pct;
+    int n;
+    int nread;                      // records read, passed or not
+    int skiplow;
+    kcount *contam;                 // in-process contaminant screen, if any
+    int contam_min;                 // shared k-mers to drop a read
+    int skipcontam;
+    bool done;
+    int batches;                    // raw batches handed out
+    int turn;                       // next batch to be taken, in input order
+    pthread_mutex_t lock;
+    pthread_cond_t next;
+};
+
+#define SIG_KEEP 0
+#define SIG_LOW 1
+#define SIG_CONTAM 2
+
+struct sig_worker {
+    sig_input *in;
+    kcount *kc;
+    pthread_t tid;
+    struct fq fq;
+    string raw;                     // batch as read, concatenated
+    vector<int> rawlens;
+    vector<char> why;               // SIG_KEEP, or the filter that dropped it
+    string seqs;                    // reads that passed
+    vector<int> lens;
+};
+
+// the filters, outside the lock
+static int sig_filter(sig_input *in, const char *s, int &n) {
+    if (in->contam && contam_hits(*in->contam, s, n, in->contam_min) >= in->contam_min)
+        return SIG_CONTAM;
+
+    int lowcom_count=in->lowcom_count;
+    if (in->canon) {
+        lowcom_count=n * in->lowcom_pct;
+    } else if (n > 32) {                // only first 32 bases considered
+        n = 32;
+    }
+
+    if (lowcomplex(s, n, lowcom_count))
+        return SIG_LOW;
+
+    // skip too short
+    if (n < in->k)
+        return SIG_LOW;
+
+    return SIG_KEEP;
+}
+
+// raw batches are read in input order under the lock, filtered by each thread, then taken in
+// the order they were read, so the sample is the same with any number of threads
+static bool sig_batch(sig_worker *w) {
+    sig_input *in=w->in;
+    int i;
+    w->seqs.clear();
+    w->lens.clear();
+    while (w->lens.empty()) {
+        w->raw.clear();
+        w->rawlens.clear();
+        pthread_mutex_lock(&in->lock);
+        if (in->done) {
+            pthread_mutex_unlock(&in->lock);
+            return false;
+        }
+        int seq=in->batches++;
+        while (!in->done && w->rawlens.size() < KC_BATCH) {
+            if (!(in->sam ? read_fq_sam(in->fin, in->nread, &w->fq) : read_fq(in->fin, in->nread, &w->fq))) {
+                in->done=true;
+                break;
+            }
+            ++in->nread;
+            w->raw.append(w->fq.seq.s, w->fq.seq.n);
+            w->rawlens.push_back(w->fq.seq.n);
+        }
+        pthread_mutex_unlock(&in->lock);
+
+        const char *s=w->raw.data();
+        w->why.resize(w->rawlens.size());
+        for (i=0;i<w->rawlens.size();++i) {
+            int n=w->rawlens[i];
+            w->why[i]=sig_filter(in, s, n);
+            if (w->why[i] == SIG_KEEP) {
+                w->seqs.append(s, n);
+                w->lens.push_back(n);
+            }
+            s+=w->rawlens[i];
+        }
+
+        // take them, in turn, until the sample is full: drop what's past it, and don't count it
+        pthread_mutex_lock(&in->lock);
+        while (in->turn != seq)
+            pthread_cond_wait(&in->next, &in->lock);
+        int kept=0, klen=0;
+        for (i=0;i<w->why.size();++i) {
+            if (in->sampsize && in->n >= in->sampsize) {
+                in->done=true;
+                break;
+            }
+            if (w->why[i] == SIG_CONTAM) {
+                ++in->skipcontam;
+            } else if (w->why[i] == SIG_LOW) {
+                ++in->skiplow;
+            } else {
+                ++in->n;
+                klen+=w->lens[kept++];
+            }
+        }
+        ++in->turn;
+        pthread_cond_broadcast(&in->next);
+        pthread_mutex_unlock(&in->lock);
+        w->lens.resize(kept);
+        w->seqs.resize(klen);
+    }
+    return true;
+}
+
+// k-mers, first base in the low bits: forward, with anything that's not ACGT read as A, which is
+// the original signature, or canonical (the lower of it and its reverse complement), skipping
+// anything that's not ACGT
+static void sig_read(kcount &kc, const char *s, int n, bool canon) {
+    int k=kc.k, i, run=0;
+    uint64_t kmask=~(((uint64_t) ~0) << (k*2));
+    uint64_t fwd=0, rc=0;
+    for (i=0;i<n;++i) {
+        uint64_t b=basemap[(unsigned char)s[i]];
+        if (canon && !isbase[(unsigned char)s[i]]) {
+            run=0;
+            continue;
+        }
+        fwd=(fwd>>2)|(b<<(2*(k-1)));
+        if (canon)
+            rc=((rc<<2)|(3-b))&kmask;
+        if (++run >= k)
+            kc.add(canon ? min(fwd, rc) : fwd);
+    }
+}
+
+static void *sig_count(void *arg) {
+    sig_worker *w=(sig_worker *) arg;
+    int i, k=w->kc->k;
+    while (sig_batch(w)) {
+        int nk=0;
+        for (i=0;i<w->lens.size();++i)
+            nk+=w->lens[i]-k+1;
+        w->kc->begin(nk);
+        const char *s=w->seqs.data();
+        for (i=0;i<w->lens.size();++i) {
+            sig_read(*w->kc, s, w->lens[i], w->in->canon);
+            s+=w->lens[i];
+        }
+        w->kc->end();
+    }
+    return NULL;
+}
+
 int main(int argc, char **argv) {
     int i;
     clock_t clock1;
@@ -46,14 +415,16 @@ int main(int argc, char **argv) {
     clock1=clock();
 
     meminit(basemap);
+    meminit(isbase);
     for (i=0;i<4;++i) {
         basemap[("acgt")[i]]=i;
         basemap[("ACGT")[i]]=i;
+        isbase[("acgt")[i]]=isbase[("ACGT")[i]]=true;
         basemaprc[("tgca")[i]]=i;
         basemaprc[("TGCA")[i]]=i;
     }
 
-    // max 16... lower values result in better sensitivity, lower specificity expecially with blended/mixed samples
+    // max 31... lower values result in better sensitivity, lower specificity expecially with blended/mixed samples
 
     int k=12;
     int x=200;
@@ -66,6 +437,9 @@ int main(int argc, char **argv) {
     // run comparison on args?
     bool docompare=0;
 
+    bool canon=0;                   // whole reads, canonical k-mers
+    int nthreads=1;
+
 
     char c;
     char *endp;
@@ -73,26 +447,32 @@ int main(int argc, char **argv) {
     int inc=0;
 
     char *contampath=NULL;
+    char *contamfa=NULL;            // screened in-process
+    int contam_min=2;
 
-    while ( (c = getopt_long(argc, argv, "chk:x:n:l:t:d:m:r:S:Q:",NULL,NULL)) != -1) {
+    while ( (c = getopt_long(argc, argv, "chak:x:n:l:t:d:m:r:R:s:S:Q:p:",NULL,NULL)) != -1) {
         switch (c) {
             case 'h': usage(stdout); return 0;
             case 'c': docompare=1; break;
             case 'x': x=atoi(optarg); break;
-            case 'k': k=atoi(optarg); if(k>16) fail("Max k is 16\n"); break;
+            case 'a': canon=1; break;
+            case 'p': nthreads=atoi(optarg); break;
+            case 'k': k=atoi(optarg); if(k>31) fail("Max k is 31\n"); break;
             case 'n': sampsize=atoi(optarg); break;
             case 'l': lowcom_pct=strtod(optarg,&endp); break;
             case 't': ftop=strtod(optarg,&endp); break;
             case 'S': scoef=strtod(optarg,&endp); break;
             case 'Q': qcoef=strtod(optarg,&endp); break;
             case 'r': contampath=optarg; break;
+            case 'R': contamfa=optarg; break;
+            case 's': contam_min=atoi(optarg); break;
             case 'd': fdel=strtod(optarg,&endp); break;
             case 'm': fmin=strtod(optarg,&endp); break;
             case '\1': inf[++inc]=optarg; break;
             case '?':
                       if (!optopt) {
                           usage(stdout); return 0;
-                      } else if (optopt && strchr("kxnltdmrSQ", optopt))
+                      } else if (optopt && strchr("kxnltdmrRsSQp", optopt))
                           fprintf (stderr, "Option -%c requires an argument.\n", optopt);
                       else if (isprint(optopt))
                           fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -111,7 +491,11 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    if (!x || !k || !sampsize || ftop<.8 || ftop > 1 || fdel > ftop || fmin > ftop || inc < 1) {
+    if (contampath && contamfa) {
+        fail("Only one of -r or -R\n");
+    }
+
+    if (!x || !k || sampsize < 0 || nthreads < 1 || contam_min < 1 || ftop<.8 || ftop > 1 || fdel > ftop || fmin > ftop || inc < 1) {
         fail("Bad params, quitting\n");
     }
 
@@ -133,101 +517,79 @@ int main(int argc, char **argv) {
         fin=zopenordie(in,"r");
     }
 
-    struct fq fq;
-
-    meminit(fq);
-    int n=0;
-
-    google::sparse_hash_map<uint32_t, int> kh;
-
-    std::string mer, scnt;
-    mer.resize(k);
-    int *pdat;
-    int kcnt=0;
-    unsigned long long lm; //, lmrc;
-    unsigned long long kmask=~(((unsigned long long) ~0) << (k*2));
-//    printf("kmask:%llx\n",kmask);
-
-   
+    sig_input inp;
+    inp.fin=fin;
+    inp.sam=contampath!=NULL;
+    inp.canon=canon;
+    inp.k=k;
+    inp.sampsize=sampsize;
 // minimum # of low-complexity positions in 32 bases to be called "low complexity"
-    int lowcom_count = 32 * lowcom_pct;
-    int skiplow=0;
-    while (contampath?read_fq_sam(fin,n,&fq):read_fq(fin, n, &fq)) {
-
-        if (fq.seq.n > 32)          // only first 32 bases considered
-            fq.seq.n = 32;
-
-        // sequence as 64-bit value
-        lm=0;
-//        lmrc=0;
-
-        if (lowcomplex(fq.seq.s, fq.seq.n, lowcom_count)) {
-            ++skiplow;
-            continue;
-        }
-
-//        printf("s:%s\n", fq.seq.s);
-
-// skip too short
-        if (fq.seq.n < k) {
-            ++skiplow;
-            continue;
-        }
-
-        ++n;
-
-        for(i=0;i<fq.seq.n;++i) {   // map to 64 bit sequence
-            lm=lm|(basemap[fq.seq.s[i]]<<(i*2));
-            // lmrc=(lmrc<<2)|basemaprc[fq.seq.s[i]];
-        }
-//        printf("orig: %s\n", string(fq.seq.s,32).c_str());
-//        printf("s:%s,lm:%llx\n",fq.seq.s,lm);
-        for (i=0;i<fq.seq.n-k+1;++i) {  // create unint_16_t kmers
-            uint32_t v=lm&kmask;
-            if (!kh[v]) ++kcnt;
-            kh[v]++;
-//            printf("i:%d,v:%hx\n",i,v);
-            lm=lm>>2;               // remove first base
-
-            // reverse
-
-//            char t[33];
-//            seq2char(v, k, t);
+    inp.lowcom_count = 32 * lowcom_pct;
+    inp.lowcom_pct = lowcom_pct;
+    inp.n=0;
+    inp.nread=0;
+    inp.skiplow=0;
+    inp.contam=NULL;
+    inp.contam_min=contam_min;
+    inp.skipcontam=0;
+    inp.done=false;
+    inp.batches=0;
+    inp.turn=0;
+    pthread_mutex_init(&inp.lock, NULL);
+    pthread_cond_init(&inp.next, NULL);
+
+    kcount kh(k, nthreads);
+
+    if (contamfa) {
+        inp.contam=new kcount(CONTAM_K, 1);
+        contam_load(*inp.contam, contamfa);
+    }
 
-//            printf("orig: %s, lm: %llx, asv: %hx, mapped: %s\n", string(fq.seq.s+i,k).c_str(), lm, v, t);
-        }
-        if (n>=sampsize) break;
+    // worker 0 is this thread
+    vector<sig_worker> w(nthreads);
+    for (i=0;i<nthreads;++i) {
+        w[i].in=&inp;
+        w[i].kc=&kh;
+        meminit(w[i].fq);
+        if (i)
+            pthread_create(&w[i].tid, NULL, sig_count, &w[i]);
     }
+    sig_count(&w[0]);
+    for (i=1;i<nthreads;++i)
+        pthread_join(w[i].tid, NULL);
+
+    int n=inp.n;
+    int skiplow=inp.skiplow;
     if (n==0) {
         fail("Insufficient sequence content\n");
     }
 
-//    printf("entries: %d\n", kcnt);
-
-
-    struct {uint32_t s; int v;} topx[x]; meminit(topx);
-
-    google::sparse_hash_map<uint32_t,int>::iterator it = kh.begin();
+    // top x by count, ties to the lower k-mer, and the distribution of counts
+    typedef pair<uint32_t, uint64_t> kval;
+    struct worse {
+        bool operator()(const kval &a, const kval &b) const {return a.first > b.first || (a.first == b.first && a.second < b.second);}
+    };
+    priority_queue<kval, vector<kval>, worse> top;      // worst on top
     vector<int> dist;
-    while(it!=kh.end()) {
-        // *not* making the distinction between 2 singleton mappings and 1 paired here
-        int val = it->second;
+    uint64_t si;
+    for (si=0;si<kh.slots();++si) {
+        uint64_t v;
+        uint32_t val=kh.slot(si, &v);
+        if (!val)
+            continue;
         dist.push_back(val);
-        if (val > topx[x-1].v) {
-            for (i=0;i<x;++i) {
-                if (val > topx[i].v) {
-                    break;
-                }
-            }
-            int found=i;
-            // shift remaining down (max 8 shifts)
-            for (i=x-1;i>found;--i) {
-                topx[i]=topx[i-1];
-            }
-            topx[found].v=val;
-            topx[found].s=it->first;
+        kval e(val, v);
+        if (top.size() < x) {
+            top.push(e);
+        } else if (worse()(e, top.top())) {
+            top.pop();
+            top.push(e);
         }
-        ++it;
+    }
+    vector<kval> topx(x, kval(0, 0));
+    for (i=top.size()-1;i>=0;--i) {
+        topx[i]=top.top();
+        top.pop();
     }
     sort(dist.begin(),dist.end());
 
@@ -240,9 +602,13 @@ int main(int argc, char **argv) {
     printf("q-delta\t%.3f\n", fdel);
     printf("q-min\t%.3f\n", fmin);
     printf("reads-used\t%d\n", n);
+    if (canon)
+        printf("canonical\t1\n");
     printf("lowcom-pct\t%.3f\n", lowcom_pct*100);
     printf("quantile-top\t%f\n", qtop);
     printf("skip-low\t%d\n", skiplow);
+    if (contamfa)
+        printf("skip-contam\t%d\n", inp.skipcontam);
     printf("run-time\t%f\n", (clock()-clock1)/(double)CLOCKS_PER_SEC);
 
     printf("--------\n");
@@ -250,8 +616,8 @@ int main(int argc, char **argv) {
     int j;
     char buf[k+1];
     for (i=0;i<x;++i) {
-        seq2char(topx[i].s, k, buf);
-        printf("%s %.3f\n", buf, topx[i].v/qtop);
+        seq2char(topx[i].second, k, buf);
+        printf("%s %.3f\n", buf, topx[i].first/qtop);
     }
 
     printf("--------\n");
@@ -297,7 +663,7 @@ FILE *popenordie(const char *cmd, const char *mode) {
 
 
 
-void seq2char(uint32_t s, int k, char *p) {
+void seq2char(uint64_t s, int k, char *p) {
     int i;
     for(i=0;i<k;++i) {
         *p++=("ACGT")[(s>>(i<<1))&0x3];
@@ -305,7 +671,7 @@ void seq2char(uint32_t s, int k, char *p) {
     *p='\0';
 }
 
-bool lowcomplex(char *s, int n, int lowcom_thresh) {
+bool lowcomplex(const char *s, int n, int lowcom_thresh) {
     int lc=0;
     int i;
 
@@ -326,18 +692,18 @@ bool lowcomplex(char *s, int n, int lowcom_thresh) {
     return lc > lowcom_thresh;
 }
 
-uint32_t char2seq(char *p, int k) {
+uint64_t char2seq(char *p, int k) {
     int i;
-    uint32_t r=0;
+    uint64_t r=0;
     for(i=0;i<k;++i) {   // map to 64 bit sequence
         r=r|(basemap[p[i]]<<(i*2));
     }
     return r;
 }
 
-uint32_t char2seqrc(char *p, int k) {
+uint64_t char2seqrc(char *p, int k) {
     int i;
-    uint32_t r=0;
+    uint64_t r=0;
     for(i=0;i<k;++i) {   // map to 64 bit sequence
         r=r<<2|(basemaprc[p[i]]);
     }
@@ -355,14 +721,15 @@ public:
     double fdel;            // delta
     double fmin;            // min quality
     double lowcom_pct;      // complexity filter used
+    int canon;              // whole reads, canonical k-mers
     string fn;              // file read from (if any)
     int qvx;                // number of entries in quantile vector
 
     void read(const char *file);
 
     typedef struct {
-        uint32_t seq;       // sequence
-        uint32_t rcseq;     // reverse complement of same
+        uint64_t seq;       // sequence
+        uint64_t rcseq;     // reverse complement of same
         int lev;
     } ent;
 
@@ -378,7 +745,7 @@ public:
     sig() {init();};
     ~sig() {clear();};
 
-    void init() {svec=NULL;svx=qvx=n=k=0;qvec=NULL;};
+    void init() {svec=NULL;svx=qvx=n=k=canon=0;qvec=NULL;};
     void clear() {if(svec) free(svec); if (qvec) free(qvec); init();}
 
     sig::comp compare(sig &other);
@@ -426,6 +793,8 @@ void sig::read(const char *file) {
             lowcom_pct=v/100;
         } else if (!strcmp(s, "reads-used")) {
             n=v;
+        } else if (!strcmp(s, "canonical")) {
+            canon=v;
         }
     }
 
@@ -459,7 +828,7 @@ void sig::read(const char *file) {
 }
 
 sig::comp sig::compare(sig &o) {
-    if (svx!=o.svx || k!=o.k || fmin != o.fmin || fdel != o.fdel || ftop != o.ftop || lowcom_pct != o.lowcom_pct) {
+    if (svx!=o.svx || k!=o.k || fmin != o.fmin || fdel != o.fdel || ftop != o.ftop || lowcom_pct != o.lowcom_pct || canon != o.canon) {
         fail("Can't compare sigs with different parameters\n");
     }
     // influences certainty
@@ -547,14 +916,18 @@ void usage(FILE *f) {
 "Generate qsig files for fastqs, or compare them\n"
 "\n"
 "Sig generation options:\n"
-"    -k INT    kmer size (12)\n"
+"    -k INT    kmer size (12), up to 31\n"
 "    -x INT    number of top kmers to output (200)\n"
-"    -n INT    number of reads to use (500000)\n"
+"    -n INT    number of reads to use (500000), 0 for all\n"
+"    -a        count canonical kmers in whole reads, instead of the first 32 bases\n"
+"    -p INT    threads (1)\n"
 "    -l REAL   low complexity filter (0.40), where 1 is no filter\n"
 "    -t REAL   top quantile to use (0.90)\n"
 "    -d REAL   quantile delta to iterate (0.15)\n"
 "    -m REAL   minimum quantile to output/test (0.50)\n"
 "    -r FASTA  bowtie indexed file of contamination/spike-ins to ignore\n"
+"    -R FASTA  contamination/spike-ins to ignore, screened in-process (no bowtie)\n"
+"    -s INT    with -R, drop reads sharing this many %d-mers (2), checked every %d bases\n"
 "\n"
 "Comparison options:\n"
 "    -Q REAL   quantile coefficient for score output (350)\n"
@@ -563,7 +936,7 @@ void usage(FILE *f) {
 "Misc options:\n"
 "    -h        this help\n"
 "\n"
-    ,VERSION);
+    ,VERSION, CONTAM_K, CONTAM_STEP);
 }
 
 std::string string_format(const std::string &fmt, ...) {
@@ -0,0 +1,424 @@
+/*
+$Id$
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "sw-lib.h"
+
+using namespace std;
+
+#define NEG_INF (INT_MIN/2)
+
+sw_profile::sw_profile(const char *query, int m, int x, int ge, int go) {
+    q = query;
+    qlen = q.size();
+    match = m;
+    mismatch = x;
+    gap_ext = ge;
+    gap_open = go;
+    bias = mismatch < 0 ? -mismatch : 0;
+
+    // 16 lanes of 8, 8 lanes of 16
+    seg8 = (qlen+15)/16;
+    seg16 = (qlen+7)/8;
+    if (!seg8) seg8 = 1;
+    if (!seg16) seg16 = 1;
+
+    prof8 = NULL;
+    prof16 = NULL;
+    mem = NULL;
+#ifdef __SSE2__
+    void *p;
+    if (posix_memalign(&p, 16, 256*seg8*16))
+        return;
+    prof8 = (unsigned char *) p;
+    if (posix_memalign(&p, 16, 256*seg16*16))
+        return;
+    prof16 = (short *) p;
+    // H in, H out and E, the 16 bit version is the bigger one
+    if (posix_memalign(&mem, 16, 3*seg16*16))
+        return;
+
+    int c, i, k;
+    for (c=0;c<256;++c) {
+        for (i=0;i<seg8;++i) {
+            for (k=0;k<16;++k) {
+                int pos = k*seg8+i;
+                prof8[(c*seg8+i)*16+k] = pos < qlen ? sub(q[pos], c)+bias : 0;
+            }
+        }
+        for (i=0;i<seg16;++i) {
+            for (k=0;k<8;++k) {
+                int pos = k*seg16+i;
+                prof16[(c*seg16+i)*8+k] = pos < qlen ? sub(q[pos], c) : mismatch;
+            }
+        }
+    }
+#endif
+}
+
+sw_profile::~sw_profile() {
+    free(prof8);
+    free(prof16);
+    free(mem);
+}
+
+int sw_profile::best(const char *t, int lo, int hi, int *qend, int *tend) {
+    const unsigned char *u = (const unsigned char *) t;
+    *qend = *tend = 0;
+    if (lo >= hi || !qlen)
+        return 0;
+#ifdef __SSE2__
+    if (mem && -gap_open < 256 && -gap_ext < 256 && match+bias < 256) {
+        bool over = false;
+        int s = best8(u, lo, hi, qend, tend, &over);
+        if (!over)
+            return s;
+        s = best16(u, lo, hi, qend, tend, &over);
+        if (!over)
+            return s;
+    }
+#endif
+    return best_plain(u, lo, hi, qend, tend);
+}
+
+#ifdef __SSE2__
+
+static inline int hmax8(__m128i v) {
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 8));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 4));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 2));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 1));
+    return _mm_cvtsi128_si32(v) & 0xff;
+}
+
+static inline int hmax16(__m128i v) {
+    v = _mm_max_epi16(v, _mm_srli_si128(v, 8));
+    v = _mm_max_epi16(v, _mm_srli_si128(v, 4));
+    v = _mm_max_epi16(v, _mm_srli_si128(v, 2));
+    return (short) _mm_extract_epi16(v, 0);
+}
+
+int sw_profile::best8(const unsigned char *t, int lo, int hi, int *qend, int *tend, bool *over) {
+    int n = seg8, i, j, best = 0;
+    __m128i *pvHStore = (__m128i *) mem;
+    __m128i *pvHLoad = pvHStore + n;
+    __m128i *pvE = pvHLoad + n;
+    memset(mem, 0, 3*n*16);
+
+    const __m128i vZero = _mm_setzero_si128();
+    const __m128i vGapO = _mm_set1_epi8(-gap_open);
+    const __m128i vGapE = _mm_set1_epi8(-gap_ext);
+    const __m128i vBias = _mm_set1_epi8(bias);
+    // past this, adding a match can saturate
+    const int limit = 255 - bias - match;
+
+    for (j=lo;j<hi;++j) {
+        const __m128i *vP = (const __m128i *) (prof8 + t[j]*n*16);
+        __m128i vF = vZero, vMax = vZero, vH, vE, vT;
+
+        // diagonal for lane k's first segment is lane k-1's last
+        vH = _mm_slli_si128(pvHStore[n-1], 1);
+        swap(pvHLoad, pvHStore);
+
+        for (i=0;i<n;++i) {
+            vH = _mm_adds_epu8(vH, vP[i]);
+            vH = _mm_subs_epu8(vH, vBias);
+            vE = pvE[i];
+            vH = _mm_max_epu8(vH, vE);
+            vH = _mm_max_epu8(vH, vF);
+            vMax = _mm_max_epu8(vMax, vH);
+            pvHStore[i] = vH;
+
+            vH = _mm_subs_epu8(vH, vGapO);
+            vE = _mm_subs_epu8(vE, vGapE);
+            pvE[i] = _mm_max_epu8(vE, vH);
+            vF = _mm_subs_epu8(vF, vGapE);
+            vF = _mm_max_epu8(vF, vH);
+
+            vH = pvHLoad[i];
+        }
+
+        // lazy F: carry vertical gaps across lanes until they stop mattering
+        vF = _mm_slli_si128(vF, 1);
+        i = 0;
+        for (;;) {
+            vH = pvHStore[i];
+            vT = _mm_subs_epu8(vH, vGapO);
+            vT = _mm_subs_epu8(vF, vT);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(vT, vZero)) == 0xffff)
+                break;
+            vH = _mm_max_epu8(vH, vF);
+            vMax = _mm_max_epu8(vMax, vH);
+            pvHStore[i] = vH;
+            pvE[i] = _mm_max_epu8(pvE[i], _mm_subs_epu8(vH, vGapO));
+            vF = _mm_subs_epu8(vF, vGapE);
+            if (++i >= n) {
+                i = 0;
+                vF = _mm_slli_si128(vF, 1);
+            }
+        }
+
+        int m = hmax8(vMax);
+        if (m > best) {
+            if (m >= limit) {
+                *over = true;
+                return m;
+            }
+            best = m;
+            *tend = j+1;
+            // first query position with it
+            const unsigned char *h = (const unsigned char *) pvHStore;
+            int k, pos = qlen;
+            for (i=0;i<n;++i)
+                for (k=0;k<16;++k)
+                    if (h[i*16+k] == m && k*n+i < pos)
+                        pos = k*n+i;
+            *qend = pos+1;
+        }
+    }
+    return best;
+}
+
+int sw_profile::best16(const unsigned char *t, int lo, int hi, int *qend, int *tend, bool *over) {
+    int n = seg16, i, j, best = 0;
+    __m128i *pvHStore = (__m128i *) mem;
+    __m128i *pvHLoad = pvHStore + n;
+    __m128i *pvE = pvHLoad + n;
+    memset(mem, 0, 3*n*16);
+
+    const __m128i vZero = _mm_setzero_si128();
+    const __m128i vMin = _mm_set1_epi16(SHRT_MIN);
+    const __m128i vGapO = _mm_set1_epi16(-gap_open);
+    const __m128i vGapE = _mm_set1_epi16(-gap_ext);
+    const int limit = SHRT_MAX - match;
+
+    for (j=lo;j<hi;++j) {
+        const __m128i *vP = (const __m128i *) (prof16 + t[j]*n*8);
+        __m128i vF = vMin, vMax = vZero, vH, vE, vT;
+
+        vH = _mm_slli_si128(pvHStore[n-1], 2);
+        swap(pvHLoad, pvHStore);
+
+        for (i=0;i<n;++i) {
+            vH = _mm_adds_epi16(vH, vP[i]);
+            vH = _mm_max_epi16(vH, vZero);
+            vE = pvE[i];
+            vH = _mm_max_epi16(vH, vE);
+            vH = _mm_max_epi16(vH, vF);
+            vMax = _mm_max_epi16(vMax, vH);
+            pvHStore[i] = vH;
+
+            vH = _mm_subs_epi16(vH, vGapO);
+            vE = _mm_subs_epi16(vE, vGapE);
+            pvE[i] = _mm_max_epi16(vE, vH);
+            vF = _mm_subs_epi16(vF, vGapE);
+            vF = _mm_max_epi16(vF, vH);
+
+            vH = pvHLoad[i];
+        }
+
+        // signed, so what shifts in at the top has to be "no gap", not 0
+        vF = _mm_insert_epi16(_mm_slli_si128(vF, 2), SHRT_MIN, 0);
+        i = 0;
+        for (;;) {
+            vH = pvHStore[i];
+            vT = _mm_subs_epi16(vH, vGapO);
+            if (!_mm_movemask_epi8(_mm_cmpgt_epi16(vF, vT)))
+                break;
+            vH = _mm_max_epi16(vH, vF);
+            vMax = _mm_max_epi16(vMax, vH);
+            pvHStore[i] = vH;
+            pvE[i] = _mm_max_epi16(pvE[i], _mm_subs_epi16(vH, vGapO));
+            vF = _mm_subs_epi16(vF, vGapE);
+            if (++i >= n) {
+                i = 0;
+                vF = _mm_insert_epi16(_mm_slli_si128(vF, 2), SHRT_MIN, 0);
+            }
+        }
+
+        int m = hmax16(vMax);
+        if (m > best) {
+            if (m >= limit) {
+                *over = true;
+                return m;
+            }
+            best = m;
+            *tend = j+1;
+            const short *h = (const short *) pvHStore;
+            int k, pos = qlen;
+            for (i=0;i<n;++i)
+                for (k=0;k<8;++k)
+                    if (h[i*8+k] == m && k*n+i < pos)
+                        pos = k*n+i;
+            *qend = pos+1;
+        }
+    }
+    return best;
+}
+
+#endif
+
+// column at a time Gotoh, same ties as the striped versions
+int sw_profile::best_plain(const unsigned char *t, int lo, int hi, int *qend, int *tend) {
+    vector<int> H(qlen+1, 0), E(qlen+1, NEG_INF);
+    int go = -gap_open, ge = -gap_ext;
+    int i, j, best = 0;
+    for (j=lo;j<hi;++j) {
+        int diag = 0, F = NEG_INF, m = 0, pos = 0;
+        H[0] = 0;
+        for (i=1;i<=qlen;++i) {
+            E[i] = max(E[i]-ge, H[i]-go);
+            int h = max(0, diag + sub(q[i-1], t[j]));
+            h = max(h, max(E[i], F));
+            diag = H[i];
+            H[i] = h;
+            F = max(F-ge, h-go);
+            if (h > m) {
+                m = h;
+                pos = i;
+            }
+        }
+        if (m > best) {
+            best = m;
+            *tend = j+1;
+            *qend = pos;
+        }
+    }
+    return best;
+}
+
+// begin of the alignment ending at qend, tend: anchored there, walking back until the score
+// is made up.  the shortest span in the target wins, then in the query
+bool sw_profile::start(const char *t, int lo, sw_hit &h) {
+    int go = -gap_open, ge = -gap_ext;
+    int qn = h.qend;
+    // gaps in the query cost at least this much each, so the target span is bounded, unless they're free
+    int per = min(go, ge);
+    int w = h.tend - lo;
+    if (per > 0)
+        w = min(w, qn + (match*qn - h.score)/per + 1);
+
+    vector<int> H(qn+1), E(qn+1, NEG_INF);
+    int i, j;
+    H[0] = 0;
+    for (i=1;i<=qn;++i)
+        H[i] = -go-(i-1)*ge;
+    for (j=1;j<=w;++j) {
+        char tc = t[h.tend-j];
+        int diag = H[0], F = NEG_INF;
+        H[0] = -go-(j-1)*ge;
+        for (i=1;i<=qn;++i) {
+            E[i] = max(E[i]-ge, H[i]-go);
+            int x = diag + sub(q[h.qend-i], tc);
+            x = max(x, max(E[i], F));
+            diag = H[i];
+            H[i] = x;
+            F = max(F-ge, x-go);
+        }
+        for (i=1;i<=qn;++i) {
+            if (H[i] == h.score) {
+                h.qbeg = h.qend - i;
+                h.tbeg = h.tend - j;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool sw_profile::align(const char *t, int tlen, sw_hit &h) {
+    h.score = best(t, 0, tlen, &h.qend, &h.tend);
+    return h.score > 0 && start(t, 0, h);
+}
+
+static bool hit_order(const sw_hit &a, const sw_hit &b) {
+    return a.score != b.score ? a.score > b.score : a.tbeg < b.tbeg;
+}
+
+int sw_profile::hits(const char *t, int tlen, int min_score, vector<sw_hit> &out) {
+    out.clear();
+    if (min_score < 1)
+        min_score = 1;
+    // best in a stretch of the target, then the stretches on either side of it
+    vector< pair<int,int> > todo;
+    todo.push_back(pair<int,int>(0, tlen));
+    while (!todo.empty()) {
+        int lo = todo.back().first, hi = todo.back().second;
+        todo.pop_back();
+        if (hi - lo <= 0)
+            continue;
+        sw_hit h;
+        h.score = best(t, lo, hi, &h.qend, &h.tend);
+        if (h.score < min_score || !start(t, lo, h))
+            continue;
+        out.push_back(h);
+        todo.push_back(pair<int,int>(lo, h.tbeg));
+        todo.push_back(pair<int,int>(h.tend, hi));
+    }
+    sort(out.begin(), out.end(), hit_order);
+    return out.size();
+}
+
+// global alignment of the hit's two pieces, with traceback
+void sw_profile::trace(const char *t, const sw_hit &h, string &qrow, string &trow) {
+    int go = -gap_open, ge = -gap_ext;
+    int n = h.qend - h.qbeg, m = h.tend - h.tbeg;
+    const char *a = q.data() + h.qbeg, *b = t + h.tbeg;
+    int w = m+1;
+    vector<int> H((n+1)*w), E((n+1)*w), F((n+1)*w);
+    int i, j;
+    for (i=0;i<=n;++i) {
+        for (j=0;j<=m;++j) {
+            int k = i*w+j;
+            if (!i && !j) {
+                H[k] = 0; E[k] = F[k] = NEG_INF;
+                continue;
+            }
+            E[k] = j ? max(E[k-1]-ge, H[k-1]-go) : NEG_INF;
+            F[k] = i ? max(F[k-w]-ge, H[k-w]-go) : NEG_INF;
+            H[k] = max(E[k], F[k]);
+            if (i && j)
+                H[k] = max(H[k], H[k-w-1] + sub(a[i-1], b[j-1]));
+        }
+    }
+
+    // 0 in H, 1 in E (gap in the query), 2 in F (gap in the target)
+    qrow.clear();
+    trow.clear();
+    int st = 0;
+    i = n; j = m;
+    while (i > 0 || j > 0) {
+        int k = i*w+j;
+        if (st == 0) {
+            if (i && j && H[k] == H[k-w-1] + sub(a[i-1], b[j-1])) {
+                qrow += a[--i];
+                trow += b[--j];
+            } else if (H[k] == E[k]) {
+                st = 1;
+            } else {
+                st = 2;
+            }
+        } else if (st == 1) {
+            qrow += '-';
+            trow += b[--j];
+            if (E[k] == H[k-1]-go)
+                st = 0;
+        } else {
+            qrow += a[--i];
+            trow += '-';
+            if (F[k] == H[k-w]-go)
+                st = 0;
+        }
+    }
+    reverse(qrow.begin(), qrow.end());
+    reverse(trow.begin(), trow.end());
+}
@@ -0,0 +1,73 @@
+/*
+$Id$
+
+Striped Smith-Waterman local alignment (Farrar, Bioinformatics 2007).
+
+A profile is built once for a query and reused for every target, which is
+what you want for a fixed adapter against millions of reads.  Scores run in
+16 8-bit saturating lanes, a target that overflows those is redone in 8
+16-bit lanes, and past that, or without SSE2, in plain code.
+
+Scoring is like seqan's Score<int>: characters match if they're equal, and
+a gap of length k costs gap_open + (k-1)*gap_ext (both negative).
+
+hits() finds every local alignment at or over a score that doesn't overlap
+a better one in the target, like Waterman-Eggert, with the best first.
+Begin positions come from a small anchored pass back from each end, so only
+the scores are striped.  Positions are 0-based, ends are one past.
+*/
+
+#ifndef _SW_LIB_H
+#define _SW_LIB_H
+
+#include <string>
+#include <vector>
+
+struct sw_hit {
+    int score;
+    int qbeg, qend;
+    int tbeg, tend;
+};
+
+class sw_profile {
+public:
+    sw_profile(const char *query, int match=3, int mismatch=-3, int gap_ext=-2, int gap_open=-2);
+    ~sw_profile();
+
+    int length() const {return qlen;}
+
+    // best local score of the query against t[lo,hi), with where it ends, 0 if nothing scores
+    int best(const char *t, int lo, int hi, int *qend, int *tend);
+
+    // the best alignment, begin and end, false if nothing scores
+    bool align(const char *t, int tlen, sw_hit &h);
+
+    // all non-overlapping hits scoring at least min_score, best first, ties by position
+    int hits(const char *t, int tlen, int min_score, std::vector<sw_hit> &out);
+
+    // gapped rows for a hit, '-' for gaps
+    void trace(const char *t, const sw_hit &h, std::string &qrow, std::string &trow);
+
+private:
+    std::string q;
+    int qlen;
+    int match, mismatch, gap_open, gap_ext;
+
+    // profiles: per target character, segments of lanes, query position lane*seg+i
+    int seg8, seg16;
+    unsigned char *prof8;
+    short *prof16;
+    int bias;
+    void *mem;                  // aligned buffers for H and E
+
+    int best8(const unsigned char *t, int lo, int hi, int *qend, int *tend, bool *over);
+    int best16(const unsigned char *t, int lo, int hi, int *qend, int *tend, bool *over);
+    int best_plain(const unsigned char *t, int lo, int hi, int *qend, int *tend);
+    bool start(const char *t, int lo, sw_hit &h);
+    int sub(char a, char b) const {return a == b ? match : mismatch;}
+
+    sw_profile(const sw_profile &);
+    sw_profile &operator=(const sw_profile &);
+};
+
+#endif
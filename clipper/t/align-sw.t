@@ -0,0 +1,47 @@
+use Test::Builder;
+use Test::More;
+use File::Basename qw(dirname);
+
+require (dirname(__FILE__) . "/test-prep.pl");
+
+$prog="$BINDIR/align-sw";
+
+# score and Seq1/Seq2 positions, one pair per line of each hit
+sub hits {
+    my $out = join("", @_);
+    my @h;
+    while ($out =~ /^Score = (\d+)\n(?:.*\n){3}Aligns Seq1\[(\d+):(\d+)\] and Seq2\[(\d+):(\d+)\]/mg) {
+        push @h, "$1 $2:$3 $4:$5";
+    }
+    return join(", ", @h);
+}
+
+# exact match inside a longer target, and one needing a gap (10 matches, one open)
+is(hits(`$prog ACGTTGCA GGACGTTGCATT`), "24 0:7 2:9", "exact match");
+is(hits(`$prog ACGTACGTAC TTACGTTACGTACTT`), "28 0:9 2:12", "gapped");
+ok(`$prog ACGTACGTAC TTACGTTACGTACTT` =~ /^ACG-TACGTAC\n\|\|\| \|\|\|\|\|\|\|\nACGTTACGTAC$/m, "gapped rows");
+is(hits(`$prog -s 25 ACGTTGCA GGACGTTGCATT`), "", "-s drops a weaker hit");
+
+# -a: every non-overlapping hit, best first, down to -s
+my $t = "TTACGTACGGGGACGTACAAAACGAAC";
+is(hits(`$prog -a -s 10 ACGTAC $t`), "18 0:5 2:7, 18 0:5 12:17, 12 0:5 21:26", "-a hit list");
+is(hits(`$prog -a -s 15 ACGTAC $t`), "18 0:5 2:7, 18 0:5 12:17", "-a -s");
+
+# 150 matches score 450, past what the 8-bit lanes hold, 11000 (33000) is past the 16-bit ones
+# a mismatch in the middle keeps it one hit, and only costs match + mismatch
+srand(1);
+my $acgt = "ACGT" x 10;
+for my $len (150, 11000) {
+    my $q = join("", map {substr("ACGT", int(rand(4)), 1)} (1..$len));
+    my $m = $q;
+    substr($m, $len/2, 1) =~ tr/ACGT/CATG/;
+    my $s = 3 * $len;
+    my ($e1, $e2) = ($len-1, $len+1);
+    is(hits(`$prog $q GG${q}CC`), "$s 0:$e1 2:$e2", "$len bases: exact");
+    is(hits(`$prog $q GG${m}CC`), ($s-6) . " 0:$e1 2:$e2", "$len bases: one mismatch");
+    is(hits(`$prog -a -s 100 $acgt ${q}TTTTTT${acgt}TTTTTT`),
+        "120 0:39 " . ($len+6) . ":" . ($len+45), "$len bases: -a, short query after a long target");
+    is(hits(`$prog -a -s 100 $q GG${q}CC${acgt}T`), "$s 0:$e1 2:$e2", "$len bases: -a long hit");
+}
+
+done_testing();
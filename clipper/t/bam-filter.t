@@ -0,0 +1,56 @@
+use Test::Builder;
+use Test::More;
+use File::Basename qw(dirname);
+use File::Compare;
+
+require (dirname(__FILE__) . "/test-prep.pl");
+
+$prog="$BINDIR/bam-filter";
+
+# needs bamtools, which isn't always there
+plan skip_all => "bam-filter isn't built" if ! -x $prog;
+
+# in.bam and both filters are name sorted: 60 names, some with two alignments, some missing NM
+# hashing, the merge joins and the partitions on disk all have to agree
+my $filt = "-f $INDIR/f1.bam -f $INDIR/f2.bam";
+mkdir("$TMPDIR/spill");
+@check = (
+    {param=>"", name=>"hash"},
+    {param=>"-q", name=>"q"},
+    {param=>"-Q", name=>"Q"},
+    {param=>"-p 4 -T $TMPDIR/spill", name=>"p"},
+);
+
+for my $eq ("", "-e", "-m") {
+    for (@check) {
+        my %d = %{$_};
+        my $name = "$d{name}$eq";
+        my ($exit, $ncmd) = run("$prog $eq $d{param} -i $INDIR/in.bam $filt -o $TMPDIR/$name.bam -b $TMPDIR/$name.bad.bam -s $TMPDIR/$name.stats 2> /dev/null");
+        ok($exit == 0, "$name worked ($ncmd)");
+        next if $d{name} eq "hash";
+        for my $x (qw(bam bad.bam stats)) {
+            ok(compare("$TMPDIR/hash$eq.$x", "$TMPDIR/$name.$x") == 0, "$name: $x same as hashing");
+        }
+    }
+}
+ok(`grep '^removed' $TMPDIR/hash.stats` !~ /\t0\t/, "some reads removed");
+
+sub spilled {
+    opendir(my $d, "$TMPDIR/spill");
+    return scalar(grep {!/^\./} readdir($d));
+}
+ok(spilled() == 0, "-p cleans up");
+
+# a pipe can't be read twice, it's an error before anything is spilled
+my ($exit, $ncmd) = run("$prog -p 4 -T $TMPDIR/spill $filt -o $TMPDIR/pipe.bam < $INDIR/in.bam 2> $TMPDIR/pipe.err");
+ok($exit != 0 && `cat $TMPDIR/pipe.err` =~ /pipe/, "-p from stdin rejected ($ncmd)");
+
+# an error after spilling still removes the partitions
+($exit, $ncmd) = run("$prog -p 4 -T $TMPDIR/spill -i $INDIR/in.bam $filt -o $TMPDIR/nodir/out.bam 2> /dev/null");
+ok($exit != 0, "unwritable output failed ($ncmd)");
+ok(spilled() == 0, "-p cleans up after an error");
+
+($exit, $ncmd) = run("$prog -p 0 -i $INDIR/in.bam $filt -o $TMPDIR/p0.bam 2> /dev/null");
+ok($exit != 0, "-p 0 rejected ($ncmd)");
+
+done_testing();
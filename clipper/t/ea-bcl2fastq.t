@@ -0,0 +1,134 @@
+use Test::Builder;
+use Test::More;
+use File::Basename qw(dirname);
+use File::Compare;
+use File::Path qw(make_path);
+use IO::Compress::Gzip qw(gzip $GzipError);
+use Compress::Zlib;
+
+require (dirname(__FILE__) . "/test-prep.pl");
+
+$prog="$BINDIR/ea-bcl2fastq";
+
+# not in the default build
+plan skip_all => "ea-bcl2fastq isn't built" if ! -x $prog;
+
+# a made-up run folder: one lane, two tiles, 20000 clusters (more than one 16384 cluster block),
+# Y8I4Y8, with filter flags, locations, and a few no-calls
+my $nclus = 20000;
+my $ncyc = 20;
+my $base = "$TMPDIR/run/Data/Intensities";
+make_path("$base/L001", "$base/BaseCalls/L001");
+srand(42);
+my $filter = pack("VVV", 0, 3, $nclus);
+my $locs = pack("VfV", 1, 1.0, $nclus);
+for (1..$nclus) {
+    $filter .= pack("C", rand() < .9 ? 1 : 0);
+    $locs .= pack("ff", rand(2000), rand(2000));
+}
+write_file("$base/BaseCalls/L001/s_1.filter", $filter);
+write_file("$base/L001/s_1.locs", $locs);
+write_file("$base/BaseCalls/L001/s_1.bci", pack("VVVV", 1101, 12000, 1102, $nclus-12000));
+# index cycles come from two barcodes, so -B has something to split
+my @bc = ("ACGT", "TTGG");
+my @ix = map {$bc[rand(2)]} (1..$nclus);
+for my $c (1..$ncyc) {
+    my $bcl = pack("V", $nclus);
+    for my $i (0..$nclus-1) {
+        my $b = ($c > 8 && $c <= 12) ? index("ACGT", substr($ix[$i], $c-9, 1)) : int(rand(4));
+        $bcl .= pack("C", rand() < .01 ? 0 : ((rand() < .5 ? 30 : 40) << 2) | $b);
+    }
+    my $z;
+    gzip(\$bcl => \$z) or die $GzipError;
+    write_file(sprintf("$base/BaseCalls/L001/%04d.bcl.bgzf", $c), $z);
+}
+write_file("$TMPDIR/bc.txt", "one\tACGT\ntwo\tTTGG\n");
+
+# threaded runs write the same reads, in the same order, as -p 1
+@check = (
+    {param=>"", name=>"plain", out=>[qw(1.fq 2.fq)]},
+    {param=>"-z", name=>"gz", out=>[qw(1.fq.gz 2.fq.gz)]},
+    {param=>"-s 5000 -n 13000", name=>"range", out=>[qw(1.fq 2.fq)]},
+    {param=>"-t 1102", name=>"tile", out=>[qw(1.fq 2.fq)]},
+    {param=>"-B $TMPDIR/bc.txt", name=>"demux", out=>[qw(one.1.fq two.2.fq unmatched.1.fq)]},
+);
+
+for (@check) {
+    my %d = %{$_};
+    for my $p (1, 4) {
+        my ($exit, $ncmd) = run("$prog -r $TMPDIR/run -l 1 -m Y8I4Y8 -o $TMPDIR/$d{name}.$p $d{param} -p $p 2> $TMPDIR/$d{name}.$p.err");
+        ok($exit == 0, "$d{name} -p $p worked ($ncmd)");
+    }
+    for (@{$d{out}}) {
+        my ($a, $b) = ("$TMPDIR/$d{name}.1.$_", "$TMPDIR/$d{name}.4.$_");
+        if (/\.gz$/) {
+            system("gzip -dc $a > $a.txt; gzip -dc $b > $b.txt");
+            ($a, $b) = ("$a.txt", "$b.txt");
+        }
+        ok(-s $a && compare($a, $b) == 0, "$d{name}: $_ -p 4 == -p 1");
+    }
+}
+
+# gzip output is the plain output, compressed
+ok(compare("$TMPDIR/plain.1.1.fq", "$TMPDIR/gz.4.1.fq.gz.txt") == 0, "-z -p 4 == plain");
+
+# -s past 1MB of clusters seeks by bgzf block: a run of real bgzf cycle files, and the same
+# run as one-member gzip files, which can only be inflated through, have to give the same reads
+my $big = (1<<20) + 3000;
+my %runs = (bgzf => 1, gz => 0);
+for my $r (keys %runs) {
+    my $dir = "$TMPDIR/$r/Data/Intensities/BaseCalls/L001";
+    make_path($dir);
+    write_file("$dir/s_1.filter", pack("VVV", 0, 3, $big) . ("\1" x $big));
+    # a 251 byte cycle of bases and qualities, shifted each cycle, so any off-by-n shows
+    my $pat = join("", map {pack("C", $_ % 37 == 0 ? 0 : ((30 + $_ % 11) << 2) | ($_ * 7 % 4))} (0..250));
+    for my $c (1..4) {
+        my $bcl = pack("V", $big) . substr($pat x (int($big/251)+2), $c, $big);
+        my $z;
+        if ($runs{$r}) {
+            $z = bgzf($bcl);
+        } else {
+            gzip(\$bcl => \$z) or die $GzipError;
+        }
+        write_file(sprintf("$dir/%04d.bcl.bgzf", $c), $z);
+    }
+}
+
+my $first = "$TMPDIR/bgzf/Data/Intensities/BaseCalls/L001/0001.bcl.bgzf";
+run("$prog -r $TMPDIR/bgzf -l 1 -m Y4 -o $TMPDIR/near -s 5000 -n 100 2> /dev/null");
+ok(! -e "$first.gzi", "short skips don't index");
+for my $r ("gz", "bgzf", "bgzf") {
+    my $n = -e "$first.gzi" ? "cached" : $r;
+    my ($exit, $ncmd) = run("$prog -r $TMPDIR/$r -l 1 -m Y4 -o $TMPDIR/far.$n -s 1050000 -n 2000 2> $TMPDIR/far.$n.err");
+    ok($exit == 0 && -s "$TMPDIR/far.$n.1.fq", "-s 1050000 from $n worked ($ncmd)");
+}
+ok(-s "$first.gzi", "block index cached");
+ok(! -e "$TMPDIR/gz/Data/Intensities/BaseCalls/L001/0001.bcl.bgzf.gzi", "no index for plain gzip");
+ok(compare("$TMPDIR/far.gz.1.fq", "$TMPDIR/far.bgzf.1.fq") == 0, "bgzf seek == inflating through");
+ok(compare("$TMPDIR/far.bgzf.1.fq", "$TMPDIR/far.cached.1.fq") == 0, "cached index == built index");
+my $want = join("", map {my $x = ($_ + 1050000) % 251; $x % 37 == 0 ? "N" : substr("ACGT", $x * 7 % 4, 1)} (1..4));
+ok((split /\n/, `head -2 $TMPDIR/far.bgzf.1.fq`)[1] eq $want, "first read is cluster 1050000");
+
+done_testing();
+
+# bgzip's format: deflate blocks of under 64k, each a gzip member with its size in a BC field
+sub bgzf {
+    my ($data) = @_;
+    my $out = "";
+    for (my $i = 0; $i < length($data); $i += 65280) {
+        my $blk = substr($data, $i, 65280);
+        my ($d) = deflateInit(-WindowBits => -MAX_WBITS, -Level => 6);
+        my ($z) = $d->deflate($blk);
+        $z .= $d->flush();
+        $out .= pack("CCCCVCCv", 31, 139, 8, 4, 0, 0, 255, 6) . pack("a2vv", "BC", 2, length($z) + 25)
+              . $z . pack("VV", crc32($blk), length($blk));
+    }
+    return $out . pack("H*", "1f8b08040000000000ff0600424302001b0003000000000000000000");
+}
+
+sub write_file {
+    my ($path, $data) = @_;
+    open(my $out, ">:raw", $path) || die "$path: $!";
+    print $out $data;
+    close $out;
+}
@@ -0,0 +1,59 @@
+use Test::Builder;
+use Test::More;
+use File::Basename qw(dirname);
+
+require (dirname(__FILE__) . "/test-prep.pl");
+
+$prog="$BINDIR/mirna-quant";
+
+# not in the default build
+plan skip_all => "mirna-quant isn't built" if ! -x $prog;
+
+# names by sequence, from the output table
+sub names {
+    my ($opt) = @_;
+    my ($exit, $ncmd) = run("$prog -t 0 -m 0 -r $INDIR/ref.fa $opt $INDIR/reads.fq > $TMPDIR/out 2> /dev/null");
+    ok($exit == 0, "$opt worked ($ncmd)");
+    my %n;
+    open(my $in, "<", "$TMPDIR/out");
+    while (<$in>) {
+        chomp;
+        my @f = split /\t/, $_, -1;
+        $n{$f[0]} = $f[3];
+    }
+    close $in;
+    return %n;
+}
+
+# reads.fq: miR-1 exact and with a substitution, miR-2 reverse strand with one, miR-3 with two and
+# three, rRNA-5S exact and with one, rRNA-X reverse strand, and reads that shouldn't align
+my %seq = (
+    mir1 => "GCTAAAGACAATTACATAACAT",
+    mir1sub => "GCTCAAGACAATTACATAACAT",
+    mir2rev => "AACAAGTTTCGGGCTGACGTGT",
+    mir3sub2 => "GGGCCAGTGTGAATCTCTTAA",
+    mir3sub3 => "GGGCCAGTGAGAATCTCTTAA",
+    rrna => "ACTTGCTGTGTCCACCCCATCGGAC",
+    rrnasub => "ACTCAGAAACAGCACTCGGGTAATT",
+    rrnarev => "GAGATTCATAGCGAGTGTCCACGC",
+    across => "TGGCATTCTCCTGAAGTGCGTGGAC",
+    junk => "GAATAATGCGTTCGCTCTATTGAC",
+    short => "ACACGTCAGCACGAAA",
+);
+
+my %want = (
+    "" => {mir1 => "miR-1"},
+    "-a" => {mir1 => "miR-1", mir1sub => "miR-1", mir2rev => "miR-2", mir3sub2 => "miR-3"},
+    "-x $INDIR/rrna.fa" => {mir1 => "miR-1", rrna => "rRNA-5S", rrnasub => "rRNA-5S", rrnarev => "rRNA-X"},
+    "-a -x $INDIR/rrna.fa -v 3" => {mir1 => "miR-1", mir1sub => "miR-1", mir2rev => "miR-2", mir3sub2 => "miR-3",
+        mir3sub3 => "miR-3", rrna => "rRNA-5S", rrnasub => "rRNA-5S", rrnarev => "rRNA-X"},
+);
+
+for my $opt (sort keys %want) {
+    my %n = names($opt);
+    for (sort keys %seq) {
+        is($n{$seq{$_}}, $want{$opt}{$_} // "", "'$opt': $_ named");
+    }
+}
+
+done_testing();
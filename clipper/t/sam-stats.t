@@ -0,0 +1,52 @@
+use Test::Builder;
+use Test::More;
+use File::Basename qw(dirname);
+use File::Compare;
+
+require (dirname(__FILE__) . "/test-prep.pl");
+
+$prog="$BINDIR/sam-stats";
+
+# threaded runs have to give the same stats, and the same exit code, as -t 1
+# placed.bam and unplaced.bam are indexed, so they're split by reference
+@check = (
+    {param=>"$INDIR/placed.bam", name=>"placed"},
+    {param=>"$INDIR/unplaced.bam", name=>"unplaced"},
+    {param=>"$INDIR/trunc.bam", name=>"trunc", bad=>1},
+    {param=>"-B - < $INDIR/placed.bam", name=>"stdin"},
+);
+
+for (@check) {
+    my %d = %{$_};
+    my @exit;
+    for my $t (1, 4) {
+        my ($exit, $ncmd) = run("$prog -t $t $d{param} > $TMPDIR/$d{name}.$t 2> $TMPDIR/$d{name}.$t.err");
+        if ($d{bad}) {
+            ok($exit != 0, "$d{name} -t $t failed ($ncmd)");
+        } else {
+            ok($exit == 0, "$d{name} -t $t worked ($ncmd)");
+        }
+    }
+    ok(compare("$TMPDIR/$d{name}.1", "$TMPDIR/$d{name}.4") == 0, "$d{name}: -t 4 == -t 1");
+}
+
+# unplaced reads are counted when no reference has any
+ok(`grep '^reads' $TMPDIR/unplaced.4` =~ /\t100$/, "unplaced: all 100 reads counted");
+
+# the read-id table is merged from the threads, its stats have to come out the same
+run("$prog -D -t 1 $INDIR/placed.bam > $TMPDIR/dup.1");
+run("$prog -D -t 4 $INDIR/placed.bam > $TMPDIR/dup.4");
+ok(compare("$TMPDIR/dup.1", "$TMPDIR/dup.4") == 0, "-D: -t 4 == -t 1");
+
+# illumina names with a #index/mate suffix are packed, not hashed
+run("$prog -D $INDIR/suffix.sam > $TMPDIR/suffix.out");
+ok(`grep -c 'dup index' $TMPDIR/suffix.out` == 2, "#0/1 names packed");
+
+# the suffix isn't part of the name: #0/1 and #0/2 mates are one read, every 7th record is doubled
+for my $t (1, 4) {
+    my $out = `$prog -D -t $t $INDIR/mates.sam`;
+    ok($out =~ /^mapped reads\t60$/m, "-t $t: /1 and /2 mates are one read");
+    ok($out =~ /^ambiguous\t16$/m && $out =~ /^max dup align\t2$/m, "-t $t: doubled records are ambiguous");
+}
+
+done_testing();
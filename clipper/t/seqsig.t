@@ -0,0 +1,37 @@
+use Test::Builder;
+use Test::More;
+use File::Basename qw(dirname);
+use File::Compare;
+
+require (dirname(__FILE__) . "/test-prep.pl");
+
+$prog="$BINDIR/seqsig";
+
+# not in the default build
+plan skip_all => "seqsig isn't built" if ! -x $prog;
+
+# 12000 reads, more than two batches: some from the spike-in, some low complexity, some too short
+# -n cuts the sample inside a batch, and the threads have to stop at the same read
+@check = (
+    {param=>"", name=>"plain"},
+    {param=>"-a", name=>"canon"},
+    {param=>"-n 5000", name=>"sample"},
+    {param=>"-R $INDIR/contam.fa", name=>"contam"},
+    {param=>"-R $INDIR/contam.fa -a -n 5000", name=>"contam-sample"},
+);
+
+for (@check) {
+    my %d = %{$_};
+    for my $p (1, 4) {
+        my ($exit, $ncmd) = run("$prog $d{param} -p $p $INDIR/reads.fq.gz > $TMPDIR/$d{name}.$p.out 2> /dev/null");
+        ok($exit == 0, "$d{name} -p $p worked ($ncmd)");
+        # everything but the timing
+        system("grep -v '^run-time' $TMPDIR/$d{name}.$p.out > $TMPDIR/$d{name}.$p");
+    }
+    ok(compare("$TMPDIR/$d{name}.1", "$TMPDIR/$d{name}.4") == 0, "$d{name}: -p 4 == -p 1");
+}
+
+ok(`grep '^skip-contam' $TMPDIR/contam.1` !~ /\t0$/, "spike-in reads dropped");
+ok(`grep '^reads-used' $TMPDIR/sample.4` =~ /\t5000$/, "-n 5000 used 5000 reads");
+
+done_testing();
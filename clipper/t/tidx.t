@@ -0,0 +1,75 @@
+use Test::Builder;
+use Test::More;
+use File::Basename qw(dirname);
+use File::Compare;
+
+require (dirname(__FILE__) . "/test-prep.pl");
+
+$prog="$BINDIR/tidx/tidx";
+
+plan skip_all => "$prog not built" if ! -x $prog;
+
+# indexes are written next to the file
+system("cp $INDIR/annot.txt $TMPDIR/annot.txt");
+system("cp $INDIR/annot.txt $TMPDIR/v1.txt");
+system("cp $INDIR/annot.v1.tidx $TMPDIR/v1.txt.tidx");
+
+my ($exit, $ncmd) = run("$prog -B -i $TMPDIR/annot.txt");
+ok($exit == 0, "build worked ($ncmd)");
+ok(`head -c 4 $TMPDIR/annot.txt.tidx` eq "TIDX", "version 2 index");
+
+# every interval's ends, either side of them, and random points, checked against a scan of the file
+my (@ivl, %chr);
+open(IN, "$INDIR/annot.txt");
+while (<IN>) {
+    chomp;
+    my @f = split /\t/;
+    push @ivl, [@f[0..2], $_];
+    $chr{$f[0]} = 1;
+}
+close IN;
+
+srand(1);
+my @q;
+for (@ivl) {
+    push @q, map {[$_->[0], $_]} ($_->[1]-1, $_->[1], $_->[1]+1, $_->[2]-1, $_->[2], $_->[2]+1);
+}
+my @c = sort keys %chr;
+push @q, [$c[rand @c], int rand 250000000] for 1..500;
+push @q, ["chrNone", 100];
+@q = sort {$a->[0] cmp $b->[0] || $a->[1] <=> $b->[1]} @q;
+open(OUT, ">$TMPDIR/q.txt");
+print OUT "$_->[0]\t$_->[1]\n" for @q;
+close OUT;
+
+sub check {
+    my ($index, $name) = @_;
+    my @out = `$prog -i $TMPDIR/$index -a $TMPDIR/q.txt`;
+    my $bad = 0;
+    for my $i (0..$#q) {
+        my ($c, $p) = @{$q[$i]};
+        my $want = join "\n", sort map {$_->[3]} grep {$_->[0] eq $c && $_->[1] <= $p && $p <= $_->[2]} @ivl;
+        chomp(my $line = $out[$i]);
+        my @got = split /\^/, $line;
+        shift @got;
+        ++$bad if $want ne join("\n", sort @got);
+    }
+    ok(@out == @q && !$bad, "$name: " . scalar(@q) . " lookups match a scan ($bad wrong)");
+}
+
+check("annot.txt", "v2");
+check("v1.txt", "v1 index");
+
+# a damaged index is refused, not read out of bounds: pool offsets past the pool, and a truncated file
+open(my $in, "<:raw", "$TMPDIR/annot.txt.tidx"); my $idx = join("", <$in>); close $in;
+my ($nchr, $nivl) = (unpack("V", substr($idx, 8, 4)), unpack("V", substr($idx, 16, 4)));
+my %bad = (pos => $idx, trunc => substr($idx, 0, length($idx)/2));
+substr($bad{pos}, 40 + $nchr*24 + $_*24 + 8, 8) = pack("V2", 0x7fffffff, 0) for 0..$nivl-1;
+for (sort keys %bad) {
+    system("cp $INDIR/annot.txt $TMPDIR/$_.txt");
+    open(my $out, ">:raw", "$TMPDIR/$_.txt.tidx"); print $out $bad{$_}; close $out;
+    my ($exit, $ncmd) = run("$prog -i $TMPDIR/$_.txt -p chr1:2300001 > $TMPDIR/$_.out 2>&1");
+    ok($exit == 1 && ! -s "$TMPDIR/$_.out", "$_: bad index finds nothing ($ncmd)");
+}
+
+done_testing();
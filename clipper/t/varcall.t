@@ -0,0 +1,55 @@
+use Test::Builder;
+use Test::More;
+use File::Basename qw(dirname);
+use File::Compare;
+
+require (dirname(__FILE__) . "/test-prep.pl");
+
+$prog="$BINDIR/varcall";
+
+# the fasta index gets written next to the fasta
+system("cp $INDIR/ref.fa $TMPDIR/ref.fa");
+
+# snp.bam has indels, so read lengths vary, and the read length bin starts over on each reference
+# a chunk per reference is exact, and so are cuts within the 1kb lead-in of a reference start
+my @outs = qw(var cse eav);
+my $fmt = join(",", @outs);
+my ($exit, $ncmd) = run("$prog -s -v -f $TMPDIR/ref.fa -t 1 -o $TMPDIR/t1 -F $fmt $INDIR/snp.bam 2> $TMPDIR/t1.err");
+ok($exit == 0, "-t 1 worked ($ncmd)");
+for my $chunk (0, 1000) {
+    my $opt = $chunk ? "--chunk $chunk" : "";
+    my ($exit, $ncmd) = run("$prog -s -v -f $TMPDIR/ref.fa -t 4 $opt -o $TMPDIR/t4.$chunk -F $fmt $INDIR/snp.bam 2> $TMPDIR/t4.$chunk.err");
+    ok($exit == 0, "-t 4 $opt worked ($ncmd)");
+    for (@outs) {
+        ok(compare("$TMPDIR/t1.$_", "$TMPDIR/t4.$chunk.$_") == 0, "-t 4 $opt: $_ == -t 1");
+    }
+}
+ok(`grep chunks $TMPDIR/t4.0.err` =~ /2 chunks/, "a chunk per reference");
+
+# .vcb round trip: --from-vcb gives back the text a -F var,eav run writes, threaded vcb too
+run("$prog -s -v -f $TMPDIR/ref.fa -t 1 -o $TMPDIR/v1 -F var,eav,vcb $INDIR/snp.bam 2> /dev/null");
+run("$prog -s -v -f $TMPDIR/ref.fa -t 4 -o $TMPDIR/v4 -F vcb $INDIR/snp.bam 2> /dev/null");
+for my $t (1, 4) {
+    my ($exit, $ncmd) = run("$prog --from-vcb $TMPDIR/v$t.vcb -o $TMPDIR/r$t -F var,eav 2> /dev/null");
+    ok($exit == 0, "--from-vcb worked ($ncmd)");
+    for (qw(var eav)) {
+        ok(compare("$TMPDIR/v1.$_", "$TMPDIR/r$t.$_") == 0, "-t $t vcb: $_ round trip");
+    }
+}
+# to stdout it's var without the header
+system("tail -n +2 $TMPDIR/v1.var > $TMPDIR/v1.body");
+ok(`cat $TMPDIR/v1.vcb | $prog --from-vcb - 2> /dev/null | cmp - $TMPDIR/v1.body` eq "", "vcb from a pipe");
+
+# bad blocks are errors, not crashes or huge allocations: cut in half, and a block claiming 2^31 loci
+open(my $in, "<:raw", "$TMPDIR/v1.vcb"); my $vcb = join("", <$in>); close $in;
+my %bad = (trunc => substr($vcb, 0, length($vcb)/2), big => $vcb);
+substr($bad{big}, 16, 4) = pack("l<", 0x7fffffff);
+for (keys %bad) {
+    open(my $out, ">:raw", "$TMPDIR/$_.vcb"); print $out $bad{$_}; close $out;
+}
+for (qw(trunc big)) {
+    my ($exit, $ncmd) = run("$prog --from-vcb $TMPDIR/$_.vcb > /dev/null 2> $TMPDIR/$_.err");
+    ok($exit != 0 && -s "$TMPDIR/$_.err", "$_.vcb rejected ($ncmd)");
+}
+
+done_testing();
@@ -5,9 +5,15 @@
 #include <errno.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <memory>
 
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <algorithm>
 
 #include <sparsehash/dense_hash_map>
 
@@ -122,108 +128,292 @@ void chomp_line(struct line &l) {
     if (l.s[l.n-1] == '\r') l.s[--l.n]='\0';       // chomp
 }
 
-vector <long int> empty_vector;
-const vector<long int> &tidx::lookup(const char *chr, int pos) {
-    dense_hash_map<string,vector<annot> >::iterator it=map.find(chr);
-    if (it == map.end()) return empty_vector;
-    vector<annot> &va = it->second;
-    if (debug) fprintf(stderr,"lookup: %s:%d -> %d\n", chr, pos, (int) va.size());
-    int b=0, t=va.size(), c=0;
-    while (t>b) {
-        c=(t+b)/2;
-//        printf("here1: c:%d, t:%d, b:%d, pos:%d, beg:%d, end:%d, res:%d\n", c, t, b, pos, va[c].beg, va[c].end, va[c].pos[0]);
-        if (pos == va[c].beg)
-            break;
-        else if (pos < va[c].beg)
-            t=c-1;
-        else if (pos > va[c].beg) {
-            if (pos <= va[c].end) {
-                return va[c].pos;
-            }
-            b=c+1;
+class tidx_image {
+public:
+    const char *base;
+    size_t len;
+    void *mm;               // mapping, if any
+    std::string own;        // otherwise the flattened image is here
+    tidx_image() {base=NULL; len=0; mm=NULL;}
+    ~tidx_image() {if (mm) munmap(mm, len);}
+};
+
+static inline size_t align8(size_t n) { return (n+7) & ~(size_t)7; }
+
+// version 2 image of a chromosome -> sorted intervals map
+static void tidx_flatten(dense_hash_map<string,vector<annot> > &map, string &out) {
+    vector<string> keys;
+    dense_hash_map<string,vector<annot> >::iterator it;
+    for (it = map.begin(); it != map.end(); ++it) 
+        keys.push_back(it->first);
+    sort(keys.begin(), keys.end());
+
+    vector<tidx_chr> chrs;
+    vector<tidx_ivl> ivls;
+    vector<int64_t> pool;
+    string names;
+    int i, j, k;
+    for (i=0;i<keys.size();++i) {
+        vector<annot> &van = map[keys[i]];
+        tidx_chr c; memset(&c, 0, sizeof(c));
+        c.name = names.size();
+        c.first = ivls.size();
+        c.count = van.size();
+        names.append(keys[i].c_str(), keys[i].size()+1);
+        chrs.push_back(c);
+        for (j=0;j<van.size();++j) {
+            tidx_ivl v; memset(&v, 0, sizeof(v));
+            v.beg = van[j].beg;
+            v.end = van[j].end;
+            v.pos = pool.size();
+            v.npos = van[j].pos.size();
+            for (k=0;k<van[j].pos.size();++k) 
+                pool.push_back(van[j].pos[k]);
+            ivls.push_back(v);
         }
     }
-    
-    if (t == b)
-        c = t;
-//    printf("here2: c:%d, t:%d, b:%d, pos:%d, beg:%d, end:%d, res:%d\n", c, t, b, pos, va[c].beg, va[c].end, va[c].pos[0]);
-    if (pos >= va[c].beg && pos <= va[c].end) {
-        return va[c].pos;
+
+    tidx_hdr h; memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TIDX_MAGIC, 4);
+    h.version = TIDX_VERSION;
+    h.nchr = chrs.size();
+    h.nivl = ivls.size();
+    h.npos = pool.size();
+    h.names_len = align8(names.size());
+    names.resize(h.names_len, '\0');
+
+    out.clear();
+    out.append((const char *) &h, sizeof(h));
+    if (chrs.size()) out.append((const char *) chrs.data(), chrs.size()*sizeof(tidx_chr));
+    if (ivls.size()) out.append((const char *) ivls.data(), ivls.size()*sizeof(tidx_ivl));
+    if (pool.size()) out.append((const char *) pool.data(), pool.size()*sizeof(int64_t));
+    out.append(names);
+}
+
+// point the section pointers into an image, false if it's not a valid version 2 index
+bool tidx::attach(shared_ptr<tidx_image> i) {
+    const tidx_hdr *h = (const tidx_hdr *) i->base;
+    if (i->len < sizeof(tidx_hdr) || memcmp(h->magic, TIDX_MAGIC, 4) || h->version != TIDX_VERSION) 
+        return false;
+    // each section has to fit in what's left of the image, checked one at a time so the sizes can't overflow
+    size_t left = i->len - sizeof(tidx_hdr);
+    if (h->nchr > left/sizeof(tidx_chr)) 
+        return false;
+    left -= h->nchr*sizeof(tidx_chr);
+    if (h->nivl > left/sizeof(tidx_ivl)) 
+        return false;
+    left -= h->nivl*sizeof(tidx_ivl);
+    if (h->npos > left/sizeof(int64_t)) 
+        return false;
+    left -= h->npos*sizeof(int64_t);
+    if (h->names_len != left || (h->names_len && i->base[i->len-1])) 
+        return false;
+    const tidx_chr *c = (const tidx_chr *) (i->base + sizeof(tidx_hdr));
+    const tidx_ivl *v = (const tidx_ivl *) (c + h->nchr);
+    uint64_t k;
+    for (k=0;k<h->nchr;++k) 
+        if (c[k].name >= h->names_len || c[k].first > h->nivl || c[k].count > h->nivl - c[k].first) 
+            return false;
+    for (k=0;k<h->nivl;++k) 
+        if (v[k].pos > h->npos || v[k].npos > h->npos - v[k].pos) 
+            return false;
+    img = i;
+    hdr = h;
+    chrs = c;
+    ivls = (const tidx_ivl *) (chrs + h->nchr);
+    pool = (const int64_t *) (ivls + h->nivl);
+    names = (const char *) (pool + h->npos);
+    return true;
+}
+
+const tidx_chr *tidx::chrdex(const char *chr) {
+    if (!hdr) return NULL;
+    int b=0, t=hdr->nchr;
+    while (t>b) {
+        int c=(t+b)/2;
+        int r=strcmp(chr, names+chrs[c].name);
+        if (!r) 
+            return &chrs[c];
+        if (r < 0)
+            t=c;
+        else
+            b=c+1;
     }
-    return empty_vector;
+    return NULL;
 }
 
-vector<long int> tidx::lookup_r(const char *chr, int beg, int end) {
-    dense_hash_map<string,vector<annot> >::iterator it=map.find(chr);
-    if (it == map.end()) return empty_vector;
-    vector<annot> &va = it->second;
-    if (debug) fprintf(stderr,"lookup_r: %s:%d.%d -> %d\n", chr, beg, end, (int) va.size());
-    int b=0, t=va.size(), c=0;
+// first interval ending at or after pos, intervals don't overlap so ends are sorted too
+static uint64_t first_end(const tidx_ivl *va, uint64_t b, uint64_t t, int pos) {
     while (t>b) {
-        c=(t+b)/2;
-        if (beg == va[c].beg)
-            break;
-        else if (beg < va[c].beg)
-            t=c-1;
-        else if (beg > va[c].beg) {
-            if (beg <= va[c].end) 
-                break;
+        uint64_t c=b+(t-b)/2;
+        if (va[c].end < pos)
             b=c+1;
+        else
+            t=c;
+    }
+    return b;
+}
+
+const tidx_ivl *tidx::find(const char *chr, int pos) {
+    const tidx_chr *ch=chrdex(chr);
+    if (!ch) return NULL;
+    const tidx_ivl *va = ivls + ch->first;
+    if (debug) fprintf(stderr,"lookup: %s:%d -> %d\n", chr, pos, (int) ch->count);
+    uint64_t c = first_end(va, 0, ch->count, pos);
+    return (c < ch->count && va[c].beg <= pos) ? &va[c] : NULL;
+}
+
+tidx_pos tidx::lookup(const char *chr, int pos) {
+    const tidx_ivl *v = find(chr, pos);
+    return v ? tidx_pos(pool+v->pos, v->npos) : tidx_pos();
+}
+
+void tidx::clear_lines() {
+    line_at.clear();
+    line_tab.clear();
+    last_lines.clear();
+    last_ok=false;
+}
+
+// parsed line at a byte offset of the indexed file
+const tidx_line *tidx::line(int64_t off) {
+    if (!text) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st)) 
+            fail("%s:%s\n",path.c_str(),strerror(errno));
+        text_len = st.st_size;
+        text = "";
+        if (text_len) {
+            void *m = mmap(NULL, text_len, PROT_READ, MAP_SHARED, fd, 0);
+            if (m == MAP_FAILED) 
+                fail("%s:%s\n",path.c_str(),strerror(errno));
+            text = (const char *) m;
         }
+        close(fd);
     }
-    if (t == b)
-        c = t;
-    vector<long int> res;
-    while (c<va.size() && end >= va[c].beg && beg <= va[c].end) {
-        append(res,va[c].pos);
-        ++c;
+
+    dense_hash_map<int64_t, int>::iterator it = line_at.find(off);
+    if (it != line_at.end()) 
+        return &line_tab[it->second];
+
+    tidx_line l;
+    l.s = text + (off < text_len ? off : text_len);
+    const char *e = (const char *) memchr(l.s, '\n', text+text_len-l.s);
+    l.n = (e ? e : text+text_len) - l.s;
+    if (l.n && l.s[l.n-1] == '\r') 
+        --l.n;
+    int i;
+    l.col.push_back(0);
+    for (i=0;i<l.n;++i) 
+        if (l.s[i] == '\t') 
+            l.col.push_back(i+1);
+
+    line_at[off] = line_tab.size();
+    line_tab.push_back(l);
+    return &line_tab.back();
+}
+
+const vector<const tidx_line *> &tidx::lines(const char *chr, int pos) {
+    return lines(find(chr, pos));
+}
+
+const vector<const tidx_line *> &tidx::lines(const tidx_ivl *v) {
+    if (last_ok && v == last_ivl) 
+        return last_lines;
+
+    // keep the cache bounded, everything handed out before this call is fair game
+    if (line_tab.size() + (v ? v->npos : 0) > TIDX_LINE_CACHE) 
+        clear_lines();
+    last_lines.clear();
+    int i;
+    if (v) {
+        for (i=0;i<v->npos;++i) 
+            last_lines.push_back(line(pool[v->pos+i]));
     }
+    last_ivl = v;
+    last_ok = true;
+    return last_lines;
+}
+
+// lines of every interval overlapping beg..end, in order
+// (a line that was cut into fragments is listed once for each fragment it's in)
+vector<long int> tidx::lookup_r(const char *chr, int beg, int end) {
+    vector<long int> res;
+    const tidx_chr *ch=chrdex(chr);
+    if (!ch) return res;
+    const tidx_ivl *va = ivls + ch->first;
+    if (debug) fprintf(stderr,"lookup_r: %s:%d.%d -> %d\n", chr, beg, end, (int) ch->count);
+    uint64_t c = first_end(va, 0, ch->count, beg);
+    for (;c < ch->count && va[c].beg <= end;++c) 
+        res.insert(res.end(), pool+va[c].pos, pool+va[c].pos+va[c].npos);
     return res;
 }
 
-string tidx::lookup(const char *chr, int pos, const char *msep) { 
-//    printf("here2\n");
-    const vector<long int> &v = lookup(chr, pos);
-    string res;
-    if (!fh) {
-        fh=fopen(path.c_str(),"rb");
-        if (!fh) 
-            fail("%s:%s\n",path.c_str(),strerror(errno));
+const tidx_ivl *tidx_cursor::find(const char *chr, int pos) {
+    if (!t) return NULL;
+    if (!have || strcmp(chr, name.c_str())) {
+        name = chr;
+        ch = t->chrdex(chr);
+        have = true;
+        cur = 0;
+        last = pos;
     }
-    string line;
+    if (!ch) return NULL;
+    const tidx_ivl *va = t->ivls + ch->first;
+    uint64_t n = ch->count;
+    if (pos < last) {
+        cur = first_end(va, 0, n, pos);
+    } else {
+        // usually the same or the next interval, search if it's further
+        int k;
+        for (k=0;k<4 && cur < n && va[cur].end < pos;++k) 
+            ++cur;
+        if (cur < n && va[cur].end < pos) 
+            cur = first_end(va, cur, n, pos);
+    }
+    last = pos;
+    return (cur < n && va[cur].beg <= pos) ? &va[cur] : NULL;
+}
+
+tidx_pos tidx_cursor::lookup(const char *chr, int pos) {
+    const tidx_ivl *v = find(chr, pos);
+    return v ? tidx_pos(t->pool+v->pos, v->npos) : tidx_pos();
+}
+
+const vector<const tidx_line *> &tidx_cursor::lines(const char *chr, int pos) {
+    return t->lines(find(chr, pos));
+}
+
+string tidx_cursor::lookup(const char *chr, int pos, const char *msep) {
+    return t->join(lines(chr, pos), msep);
+}
+
+string tidx::join(const vector<const tidx_line *> &v, const char *msep) {
+    string res;
     int i;
-	struct line l; meminit(l);
     for (i=0;i<v.size();++i) {
-        fseek(fh,v[i],0);
-    	read_line(fh, l);
-        chomp_line(l);
         res += msep;
-        res += string(l.s, l.n);
+        res.append(v[i]->s, v[i]->n);
     }
-    free_line(&l);
     return res;
 }
 
+string tidx::lookup(const char *chr, int pos, const char *msep) { 
+    return join(lines(chr, pos), msep);
+}
+
 string tidx::lookup_r(const char *chr, int beg, int end, const char *msep) {
-//    printf("here2\n");
     const vector<long int> &v = lookup_r(chr, beg, end);
     string res;
-    if (!fh) {
-        fh=fopen(path.c_str(),"rb");
-        if (!fh)
-            fail("%s:%s\n",path.c_str(),strerror(errno));
-    }
-    string line;
+    if (line_tab.size() + v.size() > TIDX_LINE_CACHE) 
+        clear_lines();
     int i;
-    struct line l; meminit(l);
     for (i=0;i<v.size();++i) {
-        fseek(fh,v[i],0);
-        read_line(fh, l);
-        chomp_line(l);
+        const tidx_line *l = line(v[i]);
         res += msep;
-        res += string(l.s, l.n);
+        res.append(l->s, l->n);
     }
-    free_line(&l);
     return res;
 }
 
@@ -239,34 +429,100 @@ const char *tidx::lookup_cr(const char *chr, int beg, int end, const char *msep)
 }
 
 bool tidx::read(const char *in) {
-    string uin = string_format("gunzip -c %s.tidx", in);
+    string ipath = string_format("%s.tidx", in);
+    map.clear();
+    img.reset();
+    hdr=NULL;
+    clear_lines();
+    if (text_len) 
+        munmap((void *) text, text_len);
+    text=NULL;
+    text_len=0;
 
     if (debug) fprintf(stderr, "read %s\n", in);
-    FILE *fun=popen(uin.c_str(),"r");
-    if (!fun) {
+    int fd = open(ipath.c_str(), O_RDONLY);
+    if (fd < 0) 
+        return false;
+
+    struct stat st;
+    char magic[4];
+    if (fstat(fd, &st) || ::read(fd, magic, 4) != 4) {
+        close(fd);
+        return false;
+    }
+
+    shared_ptr<tidx_image> i(new tidx_image);
+    if (!memcmp(magic, TIDX_MAGIC, 4)) {
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (m == MAP_FAILED)
+            return false;
+        i->mm = m;
+        i->base = (const char *) m;
+        i->len = st.st_size;
+    } else {
+        close(fd);
+        // version 1, gzipped hash map
+        string uin = string_format("gunzip -c %s", ipath.c_str());
+        FILE *fun=popen(uin.c_str(),"r");
+        if (!fun) {
+            return false;
+        }
+        bool ok = map.unserialize(string_annot_serializer(), fun);
+        pclose(fun);
+        if (!ok)
+            return false;
+        tidx_flatten(map, i->own);
+        map.clear();
+        i->base = i->own.data();
+        i->len = i->own.size();
+    }
+
+    if (!attach(i)) {
+        if (debug) fprintf(stderr, "invalid index %s\n", ipath.c_str());
         return false;
     }
-    map.unserialize(string_annot_serializer(), fun);
     path=in;
     return true;
 }
 
 void tidx::init() {
     debug=false;
-    fh=NULL;
+    text=NULL;
+    text_len=0;
+    line_at.set_empty_key(-1);
+    last_ivl=NULL;
+    last_ok=false;
+    hdr=NULL;
+    chrs=NULL;
+    ivls=NULL;
+    pool=NULL;
+    names=NULL;
     map.set_empty_key("-");
 }
 
+tidx::tidx(const tidx &x) {
+    init();
+    debug=x.debug;
+    path=x.path;
+    if (x.img) 
+        attach(x.img);
+}
+
+tidx::~tidx() {
+    if (text_len) 
+        munmap((void *) text, text_len);
+}
+
 void tidx::dump(FILE *fh) {
     fprintf(fh,"#file\t%s\n",path.c_str());
-    dense_hash_map<string,vector<annot> >::iterator it = map.begin();;
-    while (it != map.end()) {
-        vector<annot> &van = it->second;
-        int i;
-        for (i=0;i<van.size();++i) {
-            fprintf(fh, "%s\t%d\t%d\t%ld\t%ld\n", it->first.c_str(), van[i].beg, van[i].end, van[i].pos.size(), van[i].pos[0]);
+    if (!hdr) return;
+    int c, i;
+    for (c=0;c<hdr->nchr;++c) {
+        const tidx_ivl *van = ivls + chrs[c].first;
+        for (i=0;i<chrs[c].count;++i) {
+            fprintf(fh, "%s\t%d\t%d\t%ld\t%ld\n", names+chrs[c].name, van[i].beg, van[i].end, (long) van[i].npos, (long) pool[van[i].pos]);
         }
-        ++it;
     }    
 }
 
@@ -280,8 +536,8 @@ void tidx::build(const char *in, const char *sep, int nchr, int nbeg, int nend,
     if (nend == -1)
         nend = nbeg;
 
-    string out = string_format("gzip -c > %s.tidx", in);
-    FILE *fout=popen(out.c_str(),"w");
+    string out = string_format("%s.tidx.tmp", in);
+    FILE *fout=fopen(out.c_str(),"wb");
     if (!fout)
         fail("%s:%s\n", out.c_str(),strerror(errno));
 
@@ -411,16 +667,21 @@ void tidx::build(const char *in, const char *sep, int nchr, int nbeg, int nend,
 
     if (debug) fprintf(stderr, "compiled in %g secs\n", speed);
 
-    map.serialize(string_annot_serializer(), fout);
-    pclose(fout);
+    string img;
+    tidx_flatten(map, img);
+    map.clear();
+    if (fwrite(img.data(), 1, img.size(), fout) != img.size() || fclose(fout))
+        fail("%s:%s\n", out.c_str(),strerror(errno));
+    if (rename(out.c_str(), string_format("%s.tidx", in).c_str()))
+        fail("%s.tidx:%s\n", in,strerror(errno));
 
-    //
+    // and use it
     xst = xtime();
-    tidx tmap(in);
+    if (!read(in))
+        fail("%s.tidx: can't read index after build\n", in);
     xen = xtime();
     speed = xen-xst;
     if (debug) fprintf(stderr, "read in %g secs\n", speed);
-    path=in;
 }
 
 double xtime() {
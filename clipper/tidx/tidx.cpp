@@ -5,6 +5,8 @@
 #include <errno.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <memory>
 
 #include <sys/time.h>
 #include <unistd.h>
@@ -150,6 +152,11 @@ int main (int argc, char **argv) {
             if (!fin)
                 fail("error '%s':%s", ain,strerror(errno));
 
+            // sorted input is a single merge-join pass over each index, unsorted still works
+            vector<tidx_cursor> vcur;
+            for (f_i=0;f_i<vin.size();++f_i) 
+                vcur.push_back(tidx_cursor(*vmap[f_i]));
+
             while (read_line(fin, l)>0) {
                 ++nl;
 
@@ -162,7 +169,7 @@ int main (int argc, char **argv) {
                 string res;
                 if (v.size() > nchr && v.size() > nbeg) {
                     for (f_i=0;f_i<vin.size();++f_i) {
-                        string tmp = vmap[f_i]->lookup(v[nchr], atol(v[nbeg]), msep);
+                        string tmp = vcur[f_i].lookup(v[nchr], atol(v[nbeg]), msep);
                         if (tmp.size()) {
                             res = res + tmp;
                         }
@@ -201,7 +208,7 @@ fputs(
 "\n"
 "-i IFILE       Text file to index (can specify more than one)\n"
 "-B             Build index, don't annotate\n"
-"-a FILE        Read text file and annotate\n"
+"-a FILE        Read text file and annotate (fastest when sorted by position)\n"
 "-p CHR:POS     Lookup a single point (slow!)\n"
 "-r STRING      Annotation response separator (^)\n"
 "-t CHAR(s)     Field separator (TAB)\n"
@@ -1,5 +1,10 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <memory>
 #include <sparsehash/dense_hash_map>
 
 class annot {
@@ -9,24 +14,134 @@ public:
     std::vector<long> pos;
 };
 
+// version 2 index file: read-only, mmap'ed and searched in place
+//
+// header, chromosome directory (sorted by name), intervals (sorted by beg within a chromosome,
+// non-overlapping), position pool (byte offsets of lines in the indexed file), chromosome names.
+// every section is 8-byte aligned, little-endian, as written.
+// version 1 files (gzipped dense_hash_map serialization) are still read, and flattened in memory.
+
+#define TIDX_MAGIC "TIDX"
+#define TIDX_VERSION 2
+
+struct tidx_hdr {
+    char magic[4];
+    uint32_t version;
+    uint32_t nchr;
+    uint32_t pad;
+    uint64_t nivl;
+    uint64_t npos;
+    uint64_t names_len;
+};
+
+struct tidx_chr {
+    uint32_t name;          // offset into names
+    uint32_t pad;
+    uint64_t first;         // first interval
+    uint64_t count;
+};
+
+struct tidx_ivl {
+    int32_t beg;
+    int32_t end;            // inclusive
+    uint64_t pos;           // first position in the pool
+    uint32_t npos;
+    uint32_t pad;
+};
+
+// positions for one interval, points into the index
+class tidx_pos {
+    const int64_t *p;
+    int n;
+public:
+    tidx_pos() {p=NULL; n=0;}
+    tidx_pos(const int64_t *pp, int nn) {p=pp; n=nn;}
+    int size() const {return n;}
+    bool empty() const {return n==0;}
+    int64_t operator[](int i) const {return p[i];}
+    const int64_t *data() const {return p;}
+    const int64_t *begin() const {return p;}
+    const int64_t *end() const {return p+n;}
+};
+
+// one line of the indexed file, a view into its mapping, split on tabs
+class tidx_line {
+public:
+    const char *s;          // not nul terminated
+    int n;                  // without the line ending
+    std::vector<int> col;   // start of each field
+    int fields() const {return col.size();}
+    int flen(int i) const {return (i+1 < col.size() ? col[i+1]-1 : n) - col[i];}
+    const char *fptr(int i) const {return s+col[i];}
+    std::string field(int i) const {return std::string(s+col[i], flen(i));}
+    // atoi, but stops at the end of the field, the mapping isn't nul terminated
+    int ifield(int i) const {
+        const char *p = s+col[i], *e = p+flen(i);
+        while (p < e && isspace(*p)) ++p;
+        bool neg = p < e && *p == '-';
+        if (p < e && (*p == '-' || *p == '+')) ++p;
+        int v = 0;
+        for (;p < e && *p >= '0' && *p <= '9';++p)
+            v = v*10 + (*p-'0');
+        return neg ? -v : v;
+    }
+};
+
+#define TIDX_LINE_CACHE 100000
+
+// index image, either a file mapping or a flattened version 1 index
+class tidx_image;
+
 class tidx {
-    FILE *fh;
+    friend class tidx_cursor;
     void init();
+
+    std::shared_ptr<tidx_image> img;
+    const tidx_hdr *hdr;
+    const tidx_chr *chrs;
+    const tidx_ivl *ivls;
+    const int64_t *pool;
+    const char *names;
+
+    bool attach(std::shared_ptr<tidx_image> i);
+    const tidx_chr *chrdex(const char *chr);
+    const tidx_ivl *find(const char *chr, int pos);
+
+    // the indexed file, mapped on first use, and parsed lines by offset
+    const char *text;
+    size_t text_len;
+    google::dense_hash_map<int64_t, int> line_at;
+    std::deque<tidx_line> line_tab;        // deque, so lines don't move as it grows
+    const tidx_ivl *last_ivl;
+    bool last_ok;
+    std::vector<const tidx_line *> last_lines;
+
+    const tidx_line *line(int64_t off);
+    void clear_lines();
+    const std::vector<const tidx_line *> &lines(const tidx_ivl *v);
+    std::string join(const std::vector<const tidx_line *> &v, const char *msep);
 public:
     bool debug;
     tidx() {init();};
     tidx(const char *path)  {init(); read(path);};
+    tidx(const tidx &x);                    // shares the index, but not the line cache
+    ~tidx();
 
     std::string path;
-    google::dense_hash_map<std::string,std::vector<annot> > map;
+    google::dense_hash_map<std::string,std::vector<annot> > map;    // build scratch, empty after read()
 
     void dump(FILE *stream);
     bool read(const char *path);
     void build(const char *path, const char *sep, int nchr, int nbeg, int nend, int skip_i, char skip_c, bool sub_e);
 
-    const std::vector <long int> & lookup(const char *chr, int pos);
+    tidx_pos lookup(const char *chr, int pos);
     std::string lookup(const char *chr, int pos, const char *msep);
 
+// lines for the interval containing pos, parsed once, and cached
+// repeat calls for positions in the same interval return the same list with no work
+// the pointers stay valid until the next call.  not thread safe, use a copy per thread
+    const std::vector<const tidx_line *> &lines(const char *chr, int pos);
+
 // range lookup
     std::vector <long int> lookup_r(const char *chr, int beg, int end);
     std::string lookup_r(const char *chr, int beg, int end, const char *msep);
@@ -34,10 +149,33 @@ public:
 // const char * return value
     const char * lookup_c(const char *chr, int pos, const char *msep);
     const char * lookup_cr(const char *chr, int beg, int end, const char *msep);
+
+private:
+    tidx &operator=(const tidx &);
+};
+
+// sorted sweeps: keeps its place in the current chromosome and steps forward, so increasing
+// positions are a merge-join against the intervals.  a position behind the last one is searched
+// for, so any order gives the same answers.  one per thread, the index must outlive it
+class tidx_cursor {
+    tidx *t;
+    std::string name;
+    bool have;
+    const tidx_chr *ch;
+    uint64_t cur;
+    int last;
+public:
+    tidx_cursor() {t=NULL; have=false; ch=NULL; cur=0; last=0;}
+    tidx_cursor(tidx &x) {t=&x; have=false; ch=NULL; cur=0; last=0;}
+    tidx *index() const {return t;}
+
+    const tidx_ivl *find(const char *chr, int pos);
+    tidx_pos lookup(const char *chr, int pos);
+    std::string lookup(const char *chr, int pos, const char *msep);
+    const std::vector<const tidx_line *> &lines(const char *chr, int pos);    // same rules as tidx::lines
 };
 
 void chomp_line(struct line &l);
 
 // build, with no return value, for API use
 void tidx_build(const char *path, const char *sep, int nchr, int nbeg, int nend, int skip_i, char skip_c, bool sub_e);
-
@@ -28,6 +28,7 @@ THE SOFTWARE.
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 
 #include <gsl/gsl_randist.h>
@@ -37,14 +38,22 @@ THE SOFTWARE.
 #include <string>
 #include <queue>
 #include <list>
+#include <set>
 
 #include <sparsehash/sparse_hash_map> // or sparse_hash_set, dense_hash_map, ...
 #include <sparsehash/dense_hash_map> // or sparse_hash_set, dense_hash_map, ...
 #include "tidx/tidx.h"
 
+#include "samtools/bam.h"
+#include "samtools/faidx.h"
+#include "fai-mm.h"
+extern "C" {
+    int bam_prob_realn_core(bam1_t *b, const char *ref, int flag);
+}
+
 #include "fastq-lib.h"
 
-#define SVNREV atoi(strchr("$Revision$", ':')+1)
+#define SVNREV atoi(strchr("$Revision: 0 $", ':')+1)
 const char * VERSION = "0.96";
 
 #define MIN_READ_LEN 20
@@ -115,35 +124,6 @@ extern int optind;
 int g_lineno=0;
 double vse_rate[T_CNT][T_CNT];
 
-class Faidx {
-public:
-    typedef struct {
-        int len;
-        long long offset;
-        int line_blen;
-        int line_len;
-    } Faient;
-
-    sparse_hash_map<string, Faient> faimap;
-
-    string fa_n;
-    FILE *fa_f;
-
-    Faidx() {fa_f=NULL;};
-    void Load(const char *path);                    // open file, read fai
-
-    // read into buffer
-    bool Fetch(char *buf, const string &chr, int pos_from, int pos_to) {
-        Fetch(buf, Chrdex(chr), pos_from, pos_to);
-    };
-
-    // read into buffer, with cached Chrdex
-    bool Fetch(char *buf, const Faient *ent, int pos_from, int pos_to);
-    const Faient * Chrdex(const string &chr) {
-        return &(faimap[chr]);
-    }
-};
-
 class Noise {
 public:
 	Noise() {noise=0;depth=0;};
@@ -187,7 +167,7 @@ public:
 class vfinal {
 public:
     vfinal(vcall &c) {max_idl_cnt=0; padj=1; pcall = &c;};
-    vfinal & operator=(vfinal const&x) {max_idl_seq=x.max_idl_seq; max_idl_cnt=x.max_idl_cnt; padj=x.padj; pcall=x.pcall;}
+    vfinal & operator=(vfinal const&x) {max_idl_seq=x.max_idl_seq; max_idl_cnt=x.max_idl_cnt; padj=x.padj; pcall=x.pcall; return *this;}
     vcall *pcall;
     string max_idl_seq;
     int max_idl_cnt;
@@ -206,18 +186,114 @@ public:
     Read() {MapQ=Pos=0;};
 };
 
+// live reads for one pileup stream, in pileup order
+// reads are pooled and their Seq buffers reused, each column rebuilds the order from the last one
+class ReadRing {
+public:
+    ReadRing() {k=0; at=-1;}
+
+    void Begin() {cur.swap(nxt); nxt.clear(); k=0;}
+
+    // a read starting at this column, after_cur puts it after the current read (text pileup list order)
+    Read &Start(int mapq, int pos, bool after_cur) {
+        if (after_cur && k < cur.size())
+            nxt.push_back(cur[k++]);
+        if (free_r.size()) {
+            at=free_r.back();
+            free_r.pop_back();
+        } else {
+            at=pool.size();
+            pool.push_back(Read());
+        }
+        Read &r = pool[at];
+        r.MapQ=mapq;
+        r.Pos=pos;
+        r.Seq.clear();
+        return r;
+    }
+
+    bool More() {return k < cur.size();}
+    Read &Next() {at=cur[k++]; return pool[at];}
+
+    // current read stays for the next column, or is done
+    void Keep() {nxt.push_back(at);}
+    void Drop() {free_r.push_back(at);}
+
+    // reads not seen at this column stay in place, returns the live count
+    int End() {
+        while (k < cur.size())
+            nxt.push_back(cur[k++]);
+        return nxt.size();
+    }
+
+    void Clear() {
+        cur.clear(); nxt.clear(); free_r.clear(); k=0;
+        int i; for (i=0;i<pool.size();++i) free_r.push_back(i);
+    }
+
+private:
+    vector<Read> pool;
+    vector<int> free_r;
+    vector<int> cur, nxt;
+    int k, at;
+};
+
+class q_calls {public: q_calls() {meminit(call);} int call[8];};
+
+typedef struct  {
+    string Chr;
+    int Beg;
+    int End;
+} ChrRange;
+
 class PileupReads {
 public:
     double MeanReadLen() {return ReadBin.size() ? TotReadLen/ReadBin.size() : MIN_READ_LEN;}
     int TotReadLen;
-    deque<Read> ReadBin;
-    list<Read> ReadList;
-    PileupReads() {TotReadLen=0;}
+    deque<int> ReadBin;                     // lengths of recently finished reads, on this reference only
+    const string *BinChr;                   // the reference they're from, interned
+    ReadRing ReadList;                      // text pileup reads
+    vector<int> DepthByPos;                 // per-column scratch, by position in read
+    vector<q_calls> DepthByPosByCall;
+    vector< vector<string> > SeqPool;       // indel seq lists from old columns, reused
+
+    // amplicon ranges, parsed once per annotation interval
+    vector<ChrRange> Amps;
+    int AmpRegions;
+    tidx_cursor AmpCur;
+    const tidx_ivl *AmpKey;
+
+    PileupReads() {TotReadLen=0; BinChr=NULL; AmpRegions=0; AmpKey=NULL;}
 };
 
+// chromosome names are interned, so columns (and window copies of them) just carry a pointer
+class ChrName {
+public:
+    ChrName() {s=&nil;}
+    ChrName & operator=(const char *chr) {if (strcmp(s->c_str(), chr)) s=Intern(chr); return *this;}
+    const char *data() const {return s->data();}
+    const char *c_str() const {return s->c_str();}
+    operator const string &() const {return *s;}
+private:
+    const string *s;
+    static const string nil;
+    static set<string> pool;
+    static pthread_mutex_t pool_lock;
+    static const string *Intern(const char *chr) {
+        pthread_mutex_lock(&pool_lock);
+        const string *r = &(*pool.insert(chr).first);
+        pthread_mutex_unlock(&pool_lock);
+        return r;
+    }
+};
+
+const string ChrName::nil;
+set<string> ChrName::pool;
+pthread_mutex_t ChrName::pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
 class PileupSummary {
 public:
-    string Chr;
+    ChrName Chr;
     int Pos;
     char Base;
     int Depth;
@@ -237,9 +313,82 @@ public:
     char RepeatBase;
 
 	void Parse(char *line, PileupReads &reads, tidx *annot=NULL, char annot_type='\0');
+
+    // column at a time, used by Parse and by the bam pileup engine
+    void Begin(const char *chr, int pos, char base, int depth, PileupReads &reads, tidx *annot, char annot_type);
+    void AddRead(Read &read, int i, bool sor, char o, char q, char indel, const char *indel_seq, int indel_len, PileupReads &reads);
+    void EndRead(Read &read, PileupReads &reads);
+    void End(PileupReads &reads);
+
     PileupSummary() { Base = '\0'; Pos=-1; };
+
+private:
+    int meanreadlen;
+    int maxdepthbypos;
+    int pia_len;
+    int eor;
+    bool use_amps;
+
+    vcall &Call(int j, PileupReads &reads);
+};
+
+// fixed size sliding window of columns, oldest slot is reused for the newest
+// repeat runs are tracked as columns come in, so the window is never rescanned
+class PileupWindow {
+public:
+    PileupWindow() {beg=cnt=0; n=0;}
+    void Init(int size) {slots.resize(size); seq.resize(size); runl.resize(size); rune.resize(size); beg=cnt=0; n=0;}
+
+    int size() const {return cnt;}
+    int capacity() const {return slots.size();}
+    PileupSummary & operator[](int i) {return slots[Slot(i)];}
+    PileupSummary & back() {return slots[Slot(cnt-1)];}
+
+    // add a column, dropping the oldest when full, with swap p gets the dropped slot's storage instead of a copy
+    void Push(PileupSummary &p, bool swap);
+
+    // length of the run of equal bases ending at i (looking left), or starting at i (looking right), within the window
+    int LeftRun(int i) {return min(runl[Slot(i)], i+1);}
+    int RightRun(int i) {int j=Slot(i); return (rune[j] < 0 ? n-1 : rune[j]) - seq[j] + 1;}
+
+private:
+    int Slot(int i) {int j=beg+i; return j >= slots.size() ? j-slots.size() : j;}
+    vector<PileupSummary> slots;
+    vector<long> seq;                   // push count when the column came in
+    vector<int> runl;                   // run length up to this column, not capped
+    vector<long> rune;                  // push count of the run's last column, -1 while the run is open
+    int beg, cnt;
+    long n;
 };
 
+void PileupWindow::Push(PileupSummary &p, bool swap) {
+    int i;
+    int prev = cnt ? Slot(cnt-1) : -1;
+    int run = 1;
+    if (prev >= 0 && slots[prev].Base == p.Base) {
+        run = runl[prev]+1;
+    } else {
+        // previous run is done, each column is closed once
+        for (i=cnt-1;i>=0 && rune[Slot(i)] < 0;--i) 
+            rune[Slot(i)] = n-1;
+    }
+
+    int j;
+    if (cnt < slots.size()) {
+        j = Slot(cnt++);
+    } else {
+        j = beg;
+        beg = beg+1 == slots.size() ? 0 : beg+1;
+    }
+    seq[j] = n++;
+    runl[j] = run;
+    rune[j] = -1;
+    if (swap)
+        std::swap(slots[j], p);
+    else
+        slots[j] = p;
+}
+
 class PileupManager;
 
 class PileupSubscriber {
@@ -247,6 +396,13 @@ public:
     PileupManager *Manager;
     virtual void Visit(PileupSummary &dat) = 0;
     virtual void Finish() {};
+
+    // sharded runs: an empty, unattached copy for each chunk, merged back in genomic order
+    virtual PileupSubscriber *Clone() {return NULL;};
+    virtual void Merge(PileupSubscriber &chunk) {};
+    virtual void Sync() {};             // write out anything buffered, the thread's outputs are about to change
+
+    virtual ~PileupSubscriber() {};
     PileupSubscriber(PileupManager &man);
     PileupSubscriber() {Manager = NULL;}
     void SetManager(PileupManager &man);
@@ -254,6 +410,8 @@ public:
 
 class PileupManager  {
 friend class PileupSubscriber;
+friend class BamPileup;
+friend class ShardRun;
 
 private:
     void Visit(PileupSummary &dat);
@@ -266,36 +424,52 @@ protected:
 public:
 
     string Reference;
+    mmfai::hint RefHint;    // Reference fills from the 2-bit cache skip its lock
     char InputType;
     int WinMax;             // flanking window size
     int WinDex;             // current index into the window (ususally midpoint)
 
-    deque<PileupSummary> Win;
+    PileupWindow Win;
+    PileupSummary Junk;     // gap/empty placeholder
 
     int UseAnnot;
     tidx AnnotDex;          // start/stop index file
+    tidx *Annot;            // index used for lookups, &AnnotDex unless shared
+    tidx_cursor AnnotCur;   // columns come in order, so in-target lookups sweep
     char AnnotType;         // b (bed) or g (gtf - preferred)
 
     PileupReads Reads;
+
+    int VisitBeg;           // if set, only positions VisitBeg..VisitEnd go to subscribers (sharded runs)
+    int VisitEnd;
  
-    PileupManager() {InputType ='\0'; WinMax=0; WinDex=0; UseAnnot=0; AnnotType='\0';}
+    PileupManager() {InputType ='\0'; WinMax=0; WinDex=0; UseAnnot=0; Annot=&AnnotDex; AnnotType='\0'; VisitBeg=VisitEnd=0;}
 
     void Finish();
+    void Flush();
 
     void Parse(char *dat);
 
     void LoadAnnot(const char *annot_file);
-    void FillReference(int refSize);
+    void FillReference(PileupSummary &p, int refSize);
+
+private:
+    void Shift(char base, int pos);
+    void Center();
 };
 
 class VarStatVisitor : public PileupSubscriber {
     public:
     VarStatVisitor() : PileupSubscriber() {tot_locii=0; tot_depth=0; num_reads=0; stats.reserve(1000000); ins_stats.reserve(1000000); del_stats.reserve(1000000);};
     VarStatVisitor(PileupManager &man) : PileupSubscriber(man) {tot_locii=0; tot_depth=0; num_reads=0;};
+    explicit VarStatVisitor(size_t reserve) : PileupSubscriber() {tot_locii=0; tot_depth=0; num_reads=0; stats.reserve(reserve); ins_stats.reserve(reserve); del_stats.reserve(reserve);};
 
     void Visit(PileupSummary &dat);
     void Finish() {};
 
+    PileupSubscriber *Clone() {return new VarStatVisitor((size_t) 0);};
+    void Merge(PileupSubscriber &chunk);
+
 	double tot_depth;
 	int tot_locii;
 	int num_reads;
@@ -305,6 +479,86 @@ class VarStatVisitor : public PileupSubscriber {
 };
 
 
+// one called locus, as written to the var/vcf/eav/vcb outputs
+class VarAllele {
+public:
+    char base;
+    bool is_ref;
+    int fwd, rev, qual, mq_rms, qual_rms;
+    double padj, diversity, agreement;
+    int idl_cnt, idl_len;
+    const char *idl_seq;                // not owned
+    int depth() const {return fwd+rev;}
+    bool is_indel() const {return idl_cnt > 0;}
+};
+
+class VarLocus {
+public:
+    const char *chr;                    // not owned
+    int pos;
+    char base;
+    int depth;
+    int skip;
+    double pct;
+    bool in_target;
+    int regions;
+    vector<VarAllele> calls;
+    int call_depth() const;
+};
+
+// what the header lines and optional columns depend on
+#define VCB_ANNOT   1                   // in-target column (annotation loaded)
+#define VCB_PCR     2                   // --pcr-annot, regions column
+#define VCB_TARGET  4                   // -A, on-target copies of the var file
+
+void write_var(FILE *var, FILE *tgt, const VarLocus &l, bool annot);
+void write_vcf(FILE *f, const VarLocus &l);
+void write_eav(FILE *f, const VarLocus &l, bool annot, bool pcr);
+void write_headers(FILE *var, FILE *tgt, FILE *vcf, FILE *eav, int flags, int locii);
+
+// columnar binary calls (.vcb), same content as the var/vcf/eav text, without the formatting
+//
+// file:  "VCB\1", int32 flags (VCB_*), int32 locii used for adjustment, then blocks until eof
+// block: "BLK\0", int32 loci, int32 alleles, int32 chrs, int32 heap bytes, then the columns:
+//        per locus:  int32 chr (index into the block's names), pos, depth, skip, regions,
+//                    double pct, char ref, uint8 in_target, uint8 number of alleles
+//        per allele: int32 fwd, rev, qual (sum), mq_rms, qual_rms, idl_cnt, idl_len,
+//                    double padj, diversity, agreement, char base, uint8 is_ref
+//        heap:       chr names (nul terminated), then indel sequences back to back
+// little-endian, as written.  blocks are self-contained so per-thread files can be concatenated.
+#define VCB_BLOCK 4096
+
+class VcbBlock {
+public:
+    VcbBlock() {out=NULL; clear();}
+
+    // buffer a locus for f, flushing first if the buffer was for some other file
+    void add(const VarLocus &l, FILE *f);
+    void flush();
+
+    static void write_header(FILE *f, int flags, int locii);
+    static bool read_header(FILE *f, int *flags, int *locii);
+    bool read(FILE *f);                 // next block, false at eof, dies if truncated
+    int size() const {return pos.size();}
+    void get(int i, VarLocus &l);
+
+private:
+    FILE *out;
+    vector<int32_t> first;              // first allele row of each locus, filled by read()
+    vector<string> chrs;
+    vector<int32_t> chr, pos, depth, skip, regions;
+    vector<double> pct;
+    vector<char> ref;
+    vector<uint8_t> in_target, ncall;
+    vector<int32_t> fwd, rev, qual, mq_rms, qual_rms, idl_cnt, idl_len, idl_off;
+    vector<double> padj, diversity, agreement;
+    vector<char> base;
+    vector<uint8_t> is_ref;
+    string heap;
+
+    void clear();
+};
+
 class VarCallVisitor : public PileupSubscriber {
     public:
 
@@ -315,14 +569,35 @@ class VarCallVisitor : public PileupSubscriber {
         Homs=0;
         Locii=0;
     };
+    VarCallVisitor() : PileupSubscriber() {
+        SkippedAnnot=0;
+        SkippedDepth=0;
+        Hets=0;
+        Homs=0;
+        Locii=0;
+    };
 
     void Visit(PileupSummary &dat);
+    void Finish() {Vcb.flush();};
+    void Sync() {Vcb.flush();};
+
+    PileupSubscriber *Clone() {return new VarCallVisitor();};
+    void Merge(PileupSubscriber &chunk) {
+        VarCallVisitor &x = (VarCallVisitor &) chunk;
+        SkippedDepth+=x.SkippedDepth;
+        SkippedAnnot+=x.SkippedAnnot;
+        Locii+=x.Locii;
+        Hets+=x.Hets;
+        Homs+=x.Homs;
+    };
 
 	int SkippedDepth;
 	int SkippedAnnot;
 	int Locii;
 	int Hets;
 	int Homs;
+    VarLocus Loc;
+    VcbBlock Vcb;
 };
 
 bool hasdata(const string &file) {
@@ -357,14 +632,21 @@ int read_tail_pct=.6;
 int read_tail_len=4;
 int min_idepth=3;
 int no_baq=0;
+int threads=1;                  // > 1 splits the bam by reference
+int chunk_size=0;               // 0 is a chunk per reference
+bool ref_2bit=false;            // reference fetches from a 2-bit cache, one chromosome per thread
 double zygosity=.5;		        // set to .1 for 1 10% admixture, or even .05 for het/admix
 bool output_ref=0;              // set to 1 if you want to output reference-only positions
 bool no_indels=0;
 
 void parse_bams(PileupManager &v, int in_n, char **in, const char *ref);
 void check_ref_fai(const char * ref);
+void load_ref(const char * ref);
+
+FILE *varsum_f = NULL;
 
-FILE *noise_f=NULL, *var_f = NULL, *varsum_f = NULL, *tgt_var_f = NULL, *tgt_cse_f = NULL, *vcf_f = NULL, *eav_f=NULL, *cse_f=NULL;
+// per thread, so sharded runs can write each chunk to its own temp file
+__thread FILE *noise_f=NULL, *var_f = NULL, *tgt_var_f = NULL, *tgt_cse_f = NULL, *vcf_f = NULL, *eav_f=NULL, *cse_f=NULL, *vcb_f=NULL;
 
 double alpha=.05;
 int phred=33;
@@ -392,8 +674,9 @@ int str_in(const char *needle, const char **haystack) {
 }
 
 void output_stats(VarStatVisitor &vstat);
+int vcb_convert(const char *path, const char *out_prefix, const char **format_list);
 
-Faidx faidx;
+mmfai faidx;                    // shared by the bam pileup and cse context
 bool pcr_annot = false;
 
 int main(int argc, char **argv) {
@@ -410,6 +693,7 @@ int main(int argc, char **argv) {
     char *out_prefix = NULL;
     char *target_annot = NULL;
     const char *read_stats = NULL;
+    const char *from_vcb = NULL;
 
 
 // list of default output formats used when -o is specified
@@ -421,6 +705,9 @@ int main(int argc, char **argv) {
     #define OPT_PCR_ANNOT '\1'
     #define OPT_DEBUG_LEVEL '\2'
     #define OPT_NO_INDELS '\3'
+    #define OPT_CHUNK '\4'
+    #define OPT_REF_2BIT '\5'
+    #define OPT_FROM_VCB '\7'
     #define OPT_FILTER_ANNOT 'A'
 
 // long options
@@ -433,10 +720,13 @@ int main(int argc, char **argv) {
        {"diversity", 1, 0, 'd'},
        {"version", 0, 0, 'V'},
        {"debug", 1, 0, OPT_DEBUG_LEVEL},
+       {"chunk", 1, 0, OPT_CHUNK},
+       {"ref-2bit", 0, 0, OPT_REF_2BIT},
+       {"from-vcb", 1, 0, OPT_FROM_VCB},
        {0, 0, 0, 0}
     };
 
-	while ( (c = getopt_long(argc, argv, "?sv0VBhe:m:x:f:p:a:g:q:Q:i:o:D:R:b:L:S:F:A:G:d:",long_options,NULL)) != -1) {
+	while ( (c = getopt_long(argc, argv, "?sv0VBhe:m:x:f:p:a:g:q:Q:i:o:D:R:b:L:S:F:A:G:d:t:",long_options,NULL)) != -1) {
 		switch (c) {
 			case OPT_PCR_ANNOT: target_annot=optarg; pcr_annot=true; break;
 			case OPT_FILTER_ANNOT: target_annot=optarg; pcr_annot=false; break;
@@ -448,6 +738,10 @@ int main(int argc, char **argv) {
 			case 'Q': min_mapq=ok_atoi(optarg); break;
 			case 'V': printf("Version: %s.%d\n", VERSION, SVNREV); exit(0); break;
 			case 'R': repeat_filter=ok_atoi(optarg); break;
+			case 't': threads=ok_atoi(optarg); break;
+			case OPT_CHUNK: chunk_size=ok_atoi(optarg); break;
+			case OPT_REF_2BIT: ref_2bit=true; break;
+			case OPT_FROM_VCB: from_vcb=optarg; break;
 			case 'a': uminadepth=ok_atoi(optarg);break;
 			case 'D': artifact_filter=atof(optarg);break;
 			case 'i': uminidepth=ok_atoi(optarg);break;
@@ -478,7 +772,7 @@ int main(int argc, char **argv) {
 			case 'v': do_varcall=1; break;
 			case 'F': {
                 char *tok, *saved; int i=0;
-                for (tok = strtok_r(optarg, "%", &saved); tok && i < MAX_F; tok = strtok_r(NULL, " ,", &saved)) {
+                for (tok = strtok_r(optarg, " ,", &saved); tok && i < MAX_F; tok = strtok_r(NULL, " ,", &saved)) {
                     format_list[i++]=tok;
                 }
                 format_list[i]=NULL;
@@ -499,6 +793,9 @@ int main(int argc, char **argv) {
 	}
 
 
+    if (from_vcb) 
+        return vcb_convert(from_vcb, out_prefix, format_list);
+
 	if (!do_stats && !do_varcall) {
 		warn("Specify -s for stats only, or -v to do variant calling\n\n");
 		usage(stderr);
@@ -506,17 +803,17 @@ int main(int argc, char **argv) {
 	}
 
     if (out_prefix && do_varcall) {
-        var_f = openordie(string_format("%s.var.tmp", out_prefix).c_str(), "w");
+        // vcb replaces the var file, unless both are asked for
+        if (str_in("vcb", format_list)<0 || str_in("var", format_list)>=0) {
+            var_f = openordie(string_format("%s.var.tmp", out_prefix).c_str(), "w");
 
-        fprintf(var_f,"%s\t%s\t%s\t%s\t%s\t%s\t%s%s\n","chr", "pos", "ref", "depth", "skip", "pct", (target_annot&&!pcr_annot) ? "target\t" : pcr_annot ? "regions\t" : "", "...");
+            if (target_annot && !pcr_annot) {
+                // targted only output
+                tgt_var_f = openordie(string_format("%s.tgt.var.tmp", out_prefix).c_str(), "w");
+            }
+        }
 
         varsum_f = openordie(string_format("%s.varsum.tmp", out_prefix).c_str(), "w");
-
-        if (target_annot && !pcr_annot) {
-            // targted only output
-            tgt_var_f = openordie(string_format("%s.tgt.var.tmp", out_prefix).c_str(), "w");
-            fprintf(tgt_var_f,"%s\t%s\t%s\t%s\t%s\t%s\t%s\n","chr", "pos", "ref", "depth", "skip", "pct", "...");
-        }
  
         if (str_in("vcf", format_list)>=0) {
             vcf_f = openordie(string_format("%s.vcf.tmp", out_prefix).c_str(), "w");
@@ -524,11 +821,14 @@ int main(int argc, char **argv) {
         if (str_in("eav", format_list)>=0) {
             eav_f = openordie(string_format("%s.eav.tmp", out_prefix).c_str(), "w");
         }
+        if (str_in("vcb", format_list)>=0) {
+            vcb_f = openordie(string_format("%s.vcb.tmp", out_prefix).c_str(), "wb");
+        }
 
         if (str_in("cse", format_list)>=0) {
             check_ref_fai(ref);
             cse_f = openordie(string_format("%s.cse.tmp", out_prefix).c_str(), "w");
-            faidx.Load(ref);
+            load_ref(ref);
             // targted only output
             if (target_annot && ! pcr_annot) 
                 tgt_cse_f = openordie(string_format("%s.tgt.cse.tmp", out_prefix).c_str(), "w");
@@ -683,10 +983,6 @@ int main(int argc, char **argv) {
     if (total_locii<0) total_locii=DEFAULT_LOCII;
     if (total_locii==0) total_locii=1;          // no adjustment
 
-    if (eav_f) {
-        fprintf(eav_f,"chr\tpos\tref\tdepth\tnum_states\ttop_consensus\ttop_freq\tvar_base\tvar_depth\tvar_qual\tvar_strands\tforward_strands\treverse_strands\t%cval\tdiversity\tagreement\t%s\n", (total_locii>1?'e':'p'), (target_annot&&!pcr_annot) ? "in_target\t" : pcr_annot ? "regions\t" : "");
-    }
-
 	if (do_varcall) {
 		if (umindepth) min_depth=umindepth;
 		if (upctqdepth > 0) pct_qdepth=(double)upctqdepth/100;
@@ -736,9 +1032,11 @@ int main(int argc, char **argv) {
             pman.WinMax=5;
         }
 
-        if (vcf_f) {
-            // print VCF header
-            fprintf(vcf_f, "%s\n", "##fileformat=VCFv4.1");
+        if (out_prefix) {
+            int flags = (pman.UseAnnot==1 ? VCB_ANNOT : 0) | (pcr_annot ? VCB_PCR : 0) | (target_annot && !pcr_annot ? VCB_TARGET : 0);
+            write_headers(var_f, tgt_var_f, vcf_f, eav_f, flags, total_locii);
+            if (vcb_f) 
+                VcbBlock::write_header(vcb_f, flags, total_locii);
         }
         if (cse_f) {
             fprintf(cse_f, "Chr\tPos\tRef\tA\tC\tG\tT\ta\tc\tg\tt\tAq\tCq\tGq\tTq\taq\tcq\tgq\ttq\tRefAllele\tAd\tCd\tGd\tTd\tAg\tCg\tGg\tTg%s\n", pcr_annot ? "\tRegions" : "");
@@ -757,20 +1055,22 @@ int main(int argc, char **argv) {
 
         if (out_prefix) {
             // close it all
-            fclose(var_f);
+            if (var_f) fclose(var_f);
             fclose(varsum_f);
             if (vcf_f) fclose(vcf_f);
             if (eav_f) fclose(eav_f);
+            if (vcb_f) fclose(vcb_f);
             if (noise_f) fclose(noise_f);
             if (cse_f) fclose(cse_f);
             if (tgt_var_f) fclose(tgt_var_f);
             if (tgt_cse_f) fclose(tgt_cse_f);
 
-            rename_tmp(string_format("%s.var.tmp", out_prefix));
+            if (var_f) rename_tmp(string_format("%s.var.tmp", out_prefix));
             rename_tmp(string_format("%s.varsum.tmp", out_prefix));
 
             if (vcf_f) rename_tmp(string_format("%s.vcf.tmp", out_prefix));
             if (eav_f) rename_tmp(string_format("%s.eav.tmp", out_prefix));
+            if (vcb_f) rename_tmp(string_format("%s.vcb.tmp", out_prefix));
             if (cse_f) rename_tmp(string_format("%s.cse.tmp", out_prefix));
 
             if (tgt_var_f) rename_tmp(string_format("%s.tgt.var.tmp", out_prefix));
@@ -841,6 +1141,532 @@ double pnorm(double x)
     return 0.5*(1.0 + sign*y);
 }
 
+#define REF_WINDOW (1<<20)             // reference bases fetched at a time by the bam pileup
+#define REF_BEHIND 4096
+
+// in-process replacement for "samtools mpileup -Q 0 -d 100000 [-B] -f REF bam1 [bam2...]"
+// columns are built straight from the bam records, reads from all bams are pooled
+class BamPileup {
+public:
+    BamPileup();
+    ~BamPileup();
+
+    void Open(int in_n, char **in, mmfai *ref, bam_index_t **idx=NULL);
+    void SetRegion(int tid, int beg, int end);      // 0-based, end exclusive, needs the indexes passed to Open
+    int Run(PileupManager &v);                      // returns the number of columns visited
+
+    const bam_header_t *Header() {return src[0].h;}
+
+private:
+    typedef struct {
+        bamFile fp;
+        bam_header_t *h;
+        bam_index_t *idx;
+        bam_iter_t iter;
+        BamPileup *pile;
+    } Source;
+
+    vector<Source> src;
+    int reg_tid, reg_beg, reg_end;
+    vector<ReadRing> reads;                         // live reads for each bam, in pileup order
+    mmfai *fai;
+    string idl;
+
+    // reference windows: one slot is pinned by the current column, the other is for reads loaded ahead of it
+    int ref_tid[2];
+    int ref_len[2];                                 // whole sequence, -1 if it's not in the fasta
+    int ref_beg[2], ref_end[2];                     // window held
+    string ref_seq[2];
+    int ref_pin;
+    mmfai::hint ref_hint;
+    const char *RefSeq(int tid, int beg, int end, int *len, bool pin);
+
+    static int ReadFunc(void *data, bam1_t *b);
+};
+
+BamPileup::BamPileup() {
+    fai=NULL;
+    reg_tid=-1;
+    reg_beg=reg_end=0;
+    ref_pin=-1;
+    ref_tid[0]=ref_tid[1]=-1;
+    ref_len[0]=ref_len[1]=-1;
+    ref_beg[0]=ref_beg[1]=ref_end[0]=ref_end[1]=0;
+}
+
+BamPileup::~BamPileup() {
+    int i;
+    for (i=0;i<src.size();++i) {
+        if (src[i].iter)
+            bam_iter_destroy(src[i].iter);
+        bam_header_destroy(src[i].h);
+        bam_close(src[i].fp);
+    }
+}
+
+void BamPileup::Open(int in_n, char **in, mmfai *ref, bam_index_t **idx) {
+    fai = ref;
+
+    int i, t;
+    src.resize(in_n);
+    reads.resize(in_n);
+    for (i=0;i<in_n;++i) {
+        src[i].pile=this;
+        src[i].idx=idx ? idx[i] : NULL;
+        src[i].iter=NULL;
+        src[i].fp=bam_open(in[i], "r");
+        if (!src[i].fp) {
+            die("%s: %s\n", in[i], strerror(errno));
+        }
+        src[i].h=bam_header_read(src[i].fp);
+        if (!src[i].h) {
+            die("%s: can't read bam header\n", in[i]);
+        }
+        // columns are merged by tid, so the bams must agree on the reference order
+        if (i > 0) {
+            bool same = src[i].h->n_targets == src[0].h->n_targets;
+            for (t=0;same && t<src[0].h->n_targets;++t) {
+                same = !strcmp(src[i].h->target_name[t], src[0].h->target_name[t]);
+            }
+            if (!same) {
+                die("%s: reference sequences differ from %s\n", in[i], in[0]);
+            }
+        }
+    }
+}
+
+void BamPileup::SetRegion(int tid, int beg, int end) {
+    int i;
+    for (i=0;i<reads.size();++i) 
+        reads[i].Clear();
+    reg_tid=tid;
+    reg_beg=beg;
+    reg_end=end;
+    for (i=0;i<src.size();++i) {
+        if (src[i].iter)
+            bam_iter_destroy(src[i].iter);
+        src[i].iter=bam_iter_query(src[i].idx, tid, beg, end);
+    }
+}
+
+// reference for beg..end-1 (clipped to the sequence), indexed by position, so only the window holding
+// that range can be read; NULL if the sequence isn't in the fasta, *len gets the sequence length
+const char *BamPileup::RefSeq(int tid, int beg, int end, int *len, bool pin) {
+    int i;
+    for (i=0;i<2;++i) {
+        if (ref_tid[i] == tid) {
+            if (ref_len[i] < 0)
+                break;
+            int b = max(0, min(beg, ref_len[i])), e = max(b, min(end, ref_len[i]));
+            if (b >= ref_beg[i] && e <= ref_end[i])
+                break;
+        }
+    }
+    if (i == 2) {
+        // never evict the column's window
+        i = ref_pin == 0 ? 1 : 0;
+        const mmfai::ent *e = fai->chrdex(src[0].h->target_name[tid]);
+        ref_tid[i] = tid;
+        ref_len[i] = e ? e->len : -1;
+        if (e) {
+            // a little behind, for reads loaded out of order, and a good way ahead
+            int b = max(0, min(beg, e->len)), n = max(0, min(end, e->len)) - b;
+            ref_beg[i] = max(0, b-REF_BEHIND);
+            ref_end[i] = min(e->len, b+max(n, REF_WINDOW));
+            // buffers are reused, and stay nul terminated for baq at the end of the sequence
+            ref_seq[i].resize(ref_end[i]-ref_beg[i]);
+            if (ref_seq[i].size() && !fai->fetch(&ref_seq[i][0], e, ref_beg[i], ref_end[i]-1, &ref_hint)) 
+                ref_len[i] = -1;
+        }
+    }
+    if (pin)
+        ref_pin = i;
+    *len = max(0, ref_len[i]);
+    return ref_len[i] > 0 ? ref_seq[i].data() - ref_beg[i] : NULL;
+}
+
+// same read filter as mpileup: no unmapped (or secondary, qc-fail, dup... via the default pileup mask), no anomalous pairs
+int BamPileup::ReadFunc(void *data, bam1_t *b) {
+    Source *s = (Source *) data;
+    int ret;
+    while ((ret = s->iter ? bam_iter_read(s->fp, s->iter, b) : bam_read1(s->fp, b)) >= 0) {
+        if (b->core.tid < 0 || (b->core.flag & BAM_FUNMAP)) 
+            continue;
+        if ((b->core.flag & BAM_FPAIRED) && !(b->core.flag & BAM_FPROPER_PAIR)) 
+            continue;
+        if (!no_baq) {
+            // baq reads the reference up to a read length, plus half its band, either side
+            int len, pos = b->core.pos, span = bam_calend(&b->core, bam1_cigar(b)) - pos;
+            int pad = b->core.l_qseq + (span + b->core.l_qseq)/2 + 16;
+            const char *ref = s->pile->RefSeq(b->core.tid, pos-pad, pos+span+pad, &len, false);
+            if (ref) 
+                bam_prob_realn_core(b, ref, 1);
+        }
+        break;
+    }
+    return ret;
+}
+
+int BamPileup::Run(PileupManager &v) {
+    int n = src.size();
+    vector<void *> data(n);
+    vector<int> n_plp(n);
+    vector<const bam_pileup1_t *> plp(n);
+    int f, k, j;
+
+    for (f=0;f<n;++f) 
+        data[f] = &src[f];
+
+    bam_mplp_t iter = bam_mplp_init(n, ReadFunc, data.data());
+    bam_mplp_set_maxcnt(iter, 100000);
+
+    PileupSummary &col = v.Pileup;
+    tidx *adex = v.UseAnnot ? v.Annot : NULL;
+    int tid, pos, cols=0;
+
+    while (bam_mplp_auto(iter, &tid, &pos, n_plp.data(), plp.data()) > 0) {
+        // reads overlapping a region edge still need all their columns, but only the region is visited
+        bool visit = reg_tid < 0 || (pos >= reg_beg && pos < reg_end);
+        if (visit && (!v.VisitEnd || (pos+1 >= v.VisitBeg && pos+1 <= v.VisitEnd)))
+            ++cols;
+
+        int ref_len;
+        const char *ref = RefSeq(tid, pos, pos+1, &ref_len, true);
+        char base = (ref && pos < ref_len) ? ref[pos] : 'N';
+
+        int depth=0;
+        for (f=0;f<n;++f) 
+            depth+=n_plp[f];
+
+        col.Begin(src[0].h->target_name[tid], pos+1, base, depth, v.Reads, adex, v.AnnotType);
+
+        int i = 0;
+        for (f=0;f<n;++f) {
+            ReadRing &live = reads[f];
+            live.Begin();
+            for (k=0;k<n_plp[f];++k,++i) {
+                const bam_pileup1_t *p = plp[f]+k;
+                const bam1_t *b = p->b;
+                bool rev = bam1_strand(b);
+                Read *read;
+
+                if (p->is_head) {
+                    read = &live.Start(min(93, (int) b->core.qual), pos+1, false);
+                } else if (live.More()) {
+                    read = &live.Next();
+                } else {
+                    read = &live.Start(0, -1, false);
+                }
+
+                // call chars and quals as mpileup would print them
+                char o;
+                int q = p->qpos < b->core.l_qseq ? bam1_qual(b)[p->qpos] : 0;
+                if (q > 93) q = 93;
+
+                if (p->is_del) {
+                    o = p->is_refskip ? (rev ? '<' : '>') : '*';
+                } else {
+                    int c = bam_nt16_rev_table[bam1_seqi(bam1_seq(b), p->qpos)];
+                    if (c == '=' || (ref && bam_nt16_table[c] == bam_nt16_table[(int)base])) 
+                        o = rev ? ',' : '.';
+                    else 
+                        o = rev ? tolower(c) : toupper(c);
+                }
+
+                char indel = '\0';
+                int indel_len = 0;
+                if (p->indel > 0) {
+                    indel = '+';
+                    indel_len = p->indel;
+                    idl.resize(indel_len);
+                    for (j=1;j<=indel_len;++j) {
+                        int c = bam_nt16_rev_table[bam1_seqi(bam1_seq(b), p->qpos + j)];
+                        idl[j-1] = rev ? tolower(c) : toupper(c);
+                    }
+                } else if (p->indel < 0) {
+                    indel = '-';
+                    indel_len = -p->indel;
+                    idl.resize(indel_len);
+                    if (ref) 
+                        ref = RefSeq(tid, pos, pos+indel_len+1, &ref_len, true);
+                    for (j=1;j<=indel_len;++j) {
+                        int c = (ref && pos+j < ref_len) ? ref[pos+j] : 'N';
+                        idl[j-1] = rev ? tolower(c) : toupper(c);
+                    }
+                }
+
+                col.AddRead(*read, i, p->is_head, o, q, indel, idl.data(), indel_len, v.Reads);
+
+                if (p->is_tail) {
+                    col.EndRead(*read, v.Reads);
+                    live.Drop();
+                } else {
+                    live.Keep();
+                }
+            }
+            live.End();
+        }
+
+        col.End(v.Reads);
+        if (visit)
+            v.Visit(col);
+    }
+
+    bam_mplp_destroy(iter);
+    return cols;
+}
+
+// per-locus outputs, in the calling thread
+#define SHARD_OUTS 8
+#define SHARD_LEAD 1000
+FILE **shard_out(int i) {
+    switch (i) {
+        case 0: return &var_f;
+        case 1: return &vcf_f;
+        case 2: return &eav_f;
+        case 3: return &cse_f;
+        case 4: return &tgt_var_f;
+        case 5: return &tgt_cse_f;
+        case 6: return &vcb_f;
+        default: return &noise_f;
+    }
+}
+
+class Shard {
+public:
+    int tid, beg, end;                  // 0-based, end exclusive
+    int cols;                           // columns visited in beg..end
+    bool done;
+    PileupManager *man;                 // with cloned subscribers, not yet flushed
+    FILE *out[SHARD_OUTS];              // temp copies of the per-locus outputs
+    Shard(int t, int b, int e) {tid=t; beg=b; end=e; cols=0; done=false; man=NULL; meminit(out);}
+};
+
+// sharded run: each reference is a chunk, or is cut into --chunk sized ones, each one is piled up by its own PileupManager on a
+// pool of threads, outputs and subscriber stats are merged back in genomic order by the main thread
+class ShardRun {
+public:
+    ShardRun(PileupManager &v, int in_n, char **in, mmfai *ref);
+    ~ShardRun();
+    bool Run();                         // false if the input can't be sharded
+
+private:
+    PileupManager &v;
+    int in_n;
+    char **in;
+    mmfai *ref;
+
+    vector<bam_index_t *> idx;
+    vector<Shard> chunks;
+    vector<tidx *> annots;
+    bool use[SHARD_OUTS];
+    int next;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    void Chunk(const bam_header_t *h);
+    void Finish(Shard &c, bool last);
+    static void *Worker(void *arg);
+};
+
+ShardRun::ShardRun(PileupManager &pman, int n, char **files, mmfai *fa) : v(pman) {
+    in_n=n;
+    in=files;
+    ref=fa;
+    next=0;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+ShardRun::~ShardRun() {
+    int i;
+    for (i=0;i<idx.size();++i) 
+        if (idx[i]) bam_index_destroy(idx[i]);
+    for (i=0;i<annots.size();++i) 
+        delete annots[i];
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&cond);
+}
+
+// a chunk per reference, or with --chunk, cut each reference into chunks, moving cuts out of annotated intervals
+void ShardRun::Chunk(const bam_header_t *h) {
+    int t;
+    for (t=0;t<h->n_targets;++t) {
+        int len = h->target_len[t];
+        int beg = 0;
+        while (beg < len) {
+            int end = chunk_size ? min(len, beg+chunk_size) : len;
+            if (v.UseAnnot) {
+                while (end < len && v.Annot->lookup(h->target_name[t], end+1 + (v.AnnotType=='b' ? -1 : 0)).size()) 
+                    ++end;
+            }
+            chunks.push_back(Shard(t, beg, end));
+            beg = end;
+        }
+    }
+}
+
+void *ShardRun::Worker(void *arg) {
+    ShardRun *r = (ShardRun *) arg;
+    PileupManager &v = r->v;
+    int i, k;
+
+    // pcr amplicon lookups go through the index's line cache, so each thread gets its own copy
+    tidx *annot = v.Annot;
+    if (v.UseAnnot && pcr_annot) {
+        annot = new tidx(*v.Annot);
+        pthread_mutex_lock(&r->lock);
+        r->annots.push_back(annot);
+        pthread_mutex_unlock(&r->lock);
+    }
+
+    BamPileup pile;
+    pile.Open(r->in_n, r->in, r->ref, r->idx.data());
+
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        i = r->next++;
+        pthread_mutex_unlock(&r->lock);
+        if (i >= r->chunks.size()) 
+            break;
+
+        Shard &c = r->chunks[i];
+        for (k=0;k<SHARD_OUTS;++k) {
+            c.out[k] = r->use[k] ? tmpfile() : NULL;
+            if (r->use[k] && !c.out[k]) 
+                die("Can't create temp file: %s\n", strerror(errno));
+            *shard_out(k) = c.out[k];
+        }
+
+        PileupManager *m = new PileupManager();
+        m->InputType = v.InputType;
+        m->WinMax = v.WinMax;
+        m->UseAnnot = v.UseAnnot;
+        m->Annot = annot;
+        m->AnnotType = v.AnnotType;
+        m->VisitBeg = c.beg+1;
+        m->VisitEnd = c.end;
+        for (k=0;k<v.Kids.size();++k) 
+            v.Kids[k]->Clone()->SetManager(*m);
+
+        // a full window of flank on each side, so repeat/indel context matches a single pass, and some
+        // lead-in so the read length estimate (used by the artifact filter) has a history after a cut
+        // this only approximates the single pass bin, so --chunk output can differ just past a cut
+        int flank = max(v.WinMax, 1);
+        int lead = max(flank, SHARD_LEAD);
+        pile.SetRegion(c.tid, max(0, c.beg-lead), min((int) pile.Header()->target_len[c.tid], c.end+flank));
+        int cols = pile.Run(*m);
+        for (k=0;k<m->Kids.size();++k) 
+            m->Kids[k]->Sync();
+
+        pthread_mutex_lock(&r->lock);
+        c.cols = cols;
+        c.man = m;
+        c.done = true;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+    return NULL;
+}
+
+// window tail of a chunk goes straight to the real outputs, then its subscribers are merged
+void ShardRun::Finish(Shard &c, bool last) {
+    int k;
+    if (last) 
+        c.man->Finish();
+    else 
+        c.man->Flush();
+    for (k=0;k<v.Kids.size();++k) {
+        c.man->Kids[k]->Sync();
+        v.Kids[k]->Merge(*c.man->Kids[k]);
+        delete c.man->Kids[k];
+    }
+    delete c.man;
+    c.man = NULL;
+}
+
+bool ShardRun::Run() {
+    int i, k;
+
+    // every subscriber has to know how to merge
+    for (k=0;k<v.Kids.size();++k) {
+        PileupSubscriber *x = v.Kids[k]->Clone();
+        if (!x) 
+            return false;
+        delete x;
+    }
+
+    for (i=0;i<in_n;++i) {
+        idx.push_back(bam_index_load(in[i]));
+        if (!idx.back()) {
+            warn("warning\tno index for %s, can't split over threads\n", in[i]);
+            return false;
+        }
+    }
+
+    bamFile fp = bam_open(in[0], "r");
+    if (!fp) 
+        die("%s: %s\n", in[0], strerror(errno));
+    bam_header_t *h = bam_header_read(fp);
+    Chunk(h);
+    bam_header_destroy(h);
+    bam_close(fp);
+
+    for (k=0;k<SHARD_OUTS;++k) 
+        use[k] = *shard_out(k) != NULL;
+
+    int nt = min(threads, (int) chunks.size());
+    warn("threads\t%d, %d chunks\n", nt, (int) chunks.size());
+
+    vector<pthread_t> tids(nt);
+    for (i=0;i<nt;++i) 
+        pthread_create(&tids[i], NULL, Worker, this);
+
+    // merge in order, a chunk's window is only flushed once the next chunk with data is known
+    char buf[0x10000];
+    Shard *pending = NULL;
+    g_lineno = 0;
+    for (i=0;i<chunks.size();++i) {
+        Shard &c = chunks[i];
+        pthread_mutex_lock(&lock);
+        while (!c.done) 
+            pthread_cond_wait(&cond, &lock);
+        pthread_mutex_unlock(&lock);
+
+        if (c.cols && pending) 
+            Finish(*pending, false);
+
+        for (k=0;k<SHARD_OUTS;++k) {
+            if (c.out[k]) {
+                size_t n;
+                rewind(c.out[k]);
+                while ((n=fread(buf, 1, sizeof(buf), c.out[k])) > 0) 
+                    fwrite(buf, 1, n, *shard_out(k));
+                fclose(c.out[k]);
+                c.out[k] = NULL;
+            }
+        }
+
+        if (c.cols) {
+            pending = &c;
+        } else {
+            // nothing visited, nothing to merge
+            for (k=0;k<c.man->Kids.size();++k) 
+                delete c.man->Kids[k];
+            delete c.man;
+            c.man = NULL;
+        }
+        g_lineno += c.cols;
+    }
+    if (pending) 
+        Finish(*pending, true);
+
+    for (i=0;i<nt;++i) 
+        pthread_join(tids[i], NULL);
+
+    return true;
+}
+
 void parse_bams(PileupManager &v, int in_n, char **in, const char *ref) {
 
 	if (!in_n) {
@@ -871,29 +1697,24 @@ void parse_bams(PileupManager &v, int in_n, char **in, const char *ref) {
 	}
 
 	int is_popen = 0;
-	FILE *fin;
+	FILE *fin = NULL;
 
+    g_lineno=0;
 	if (bam_n) {
         check_ref_fai(ref);
+        load_ref(ref);
 
-		const char *nobaq = no_baq ? "-B" : "";
-
-		string mpil_cmd = string_format("samtools mpileup -Q 0 -d 100000 %s -f '%s'", nobaq, ref);
-
-		int i;
-		for (i=0;i<in_n;++i) {
-			mpil_cmd += " '";
-			mpil_cmd += in[i];
-			mpil_cmd += "' ";
-		}
-
-		warn("command\t%s\n", mpil_cmd.c_str());
+		warn("baq\t%s\n", no_baq ? "off" : "on");
 
-		fin = popen(mpil_cmd.c_str(), "r");
-		if (!fin) 
-			exit(1);
-
-		is_popen = 1;
+        ShardRun shards(v, in_n, in, &faidx);
+        if (threads > 1 && !debug_xpos && shards.Run()) {
+            v.Finish();
+        } else {
+            BamPileup pile;
+            pile.Open(in_n, in, &faidx);
+            g_lineno = pile.Run(v);
+            v.Finish();
+        }
 	} else {
         if (!strcmp(in[0], "-")) {
             fin=stdin;
@@ -913,7 +1734,6 @@ void parse_bams(PileupManager &v, int in_n, char **in, const char *ref) {
 	}
 
     line l; meminit(l);
-    g_lineno=0;
     if (fin) {
         while(read_line(fin, l)>0) {
             ++g_lineno;
@@ -934,15 +1754,6 @@ void parse_bams(PileupManager &v, int in_n, char **in, const char *ref) {
 
 bool hitoloint (int i,int j) { return (i>j);}
 
-class q_calls {public: q_calls() {meminit(call);} int call[8];};
-vector<int> depthbypos;
-vector<q_calls> depthbyposbycall;
-typedef struct  {
-    string Chr;
-    int Beg;
-    int End;
-} ChrRange;
-
 
 char *_dat[256];
 inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char atype) {
@@ -956,10 +1767,101 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
 
 	const char * p_qual=_dat[5];
 
-	Chr=_dat[0];
-	Pos=atoi(_dat[1]);
-	Base=*(_dat[2]);
-	Depth = atoi(_dat[3]);
+	Begin(_dat[0], atoi(_dat[1]), *(_dat[2]), atoi(_dat[3]), rds, adex, atype);
+
+	int i;
+
+	const char *cur_p = _dat[4];
+
+    ReadRing &live = rds.ReadList;
+    live.Begin();
+
+	for (i=0;i<Depth;++i) {
+		bool sor=0;
+        Read *read;
+
+		if (*cur_p == '^') {
+			sor=1;
+			++cur_p;
+            read = &live.Start(*cur_p-phred, Pos, true);
+            ++cur_p;
+		} else if (live.More()) {
+            read = &live.Next();
+        } else {
+            warn("warning\tread start without '^', partial pileup: '%s'\n", cur_p);
+            read = &live.Start(0, -1, false);
+		}
+
+		char o = *cur_p;				// orig call
+        const char *next_p = cur_p;
+
+		if (o == '-' || o == '+') {
+            warn("invalid pileup, at '%s', indel not attached to read?\n", cur_p);
+		} else {
+			++next_p;
+		}
+
+        char indel = '\0';
+        const char *indel_seq = NULL;
+        int indel_len = 0;
+        if (*next_p == '+' || *next_p == '-') {
+            char *end_p;
+            indel = *next_p;
+            indel_len = strtol(next_p+1, &end_p, 10);
+            indel_seq = end_p;
+            next_p = end_p+indel_len;
+        }
+
+        AddRead(*read, i, sor, o, p_qual[i]-phred, indel, indel_seq, indel_len, rds);
+        cur_p = next_p;
+
+        if (*cur_p == '$') {
+            EndRead(*read, rds);
+            live.Drop();
+            ++cur_p;
+        } else {
+            live.Keep();
+        }
+	}
+
+    int nlive = live.End();
+    if ((Depth-eor) != nlive) {
+        warn("warning\tdepth is %d, but read list is: %d\n", Depth, nlive);
+    }
+
+	if (*cur_p == '-' || *cur_p == '+') {
+		char *end_p;
+		int len = strtol(++cur_p, &end_p, 10);
+		// keep this
+		string idl(end_p, len);
+		cur_p=end_p+len;
+	}
+
+	if (*cur_p) {
+		warn("Failed to parse pileup %s\n", _dat[4]);
+		exit(1);
+	}
+
+    End(rds);
+}
+
+// start a new column, reads are added in pileup order
+inline void PileupSummary::Begin(const char *chr, int pos, char base, int depth, PileupReads &rds, tidx *adex, char atype) {
+    vector<int> &depthbypos = rds.DepthByPos;
+    vector<q_calls> &depthbyposbycall = rds.DepthByPosByCall;
+
+	Chr=chr;
+	Pos=pos;
+	Base=base;
+	Depth=depth;
+
+    // the read length bin starts over on each reference, so a chunk at a reference start has it exactly
+    if (rds.BinChr != &(const string &) Chr) {
+        rds.BinChr = &(const string &) Chr;
+        rds.ReadBin.clear();
+        rds.TotReadLen = 0;
+    }
+
 	SkipDupReads = 0;
 	SkipN = 0;
 	SkipAmp = 0;
@@ -973,32 +1875,37 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
 
 	int i;
 
-	const char *cur_p = _dat[4];
-
-    list<Read>::iterator read_i = rds.ReadList.begin();
-    
     memset(depthbypos.data(),0,depthbypos.size()*sizeof(depthbypos[0]));
     memset(depthbyposbycall.data(),0,depthbyposbycall.size()*sizeof(depthbyposbycall[0]));
 
-    int eor=0;
-
-    // list of amplicon range objects
-    vector<ChrRange> amps;
-
-    if (pcr_annot && adex) {
-        string s = adex->lookup(Chr.data(), Pos + (atype=='b' ? -1 : 0), "^");
-        if (s.length()) {
-            vector<char *> a=split((char *)s.data(), '^');
-            Regions=a.size()-1;
-            // skip leading entry...
-            for(i=1;i<a.size();++i) {
-                vector<char *> f=split(a[i], '\t');
+    eor=0;
+    pia_len=0;
+
+    // amplicon ranges, the lookup returns the same position list for every column in an interval
+    use_amps = pcr_annot && adex;
+
+    if (use_amps) {
+        if (adex != rds.AmpCur.index()) {
+            rds.AmpCur = tidx_cursor(*adex);
+            rds.AmpKey = NULL;
+            rds.AmpRegions = 0;
+            rds.Amps.clear();
+        }
+        const tidx_ivl *key = rds.AmpCur.find(Chr.data(), Pos + (atype=='b' ? -1 : 0));
+        if (key != rds.AmpKey) {
+            rds.AmpKey = key;
+            rds.AmpRegions = 0;
+            rds.Amps.clear();
+            const vector<const tidx_line *> &a = rds.AmpCur.lines(Chr.data(), Pos + (atype=='b' ? -1 : 0));
+            rds.AmpRegions=a.size();
+            for(i=0;i<a.size();++i) {
+                const tidx_line &f=*a[i];
                 // create new range object
-                if (f.size() >= 3) {
+                if (f.fields() >= 3) {
                     ChrRange amp;
-                    amp.Chr=f[0];
-                    amp.Beg=atoi(f[1]);
-                    amp.End=atoi(f[2]);
+                    amp.Chr=f.field(0);
+                    amp.Beg=f.ifield(1);
+                    amp.End=f.ifield(2);
                     if (atype=='b') {
                         ++amp.Beg;
                     } 
@@ -1006,10 +1913,11 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
                         die("Annotation file must be in bed or gtf format, or at least a 1-based inclusive set of ranges\n"); 
                     }
 //                    warn("AMP: %s:%d-%d\n",amp.Chr.data(),amp.Beg,amp.End);
-                    amps.push_back(amp);
+                    rds.Amps.push_back(amp);
                 }
             }
         }
+        Regions=rds.AmpRegions;
     }
 
     if (debug_xpos) {
@@ -1018,42 +1926,44 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
         }
     }
 
-    int meanreadlen = rds.MeanReadLen();
-    int maxdepthbypos = meanreadlen <= 0 ? 10 : max(10, round(10.0 * artifact_filter * (Depth/(double)meanreadlen)));
+    meanreadlen = rds.MeanReadLen();
+    maxdepthbypos = meanreadlen <= 0 ? 10 : max(10, round(10.0 * artifact_filter * (Depth/(double)meanreadlen)));
 
+    // keep the indel seq lists' storage for later columns
+    for (i=0;i<Calls.size();++i) {
+        if (Calls[i].seqs.capacity()) {
+            Calls[i].seqs.clear();
+            rds.SeqPool.push_back(vector<string>());
+            rds.SeqPool.back().swap(Calls[i].seqs);
+        }
+    }
     Calls.clear();
+}
 
-    int j;
-    int pia_len=0;
-	for (i=0;i<Depth;++i,++read_i) {
-		bool sor=0;
-
-		if (*cur_p == '^') {
-			sor=1;
-			++cur_p;
-            Read x;
-            x.MapQ = *cur_p-phred;
-            x.Pos = Pos;
-            ++cur_p;
-            if (read_i != rds.ReadList.end()) {
-                ++read_i;
+// call slot j, growing the list (with reused seq storage) as needed
+inline vcall &PileupSummary::Call(int j, PileupReads &rds) {
+    if (j >= Calls.size()) {
+        int was = Calls.size();
+        Calls.resize(j+1);
+        int t; for (t=was;t<=j;++t) {
+            Calls[t].base=i2b(t);
+            if (rds.SeqPool.size()) {
+                Calls[t].seqs.swap(rds.SeqPool.back());
+                rds.SeqPool.pop_back();
             }
-            read_i=rds.ReadList.insert(read_i,x);
-            meanreadlen = rds.MeanReadLen();
-		}
-
-        if (read_i == rds.ReadList.end()) {
-            warn("warning\tread start without '^', partial pileup: '%s'\n", cur_p);
-            Read x;
-            x.MapQ = 0;
-            x.Pos = -1;
-            read_i=rds.ReadList.insert(read_i,x);
-            meanreadlen = rds.MeanReadLen();
         }
+    }
+    return Calls[j];
+}
 
+// one read's call at this column: o is the pileup call char (.,ACGTacgt*<>), q the base quality, indel is '+', '-' or 0
+inline void PileupSummary::AddRead(Read &read, int i, bool sor, char o, char q, char indel, const char *indel_seq, int indel_len, PileupReads &rds) {
+        vector<int> &depthbypos = rds.DepthByPos;
+        vector<q_calls> &depthbyposbycall = rds.DepthByPosByCall;
+        int j;
 
         // position of read relative to my position
-        int pia = read_i->Pos >= 0 ? Pos-read_i->Pos : 0;
+        int pia = read.Pos >= 0 ? Pos-read.Pos : 0;
 
         pia = pia % (meanreadlen*2);
 
@@ -1069,9 +1979,7 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
 		if (sor) 
 			++NumReads;
 
-		char q = p_qual[i]-phred;				// qual char
-		char mq = read_i->MapQ;
-		char o = *cur_p;				// orig call
+		char mq = read.MapQ;
 		char c = toupper(o);			// uppercase/ref 
 		bool is_ref = 0;
 
@@ -1087,17 +1995,18 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
 		}
 
 		bool skip = 0;
-        bool ampok = !pcr_annot || !adex;
+        bool ampok = !use_amps;
 
         if (!ampok) {
+            vector<ChrRange> &amps = rds.Amps;
             for (j=0;j<amps.size();++j) {
-                int apos = read_i->Pos + meanreadlen + 1;
-                int bpos = read_i->Pos + meanreadlen;
-                int cpos = read_i->Pos + meanreadlen - 1;
+                int apos = read.Pos + meanreadlen + 1;
+                int bpos = read.Pos + meanreadlen;
+                int cpos = read.Pos + meanreadlen - 1;
                 if (apos == amps[j].End || bpos == amps[j].End || cpos == amps[j].End) {
                     ampok=1;
                 }
-                if (read_i->Pos == amps[j].Beg) {
+                if (read.Pos == amps[j].Beg) {
                     ampok=1;
                     break;
                 }
@@ -1122,7 +2031,7 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
         depthbyposbycall[pia].call[call_index]++;
 
 		if (!ampok) {
-//            warn("SKIP: %d-%d, %c\n", read_i->Pos, (int)(read_i->Pos+rds.MeanReadLen()), o);
+//            warn("SKIP: %d-%d, %c\n", read.Pos, (int)(read.Pos+rds.MeanReadLen()), o);
             ++SkipAmp;
             skip=1;
 		} else if (c == 'N') {
@@ -1141,13 +2050,7 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
 		} else {
 			int j = call_index;
 
-			if (call_index >= Calls.size()) {
-				int was = Calls.size();
-				Calls.resize(j+1);
-				int t; for (t=was;t<=j;++t) {
-					Calls[t].base=i2b(t);
-				}
-			}
+			Call(j, rds);
 			if (is_ref) 
 				Calls[j].is_ref = 1;
 
@@ -1180,30 +2083,17 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
             }
 		}
 
-		if (c == '-' || c == '+') {
-            warn("invalid pileup, at '%s', indel not attached to read?\n", cur_p);
-		} else {
-		    if (c != '*' && c != 'N') 
-                read_i->Seq += c;
-			++cur_p;
-		}
+		if (c != '-' && c != '+' && c != '*' && c != 'N') 
+            read.Seq += c;
 
-        if (*cur_p == '+' || *cur_p == '-') {
-            c = *cur_p;
-            char *end_p;
-            int len = strtol(++cur_p, &end_p, 10);
-            string ins_seq(end_p, len);
+        if (indel) {
+            c = indel;
+            string ins_seq(indel_seq, indel_len);
             to_upper(ins_seq);
-            read_i->Seq += ins_seq;
+            read.Seq += ins_seq;
             if (!skip) {
                 int j = b2i(c);
-                if (j >= Calls.size()) {
-                    int was = Calls.size();
-                    Calls.resize(j+1);
-                    int t; for (t=was;t<=j;++t) {
-                        Calls[t].base=i2b(t);
-                    }
-                }
+                Call(j, rds);
                 if ( o == ',' || o == 'a' || o == 'c' || o == 't' || o == 'g' ) {
                     ++Calls[j].rev;
                     Calls[j].rev_q+=q;
@@ -1218,43 +2108,29 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
                 Calls[j].mq_sum+=mq;
                 Calls[j].seqs.push_back(ins_seq);
             }
-            cur_p=end_p+len;
         }
+}
 
-        if (*cur_p == '$') {
-            if (read_i->MapQ > -1) {
-                rds.TotReadLen+=read_i->Seq.size();
-                rds.ReadBin.push_back(*read_i);
-                if (rds.ReadBin.size() > min(1000,Depth*2)) {
-                    rds.TotReadLen-=rds.ReadBin.front().Seq.size();
-                    rds.ReadBin.pop_front();
-                }
-            }
-//            printf("%d\t%s\n", read_i->MapQ, read_i->Seq.c_str());
-            read_i=rds.ReadList.erase(read_i);
-            meanreadlen = rds.MeanReadLen();
-            --read_i;
-            ++cur_p;
-            ++eor;
+// read ended at this column, its sequence goes into the read length bin
+inline void PileupSummary::EndRead(Read &read, PileupReads &rds) {
+    if (read.MapQ > -1) {
+        rds.TotReadLen+=read.Seq.size();
+        rds.ReadBin.push_back(read.Seq.size());
+        if (rds.ReadBin.size() > min(1000,Depth*2)) {
+            rds.TotReadLen-=rds.ReadBin.front();
+            rds.ReadBin.pop_front();
         }
-	}
-
-    if ((Depth-eor) != rds.ReadList.size()) {
-        warn("warning\tdepth is %d, but read list is: %d\n", Depth, (int) rds.ReadList.size());
     }
+//    printf("%d\t%s\n", read.MapQ, read.Seq.c_str());
+    meanreadlen = rds.MeanReadLen();
+    ++eor;
+}
 
-	if (*cur_p == '-' || *cur_p == '+') {
-		char *end_p;
-		int len = strtol(++cur_p, &end_p, 10);
-		// keep this
-		string idl(end_p, len);
-		cur_p=end_p+len;
-	}
-
-	if (*cur_p) {
-		warn("Failed to parse pileup %s\n", _dat[4]);
-		exit(1);
-	}
+// all reads are in, total up depth, diversity and agreement
+inline void PileupSummary::End(PileupReads &rds) {
+    vector<int> &depthbypos = rds.DepthByPos;
+    vector<q_calls> &depthbyposbycall = rds.DepthByPosByCall;
+    int i, j;
 
 	Depth=0;
 	for (i=0;i<5 && i < Calls.size();++i) {		// total depth (exclude inserts for tot depth, otherwise they are double-counted)
@@ -1364,10 +2240,8 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
 	}
 }
 
-PileupSummary JunkSummary;
-
 inline void PileupManager::Parse(char *dat) {
-    Pileup.Parse(dat, Reads, UseAnnot ? &AnnotDex : NULL, AnnotType);
+    Pileup.Parse(dat, Reads, UseAnnot ? Annot : NULL, AnnotType);
     Visit(Pileup);
 }
 
@@ -1379,78 +2253,59 @@ void PileupManager::Visit(PileupSummary &p) {
         return;
     }
 
-    if (p.Base != '-' && p.Base != '@') {
-        if (Win.size() && (Win.back().Pos != (p.Pos - 1) )) {
-            if (Win.back().Pos < p.Pos && ((p.Pos - Win.back().Pos) <= (WinMax/2))) {
-                while (Win.back().Pos < (p.Pos - 1)) {
-                    // visit/pop, add a placeholder
-                    JunkSummary.Base = '-';
-                    JunkSummary.Pos = Win.back().Pos + 1;
-                    Visit(JunkSummary);
-                }
-            } else {
-                while (Win.size() && Win[WinMax/2].Base != '@') {
-                    // visit/pop, but don't add anything, until it's empty
-                    JunkSummary.Base = '@';
-                    JunkSummary.Pos = 0;
-                    Visit(JunkSummary);
-                }
+    if (Win.capacity() != WinMax) 
+        Win.Init(WinMax);
+
+    if (Win.size() && (Win.back().Pos != (p.Pos - 1) )) {
+        if (Win.back().Pos < p.Pos && ((p.Pos - Win.back().Pos) <= (WinMax/2))) {
+            while (Win.back().Pos < (p.Pos - 1)) {
+                // visit/pop, add a placeholder
+                Shift('-', Win.back().Pos + 1);
             }
+        } else {
+            // visit/pop, but don't add anything, until it's empty ... at most one window of shifts, however big the gap
+            while (Win[WinMax/2].Base != '@') 
+                Shift('@', 0);
         }
     }
 
     // initialize the window with nothing, if it's not full
     while (Win.size() < WinMax) {
-        JunkSummary.Base = '@';
-        JunkSummary.Pos = 0;
-        Win.push_back(JunkSummary);
+        Junk.Base = '@';
+        Junk.Pos = 0;
+        Win.Push(Junk, false);
     }
 
-    Win.push_back(p);
+    // the caller's column is swapped into the window, it gets an old slot back to refill
+    Win.Push(p, true);
 
     //debug("Visit: %d\n", p.Pos);
 
-    if (Win.size() > WinMax)        // queue too big?  pop
-        Win.pop_front();
-    
-    int i;
-    int lrc=0,rrc=0;                // left repeat count, right repeat count
-    char lrb, rrb;                  // left repeat base...
-    int vx;
+    Center();
+}
 
-    if (Win.size() < WinMax) {    // small window?  look at leading edge only
-        return;
-    } else {
-        vx = WinMax/2;              // larger window? look at midpoint
-    }
+// add a placeholder column
+void PileupManager::Shift(char base, int pos) {
+    Junk.Base = base;
+    Junk.Pos = pos;
+    Win.Push(Junk, false);
+    Center();
+}
+
+// visit the column in the middle of the window
+void PileupManager::Center() {
+    int i;
+    int vx = WinMax/2;
 
     if (Win[vx].Base == '-' || Win[vx].Base == '@') 
         return;
 
-    if (vx > 1) {                   // look left
-        lrb = Win[vx-1].Base;
-        for (i=vx-2; i >= 0; --i) { // increment repeat count
-            if (Win[i].Base == lrb) 
-                ++lrc;
-            else 
-                break;
-        }
-    }
-    if (vx < (Win.size()-2)) {
-        rrb = Win[vx+1].Base;
-        for (i=vx+2; i < Win.size(); ++i) {
-            if (Win[i].Base == rrb)
-                ++rrc;
-            else
-                break;
-        }
-    }
+    // maximum repeat count and associated base, either side
+    char lrb = Win[vx-1].Base;
+    char rrb = Win[vx+1].Base;
+    int lrc = Win.LeftRun(vx-1);
+    int rrc = Win.RightRun(vx+1);
 
-    // repeat counts are now 1-based, not 0-based
-    ++lrc;
-    ++rrc;
-
-    // maximum repeat count and associated base
     if (lrb == rrb ) {
         Win[vx].RepeatCount = lrc+rrc;
         Win[vx].RepeatBase = lrb;
@@ -1517,14 +2372,24 @@ void PileupManager::Finish() {
     }
 }
 
+// push what's left in the window through, same as when a gap is hit
+void PileupManager::Flush() {
+    while (WinMax >= 3 && Win.size() >= WinMax && Win[WinMax/2].Base != '@') 
+        Shift('@', 0);
+}
+
 void PileupManager::VisitX(PileupSummary &p, int windex) {
 
     WinDex=windex;
 
+    if (VisitEnd && (p.Pos < VisitBeg || p.Pos > VisitEnd)) 
+        return;
+
     if (UseAnnot) {
         // index lookup only.... not string lookup
-        const std::vector <long int> * v = &(AnnotDex.lookup(p.Chr.data(), p.Pos + (AnnotType=='b' ? -1 : 0)));
-        if (v && v->size()) {
+        if (AnnotCur.index() != Annot) 
+            AnnotCur = tidx_cursor(*Annot);
+        if (AnnotCur.lookup(p.Chr.data(), p.Pos + (AnnotType=='b' ? -1 : 0)).size()) {
             p.InTarget=1;
         }
     }
@@ -1582,7 +2447,7 @@ void VarCallVisitor::Visit(PileupSummary &p) {
 	if (p.Calls.size() > 6) 
 		p.Calls.resize(7);	// toss N's before sort
 
-    static char regions[64] = "";
+    char regions[64] = "";
     if (pcr_annot) {
         sprintf(regions, "\t%d", p.Regions); 
     } 
@@ -1592,12 +2457,12 @@ void VarCallVisitor::Visit(PileupSummary &p) {
         if (p.Calls.size() < 4) 
             p.Calls.resize(4);	// cse needs 4 calls
 
-        Manager->FillReference(21);
+        Manager->FillReference(p, 21);
     
         // cse format... no need to sort or call anything
         if (p.Calls[T_A].depth()||p.Calls[T_C].depth()|| p.Calls[T_G].depth()|| p.Calls[T_T].depth()) {
             // silly 15 decimals to match R's default output ... better off with the C default
-            static char cse_buf[8192]; 
+            char cse_buf[8192]; 
             #define MEANQ(base,dir) (p.Calls[base].dir?(p.Calls[base].dir##_q/(double)p.Calls[base].dir):0)
            sprintf(cse_buf,"%s\t%d\t%c\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%g\t%g\t%g\t%g\t%g\t%g\t%g\t%g\t%s\t%g\t%g\t%g\t%g\t%g\t%g\t%g\t%g%s\n",p.Chr.c_str(), p.Pos, toupper(p.Base)
                     , p.Calls[T_A].fwd, p.Calls[T_C].fwd, p.Calls[T_G].fwd, p.Calls[T_T].fwd
@@ -1858,103 +2723,42 @@ void VarCallVisitor::Visit(PileupSummary &p) {
             }
         }
 
-        /// INTERNAL VAR FILE
-        if (var_f) {
-            int i;
-            string pil;
-            for (i=0;i<final_calls.size();++i) {
-               vfinal &f=final_calls[i];
-               if (f.is_indel()) {
-                    pil += string_format("\t%c%s:%d,%d,%.1e,%.2g,%.2g",f.pcall->base,f.max_idl_seq.c_str(),f.max_idl_cnt,f.pcall->qual/f.pcall->depth(),f.padj, f.pcall->diversity, f.pcall->agreement);
-               } else {
-                    pil += string_format("\t%c:%d,%d,%.1e,%.2g,%.2g",f.pcall->base,f.pcall->depth(),f.pcall->qual/f.pcall->depth(),f.padj, f.pcall->diversity, f.pcall->agreement);
-               }
-            }
-            fprintf(var_f,"%s\t%d\t%c\t%d\t%d\t%2.2f%s%s\n",p.Chr.c_str(), p.Pos, p.Base, p.Depth, skipped_diversity+skipped_agreement+skipped_alpha+skipped_depth+skipped_balance+p.SkipAmp+p.SkipN+p.SkipDupReads+p.SkipMinMapq+p.SkipMinQual, pct_allele, Manager->UseAnnot==1?(p.InTarget ? "\t1" : "\t0"):"", pil.c_str());
-
-            if (tgt_var_f) {
-                if (p.InTarget) {
-                    fprintf(tgt_var_f,"%s\t%d\t%c\t%d\t%d\t%2.2f%s\n",p.Chr.c_str(), p.Pos, p.Base, p.Depth, skipped_diversity+skipped_agreement+skipped_alpha+skipped_depth+skipped_balance+p.SkipAmp+p.SkipN+p.SkipDupReads+p.SkipMinMapq+p.SkipMinQual, pct_allele, pil.c_str());
-                }
-            }
-        }
-
-       if (vcf_f) {
-            for (i=0;i<final_calls.size();++i) {
-               vfinal &f=final_calls[i];
-               int qual = f.padj>0?min(40,10*(-log10(f.padj))):40;
-
-               if (f.is_indel()) {
-                    string base;
-                    string alt;
-                    if (f.pcall->base =='-') {
-                        base = p.Base + f.max_idl_seq;
-                        alt = p.Base;
-                    } else {
-                        base = p.Base;
-                        alt = p.Base + f.max_idl_seq;
-                    }
-                    double freq_allele = f.max_idl_cnt / (double) p.Depth;
-                    fprintf(vcf_f,"%s\t%d\t.\t%s\t%s\t%2d\tPASS\tMQ=%d;BQ=%d;DP=%d;AF=%2.2f\n", 
-                        p.Chr.c_str(), p.Pos, base.c_str(), alt.c_str(), qual, 
-                        (int) f.pcall->mq_rms(),
-                        (int) f.pcall->qual_rms(),
-                        total_call_depth,
-                        freq_allele);
-                } else {
-                    char alt = f.pcall->base;
-                    if (f.pcall->is_ref) 
-                        alt = '.';
-                    double freq_allele = f.pcall->depth() / (double) p.Depth;
-                    fprintf(vcf_f,"%s\t%d\t.\t%c\t%c\t%d\tPASS\tMQ=%d;BQ=%d;DP=%d;AF=%2.2f\n",
-                        p.Chr.c_str(), p.Pos, p.Base, alt, qual,
-                        (int) f.pcall->mq_rms(),
-                        (int) f.pcall->qual_rms(),
-                        total_call_depth,
-                        freq_allele);
-                }
-           }
-        }
-
-        if (eav_f) {
-//            printf(eav_f,"chr\tpos\tref\tdepth\tnum_states\ttop_consensus\ttop_freq\tvar_base\tvar_depth\tvar_qual\tvar_strands\tforward_strands\treverse_strands\n");
-            string top_cons, var_base, var_depth, var_qual, var_strands, forward, reverse, diversity, agreement;
-           
-            float padj=final_calls[0].padj;
-            if (final_calls[0].pcall->is_ref && final_calls.size() > 1) {
-                padj=final_calls[1].padj;
-            }
-            for (i=0;i<final_calls.size();++i) {
-                vfinal &f=final_calls[i];
-                if (i < 2) {
-                    if (i > 0) top_cons += "/";
-                    top_cons += f.pcall->base;
-                }
-                if (i > 0) var_base += "/";
-                var_base += f.pcall->base;
-                if (f.is_indel()) {
-                    if (i < 2) {
-                        top_cons += f.max_idl_seq;
-                    }
-                    var_base += f.max_idl_seq;
-                }
-                if (i > 0) var_depth+= ";";
-                var_depth+= string_format("%d",f.pcall->depth());
-                if (i > 0) var_qual+= ";";
-                var_qual+= string_format("%d",f.pcall->qual_rms());
-                if (i > 0) var_strands+= ";";
-                var_strands+= string_format("%d",(f.pcall->fwd>0)+(f.pcall->rev>0));
-                if (i > 0) forward += ";";
-                forward+= string_format("%d",f.pcall->fwd);
-                if (i > 0) reverse += ";";
-                reverse+= string_format("%d",f.pcall->rev);
-                if (i > 0) agreement += ";";
-                agreement+= string_format("%g",f.pcall->agreement);
-                if (i > 0) diversity += ";";
-                diversity+= string_format("%g",f.pcall->diversity);
-            }
-            fprintf(eav_f,"%s\t%d\t%c\t%d\t%d\t%s\t%2.2f\t%s\t%s\t%s\t%s\t%s\t%s\t%.1e\t%s\t%s%s\n",p.Chr.c_str(), p.Pos, p.Base, p.Depth, (int) final_calls.size(),top_cons.c_str(), pct_allele, var_base.c_str(), var_depth.c_str(), var_qual.c_str(), var_strands.c_str(), forward.c_str(), reverse.c_str(), padj, diversity.c_str(), agreement.c_str(), Manager->UseAnnot==1?(p.InTarget?"\t1":"\t0"):regions);
-        }
+        // one record for all the outputs
+        Loc.chr = p.Chr.c_str();
+        Loc.pos = p.Pos;
+        Loc.base = p.Base;
+        Loc.depth = p.Depth;
+        Loc.skip = skipped_diversity+skipped_agreement+skipped_alpha+skipped_depth+skipped_balance+p.SkipAmp+p.SkipN+p.SkipDupReads+p.SkipMinMapq+p.SkipMinQual;
+        Loc.pct = pct_allele;
+        Loc.in_target = p.InTarget;
+        Loc.regions = p.Regions;
+        Loc.calls.resize(final_calls.size());
+        for (i=0;i<final_calls.size();++i) {
+            vfinal &f=final_calls[i];
+            VarAllele &a=Loc.calls[i];
+            a.base = f.pcall->base;
+            a.is_ref = f.pcall->is_ref;
+            a.fwd = f.pcall->fwd;
+            a.rev = f.pcall->rev;
+            a.qual = f.pcall->qual;
+            a.mq_rms = f.pcall->mq_rms();
+            a.qual_rms = f.pcall->qual_rms();
+            a.padj = f.padj;
+            a.diversity = f.pcall->diversity;
+            a.agreement = f.pcall->agreement;
+            a.idl_cnt = f.max_idl_cnt;
+            a.idl_seq = f.max_idl_seq.data();
+            a.idl_len = f.max_idl_seq.size();
+        }
+
+        if (var_f) 
+            write_var(var_f, tgt_var_f, Loc, Manager->UseAnnot==1);
+        if (vcf_f) 
+            write_vcf(vcf_f, Loc);
+        if (eav_f) 
+            write_eav(eav_f, Loc, Manager->UseAnnot==1, pcr_annot);
+        if (vcb_f) 
+            Vcb.add(Loc, vcb_f);
 
 		if (debug_xpos) {
 		    fprintf(stderr,"xpos-skip-dup\t%d\n",p.SkipDupReads);
@@ -1977,7 +2781,378 @@ void VarCallVisitor::Visit(PileupSummary &p) {
 	}
 }
 
-void PileupManager::FillReference(int refSize) {
+int VarLocus::call_depth() const {
+    int i, d=0;
+    for (i=0;i<calls.size();++i) 
+        d+=calls[i].depth();
+    return d;
+}
+
+void write_var(FILE *var, FILE *tgt, const VarLocus &l, bool annot) {
+    int i;
+    string pil;
+    for (i=0;i<l.calls.size();++i) {
+       const VarAllele &f=l.calls[i];
+       if (f.is_indel()) {
+            pil += string_format("\t%c%.*s:%d,%d,%.1e,%.2g,%.2g",f.base,f.idl_len,f.idl_seq,f.idl_cnt,f.qual/f.depth(),f.padj, f.diversity, f.agreement);
+       } else {
+            pil += string_format("\t%c:%d,%d,%.1e,%.2g,%.2g",f.base,f.depth(),f.qual/f.depth(),f.padj, f.diversity, f.agreement);
+       }
+    }
+    fprintf(var,"%s\t%d\t%c\t%d\t%d\t%2.2f%s%s\n",l.chr, l.pos, l.base, l.depth, l.skip, l.pct, annot?(l.in_target ? "\t1" : "\t0"):"", pil.c_str());
+
+    if (tgt && l.in_target) {
+        fprintf(tgt,"%s\t%d\t%c\t%d\t%d\t%2.2f%s\n",l.chr, l.pos, l.base, l.depth, l.skip, l.pct, pil.c_str());
+    }
+}
+
+void write_vcf(FILE *f, const VarLocus &l) {
+    int i;
+    int total_call_depth=l.call_depth();
+    for (i=0;i<l.calls.size();++i) {
+       const VarAllele &a=l.calls[i];
+       int qual = a.padj>0?min(40,10*(-log10(a.padj))):40;
+
+       if (a.is_indel()) {
+            string base(1, l.base);
+            string alt(1, l.base);
+            if (a.base =='-') {
+                base.append(a.idl_seq, a.idl_len);
+            } else {
+                alt.append(a.idl_seq, a.idl_len);
+            }
+            double freq_allele = a.idl_cnt / (double) l.depth;
+            fprintf(f,"%s\t%d\t.\t%s\t%s\t%2d\tPASS\tMQ=%d;BQ=%d;DP=%d;AF=%2.2f\n", 
+                l.chr, l.pos, base.c_str(), alt.c_str(), qual, 
+                a.mq_rms,
+                a.qual_rms,
+                total_call_depth,
+                freq_allele);
+        } else {
+            char alt = a.base;
+            if (a.is_ref) 
+                alt = '.';
+            double freq_allele = a.depth() / (double) l.depth;
+            fprintf(f,"%s\t%d\t.\t%c\t%c\t%d\tPASS\tMQ=%d;BQ=%d;DP=%d;AF=%2.2f\n",
+                l.chr, l.pos, l.base, alt, qual,
+                a.mq_rms,
+                a.qual_rms,
+                total_call_depth,
+                freq_allele);
+        }
+   }
+}
+
+void write_eav(FILE *f, const VarLocus &l, bool annot, bool pcr) {
+    string top_cons, var_base, var_depth, var_qual, var_strands, forward, reverse, diversity, agreement;
+    int i;
+
+    float padj=l.calls.size() ? l.calls[0].padj : 1;
+    if (l.calls.size() > 1 && l.calls[0].is_ref) {
+        padj=l.calls[1].padj;
+    }
+    for (i=0;i<l.calls.size();++i) {
+        const VarAllele &a=l.calls[i];
+        if (i < 2) {
+            if (i > 0) top_cons += "/";
+            top_cons += a.base;
+        }
+        if (i > 0) var_base += "/";
+        var_base += a.base;
+        if (a.is_indel()) {
+            if (i < 2) {
+                top_cons.append(a.idl_seq, a.idl_len);
+            }
+            var_base.append(a.idl_seq, a.idl_len);
+        }
+        if (i > 0) var_depth+= ";";
+        var_depth+= string_format("%d",a.depth());
+        if (i > 0) var_qual+= ";";
+        var_qual+= string_format("%d",a.qual_rms);
+        if (i > 0) var_strands+= ";";
+        var_strands+= string_format("%d",(a.fwd>0)+(a.rev>0));
+        if (i > 0) forward += ";";
+        forward+= string_format("%d",a.fwd);
+        if (i > 0) reverse += ";";
+        reverse+= string_format("%d",a.rev);
+        if (i > 0) agreement += ";";
+        agreement+= string_format("%g",a.agreement);
+        if (i > 0) diversity += ";";
+        diversity+= string_format("%g",a.diversity);
+    }
+    string extra;
+    if (annot) 
+        extra = l.in_target ? "\t1" : "\t0";
+    else if (pcr) 
+        extra = string_format("\t%d", l.regions);
+    fprintf(f,"%s\t%d\t%c\t%d\t%d\t%s\t%2.2f\t%s\t%s\t%s\t%s\t%s\t%s\t%.1e\t%s\t%s%s\n",l.chr, l.pos, l.base, l.depth, (int) l.calls.size(),top_cons.c_str(), l.pct, var_base.c_str(), var_depth.c_str(), var_qual.c_str(), var_strands.c_str(), forward.c_str(), reverse.c_str(), padj, diversity.c_str(), agreement.c_str(), extra.c_str());
+}
+
+// header lines for the text outputs that have them, any of the files can be NULL
+void write_headers(FILE *var, FILE *tgt, FILE *vcf, FILE *eav, int flags, int locii) {
+    bool target = flags & VCB_TARGET;
+    bool pcr = flags & VCB_PCR;
+    if (var) 
+        fprintf(var,"%s\t%s\t%s\t%s\t%s\t%s\t%s%s\n","chr", "pos", "ref", "depth", "skip", "pct", target ? "target\t" : pcr ? "regions\t" : "", "...");
+    if (tgt) 
+        fprintf(tgt,"%s\t%s\t%s\t%s\t%s\t%s\t%s\n","chr", "pos", "ref", "depth", "skip", "pct", "...");
+    if (eav) 
+        fprintf(eav,"chr\tpos\tref\tdepth\tnum_states\ttop_consensus\ttop_freq\tvar_base\tvar_depth\tvar_qual\tvar_strands\tforward_strands\treverse_strands\t%cval\tdiversity\tagreement\t%s\n", (locii>1?'e':'p'), target ? "in_target\t" : pcr ? "regions\t" : "");
+    if (vcf) 
+        fprintf(vcf, "%s\n", "##fileformat=VCFv4.1");
+}
+
+void VcbBlock::clear() {
+    chrs.clear();
+    chr.clear(); pos.clear(); depth.clear(); skip.clear(); regions.clear();
+    pct.clear(); ref.clear(); in_target.clear(); ncall.clear();
+    fwd.clear(); rev.clear(); qual.clear(); mq_rms.clear(); qual_rms.clear(); idl_cnt.clear(); idl_len.clear(); idl_off.clear();
+    padj.clear(); diversity.clear(); agreement.clear(); base.clear(); is_ref.clear();
+    first.clear();
+    heap.clear();
+}
+
+void VcbBlock::add(const VarLocus &l, FILE *f) {
+    if (f != out) {
+        flush();
+        out = f;
+    }
+    if (!chrs.size() || strcmp(chrs.back().c_str(), l.chr)) 
+        chrs.push_back(l.chr);
+    chr.push_back(chrs.size()-1);
+    pos.push_back(l.pos);
+    depth.push_back(l.depth);
+    skip.push_back(l.skip);
+    regions.push_back(l.regions);
+    pct.push_back(l.pct);
+    ref.push_back(l.base);
+    in_target.push_back(l.in_target);
+    ncall.push_back(l.calls.size());
+
+    int i;
+    for (i=0;i<l.calls.size();++i) {
+        const VarAllele &a=l.calls[i];
+        fwd.push_back(a.fwd);
+        rev.push_back(a.rev);
+        qual.push_back(a.qual);
+        mq_rms.push_back(a.mq_rms);
+        qual_rms.push_back(a.qual_rms);
+        idl_cnt.push_back(a.idl_cnt);
+        idl_len.push_back(a.idl_len);
+        padj.push_back(a.padj);
+        diversity.push_back(a.diversity);
+        agreement.push_back(a.agreement);
+        base.push_back(a.base);
+        is_ref.push_back(a.is_ref);
+        heap.append(a.idl_seq, a.idl_len);
+    }
+
+    if (pos.size() >= VCB_BLOCK) 
+        flush();
+}
+
+template <class T> static void vcb_put(const vector<T> &v, FILE *f) {
+    if (v.size()) 
+        fwrite(v.data(), sizeof(T), v.size(), f);
+}
+
+template <class T> static bool vcb_get(vector<T> &v, int n, FILE *f) {
+    v.resize(n);
+    return !n || fread(v.data(), sizeof(T), n, f) == (size_t) n;
+}
+
+void VcbBlock::flush() {
+    if (!pos.size() || !out) {
+        clear();
+        return;
+    }
+    string names;
+    int i;
+    for (i=0;i<chrs.size();++i) 
+        names.append(chrs[i].c_str(), chrs[i].size()+1);
+
+    int32_t hdr[4] = {(int32_t) pos.size(), (int32_t) fwd.size(), (int32_t) chrs.size(), (int32_t) (names.size()+heap.size())};
+    fwrite("BLK\0", 1, 4, out);
+    fwrite(hdr, sizeof(hdr), 1, out);
+    vcb_put(chr, out); vcb_put(pos, out); vcb_put(depth, out); vcb_put(skip, out); vcb_put(regions, out);
+    vcb_put(pct, out); vcb_put(ref, out); vcb_put(in_target, out); vcb_put(ncall, out);
+    vcb_put(fwd, out); vcb_put(rev, out); vcb_put(qual, out); vcb_put(mq_rms, out); vcb_put(qual_rms, out); vcb_put(idl_cnt, out); vcb_put(idl_len, out);
+    vcb_put(padj, out); vcb_put(diversity, out); vcb_put(agreement, out); vcb_put(base, out); vcb_put(is_ref, out);
+    fwrite(names.data(), 1, names.size(), out);
+    fwrite(heap.data(), 1, heap.size(), out);
+    clear();
+}
+
+void VcbBlock::write_header(FILE *f, int flags, int locii) {
+    int32_t hdr[2] = {flags, locii};
+    fwrite("VCB\1", 1, 4, f);
+    fwrite(hdr, sizeof(hdr), 1, f);
+}
+
+bool VcbBlock::read_header(FILE *f, int *flags, int *locii) {
+    char magic[4];
+    int32_t hdr[2];
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, "VCB\1", 4) || fread(hdr, sizeof(hdr), 1, f) != 1) 
+        return false;
+    *flags = hdr[0];
+    *locii = hdr[1];
+    return true;
+}
+
+// bytes from here to the end of f, -1 if it isn't a regular file
+static long long vcb_left(FILE *f) {
+    struct stat st;
+    off_t at = ftello(f);
+    if (at < 0 || fstat(fileno(f), &st) || !S_ISREG(st.st_mode)) 
+        return -1;
+    return st.st_size - at;
+}
+
+bool VcbBlock::read(FILE *f) {
+    clear();
+    char magic[4];
+    int32_t hdr[4];
+    size_t n = fread(magic, 1, 4, f);
+    if (!n) 
+        return false;
+    if (n != 4 || memcmp(magic, "BLK\0", 4) || fread(hdr, sizeof(hdr), 1, f) != 1) 
+        die("Invalid or truncated vcb block\n");
+
+    // counts as add() writes them: up to VCB_BLOCK loci (a flush comes at VCB_BLOCK), up to 255 alleles
+    // each, no more names than loci.  the columns and heap have to fit in what's left of the file
+    int nl = hdr[0], na = hdr[1], nc = hdr[2], nh = hdr[3];
+    if (nl < 0 || nl > VCB_BLOCK || na < 0 || na > nl*255 || nc < 0 || nc > nl || nh < 0) 
+        die("Invalid vcb block header\n");
+    long long need = nl * (5*sizeof(int32_t) + sizeof(double) + 3) + na * (7*sizeof(int32_t) + 3*sizeof(double) + 2) + (long long) nh;
+    long long left = vcb_left(f);
+    if (left >= 0 && need > left) 
+        die("Invalid or truncated vcb block\n");
+
+    bool ok = vcb_get(chr, nl, f) && vcb_get(pos, nl, f) && vcb_get(depth, nl, f) && vcb_get(skip, nl, f) && vcb_get(regions, nl, f)
+        && vcb_get(pct, nl, f) && vcb_get(ref, nl, f) && vcb_get(in_target, nl, f) && vcb_get(ncall, nl, f)
+        && vcb_get(fwd, na, f) && vcb_get(rev, na, f) && vcb_get(qual, na, f) && vcb_get(mq_rms, na, f) && vcb_get(qual_rms, na, f) && vcb_get(idl_cnt, na, f) && vcb_get(idl_len, na, f)
+        && vcb_get(padj, na, f) && vcb_get(diversity, na, f) && vcb_get(agreement, na, f) && vcb_get(base, na, f) && vcb_get(is_ref, na, f);
+    if (!ok) 
+        die("Invalid or truncated vcb block\n");
+
+    // a pipe's length isn't known, so the heap grows as it's read rather than trusting nh up front
+    char buf[0x10000];
+    while (heap.size() < (size_t) nh) {
+        size_t want = min(sizeof(buf), (size_t) nh - heap.size());
+        if (fread(buf, 1, want, f) != want) 
+            die("Invalid or truncated vcb block\n");
+        heap.append(buf, want);
+    }
+
+    // names, each nul terminated inside the heap, then indel sequences
+    int i, off=0;
+    for (i=0;i<nc;++i) {
+        const char *z = (const char *) memchr(heap.data()+off, '\0', nh-off);
+        if (!z) 
+            die("Invalid vcb block: chromosome name runs off the heap\n");
+        chrs.push_back(string(heap.data()+off, z-(heap.data()+off)));
+        off = z-heap.data()+1;
+    }
+    for (i=0;i<na;++i) {
+        if (idl_len[i] < 0 || idl_len[i] > nh-off) 
+            die("Invalid vcb block: indel length runs off the heap\n");
+        idl_off.push_back(off);
+        off+=idl_len[i];
+    }
+    for (i=0,off=0;i<nl;++i) {
+        first.push_back(off);
+        off+=ncall[i];
+    }
+    if (off != na) 
+        die("Invalid vcb block: allele counts don't add up\n");
+    for (i=0;i<nl;++i) 
+        if (chr[i] < 0 || chr[i] >= nc) 
+            die("Invalid vcb block: bad chromosome index\n");
+    return true;
+}
+
+void VcbBlock::get(int i, VarLocus &l) {
+    l.chr = chrs[chr[i]].c_str();
+    l.pos = pos[i];
+    l.base = ref[i];
+    l.depth = depth[i];
+    l.skip = skip[i];
+    l.pct = pct[i];
+    l.in_target = in_target[i];
+    l.regions = regions[i];
+    l.calls.resize(ncall[i]);
+    int j;
+    for (j=0;j<ncall[i];++j) {
+        int r = first[i]+j;
+        VarAllele &a=l.calls[j];
+        a.base = base[r];
+        a.is_ref = is_ref[r];
+        a.fwd = fwd[r];
+        a.rev = rev[r];
+        a.qual = qual[r];
+        a.mq_rms = mq_rms[r];
+        a.qual_rms = qual_rms[r];
+        a.padj = padj[r];
+        a.diversity = diversity[r];
+        a.agreement = agreement[r];
+        a.idl_cnt = idl_cnt[r];
+        a.idl_len = idl_len[r];
+        a.idl_seq = heap.data()+idl_off[r];
+    }
+}
+
+// rewrite a .vcb as the text outputs, the same files a -o run with those formats would have made
+int vcb_convert(const char *path, const char *out_prefix, const char **format_list) {
+    FILE *in = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    if (!in) 
+        die("Can't open %s: %s\n", path, strerror(errno));
+
+    int flags, locii;
+    if (!VcbBlock::read_header(in, &flags, &locii)) 
+        die("%s: not a vcb file\n", path);
+
+    FILE *var=NULL, *tgt=NULL, *vcf=NULL, *eav=NULL;
+    if (out_prefix) {
+        if (str_in("var", format_list)>=0) {
+            var = openordie(string_format("%s.var.tmp", out_prefix).c_str(), "w");
+            if (flags & VCB_TARGET) 
+                tgt = openordie(string_format("%s.tgt.var.tmp", out_prefix).c_str(), "w");
+        }
+        if (str_in("vcf", format_list)>=0) 
+            vcf = openordie(string_format("%s.vcf.tmp", out_prefix).c_str(), "w");
+        if (str_in("eav", format_list)>=0) 
+            eav = openordie(string_format("%s.eav.tmp", out_prefix).c_str(), "w");
+        write_headers(var, tgt, vcf, eav, flags, locii);
+    } else {
+        var = stdout;
+    }
+
+    VcbBlock blk;
+    VarLocus l;
+    int i, n=0;
+    while (blk.read(in)) {
+        for (i=0;i<blk.size();++i) {
+            blk.get(i, l);
+            if (var) write_var(var, tgt, l, flags & VCB_ANNOT);
+            if (vcf) write_vcf(vcf, l);
+            if (eav) write_eav(eav, l, flags & VCB_ANNOT, flags & VCB_PCR);
+        }
+        n+=blk.size();
+    }
+    if (in != stdin) 
+        fclose(in);
+
+    if (out_prefix) {
+        if (var) {fclose(var); rename_tmp(string_format("%s.var.tmp", out_prefix));}
+        if (tgt) {fclose(tgt); rename_tmp(string_format("%s.tgt.var.tmp", out_prefix));}
+        if (vcf) {fclose(vcf); rename_tmp(string_format("%s.vcf.tmp", out_prefix));}
+        if (eav) {fclose(eav); rename_tmp(string_format("%s.eav.tmp", out_prefix));}
+    }
+    fprintf(stderr, "locii\t%d\n", n);
+    return 0;
+}
+
+void PileupManager::FillReference(PileupSummary &p, int refSize) {
     int flank=(refSize-1)/2;
     Reference.resize(refSize);
 
@@ -1994,10 +3169,10 @@ void PileupManager::FillReference(int refSize) {
             }
         }
         if (needfai) {
-            faidx.Fetch((char *)Reference.data(), Pileup.Chr, Pileup.Pos-flank-1, Pileup.Pos+flank-1);
+            faidx.fetch((char *)Reference.data(), p.Chr.c_str(), p.Pos-flank-1, p.Pos+flank-1, &RefHint);
         }
     } else {
-        faidx.Fetch((char *)Reference.data(), Pileup.Chr, Pileup.Pos-flank-1, Pileup.Pos+flank-1);
+        faidx.fetch((char *)Reference.data(), p.Chr.c_str(), p.Pos-flank-1, p.Pos+flank-1, &RefHint);
     }
 }
 
@@ -2042,12 +3217,24 @@ void PileupManager::LoadAnnot(const char *path) {
         //    void build(const char *path, const char *sep, int nchr, int nbeg, int nend, int skip_i, char skip_c, int sub_e);
             AnnotDex.build(path, "\t", 0, 1, 2, 0, '#', AnnotType=='b' ? 1 : 0);
         }
-        die("Either %s.tidx must be a valid tidx indexed file, or %s must be a BED or GTF file\n", path, path);
+        if (!AnnotDex.read(path))
+            die("Either %s.tidx must be a valid tidx indexed file, or %s must be a BED or GTF file\n", path, path);
     }
 
     UseAnnot=1;
 }
 
+// chunks are merged in genomic order, so the noise lists come out the same as a single pass
+void VarStatVisitor::Merge(PileupSubscriber &chunk) {
+    VarStatVisitor &x = (VarStatVisitor &) chunk;
+    tot_depth += x.tot_depth;
+    tot_locii += x.tot_locii;
+    num_reads += x.num_reads;
+    stats.insert(stats.end(), x.stats.begin(), x.stats.end());
+    ins_stats.insert(ins_stats.end(), x.ins_stats.begin(), x.ins_stats.end());
+    del_stats.insert(del_stats.end(), x.del_stats.begin(), x.del_stats.end());
+}
+
 void VarStatVisitor::Visit(PileupSummary &p) {
 	tot_locii += 1;
 
@@ -2125,9 +3312,9 @@ void VarStatVisitor::Visit(PileupSummary &p) {
 
 	tot_depth += p.Depth;
 	num_reads += p.NumReads;
-	stats.push_back(Noise(p.Base, p.Calls[1].base, p.Depth, noise, qnoise, mnqual));
-	ins_stats.push_back(Noise(p.Base, p.Calls[1].base, p.Depth, ins_noise, ins_qnoise, mnqual));
-	del_stats.push_back(Noise(p.Base, p.Calls[1].base, p.Depth, del_noise, del_qnoise, mnqual));
+	stats.push_back(Noise(p.Base, pbase, p.Depth, noise, qnoise, mnqual));
+	ins_stats.push_back(Noise(p.Base, pbase, p.Depth, ins_noise, ins_qnoise, mnqual));
+	del_stats.push_back(Noise(p.Base, pbase, p.Depth, del_noise, del_qnoise, mnqual));
 }
 
 
@@ -2154,6 +3341,7 @@ void usage(FILE *f) {
 "-G FLOAT    Minimum agreement (Weighted CV of positional variation) (0.25)\n"
 "-0          Zero out all filters, set e-value filter to 1, report everything\n"
 "-B          If running from a BAM, turn off BAQ correction (false)\n"
+"-t INT      Threads, splits indexed BAMs by reference (1)\n"
 "-R          Homopolymer repeat indel filtering (8)\n"
 "-e FLOAT    Alpha filter to use, requires -l or -S (.05)\n"
 "-g FLOAT    Global minimum error rate (default: assume phred is ok)\n"
@@ -2162,7 +3350,7 @@ void usage(FILE *f) {
 "-S FILE     Read in statistics and params from a previous run with -s (do this!)\n"
 "-A ANNOT    Calculate in-target stats using the annotation file (requires -o)\n"
 "-o PREFIX   Output prefix (works with -s or -v)\n"
-"-F files    List of file types to output (var, varsum, eav, vcf)\n"
+"-F files    List of file types to output (var, varsum, eav, vcf, cse, vcb)\n"
 "\n"
 "Extended Options\n"
 "\n"
@@ -2171,6 +3359,10 @@ void usage(FILE *f) {
 "--diversity|d FLOAT    Alias for -d\n"
 "--agreement|G FLOAT    Alias for -G\n"
 "--no-indels            Ignore all indels\n"
+"--chunk       INT      Also cut references into chunks of this many bases for -t, calls\n"
+"                       just past a cut use an estimated mean read length (whole references)\n"
+"--ref-2bit             Keep reference sequences in a 2-bit cache (uppercases, non-ACGT is N)\n"
+"--from-vcb    FILE     Convert a .vcb back to text, -o/-F pick the outputs (var to stdout without -o)\n"
 "\n"
 "Input files\n"
 "\n"
@@ -2186,6 +3378,7 @@ void usage(FILE *f) {
 "   PREFIX.eav         Variant calls in tab delimited 'ea-var' format\n"
 "   PREFIX.cse         Variant calls in tab delimited 'varprowl' format\n"
 "   PREFIX.vcf         Variant calls, in vcf format\n"
+"   PREFIX.vcb         Variant calls, columnar binary (replaces .var unless var is also in -F)\n"
 "   PREFIX.varsum      Summary of variant calls\n"
 "   PREFIX.tgt.var     On-target version of .var\n"
 "   PREFIX.tgt.cse     On-target version of .cse\n"
@@ -2229,8 +3422,8 @@ std::string string_format(const std::string &fmt, ...) {
 }
 
 void to_upper(const std::string str) {
-	static int i;
-    static char c;
+	int i;
+    char c;
 	for ( i=0;i<str.size();++i ) {
         c=((char *)(void *)str.data())[i];
 		if (c >= 'a' && c <= 'z') {
@@ -2340,46 +3533,23 @@ void check_ref_fai(const char * ref) {
     }
 
     if (!hasdata(string(ref)+".fai")) {
-        int ret=system(string_format("samtools faidx '%s'", ref).c_str());
-        if (ret) {
+        if (fai_build(ref)) {
             warn("Need a %s.fai file, run samtools faidx\n", ref);
             exit(1);
         }
     }
 }
 
-void Faidx::Load(const char *path) {
-    fa_f = openordie(path, "r");
-    FILE *fp = openordie(string_format("%s.fai", path).c_str(), "r");
-
-    char *buf = (char*)calloc(0x10000, 1);
-    char *p;
-    while (!feof(fp) && fgets(buf, 0x10000, fp)) {
-        for (p = buf; *p && isgraph(*p); ++p);
-        *p = 0; ++p;
-        Faient e;
-        sscanf(p, "%d%lld%d%d", &e.len, &e.offset, &e.line_blen, &e.line_len);
-        string chr = buf;
-        faimap[chr]=e;
-    }
-    free(buf);
-}
-
-bool Faidx::Fetch(char *buf, const Faient *ent, int pos_from, int pos_to) {
-    int len = (pos_to-pos_from+1);
-
-    if (fseek(fa_f, ent->offset + pos_from / ent->line_blen * ent->line_len + pos_from % ent->line_blen, SEEK_SET) == -1) {
-        return false;
-    }
-    int l = 0;
-    char c;
-    while (((c=fgetc(fa_f))!= EOF) && (l < len)) {
-        if (isgraph(c)) buf[l++] = c;
-    }
-    return l==len;
+// map the reference once, for everything that needs it
+void load_ref(const char * ref) {
+    if (faidx.is_open()) 
+        return;
+    if (!faidx.open(ref)) 
+        die("Can't load reference %s\n", ref);
+    if (ref_2bit) 
+        faidx.cache(threads+1);
 }
 
-
 PileupSubscriber::PileupSubscriber(PileupManager &man) {
     Manager = NULL; 
     SetManager(man);